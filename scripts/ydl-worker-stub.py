@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+#
+# Offline stand-in for ydl-worker.py, speaks the same protocol without
+# needing youtube-dl or network access.
+#
+# URLs containing "fail" return an error, "gone" an error for a removed
+# video, and URLs containing "crash" make the worker exit without
+# answering. YDLD_STUB_DELAY sets a per-request delay in seconds.
+#
+# YDLD_STUB_LIMIT simulates a throttling site; each host only takes that
+# many concurrent requests across all workers and answers any more with an
+# HTTP 429 error. Requests also slow down as the host gets busier.
+
+import fcntl
+import json
+import os
+import sys
+import tempfile
+import time
+import zlib
+from urllib.parse import urlparse
+
+DELAY = float(os.environ.get('YDLD_STUB_DELAY', '0'))
+LIMIT = int(os.environ.get('YDLD_STUB_LIMIT', '0'))
+STATE = os.environ.get('YDLD_STUB_STATE', os.path.join(tempfile.gettempdir(), 'ydld-stub'))
+
+
+def respond(*documents):
+    for document in documents:
+        sys.stdout.write(json.dumps(document))
+        sys.stdout.write('\n')
+    sys.stdout.flush()
+
+
+def fake_info(url):
+    video_id = '%08x' % zlib.crc32(url.encode('utf-8'))
+    return {
+        'id': video_id,
+        'title': 'Stub song ' + video_id,
+        'duration': 180,
+        'uploader': 'Stub Uploader',
+        'extractor': 'stub',
+        'extractor_key': 'Stub',
+        'webpage_url': url,
+        'original_url': url,
+        'thumbnail': 'http://localhost/' + video_id + '.jpg',
+        'formats': [
+            {
+                'format_id': '1',
+                'url': 'http://localhost/' + video_id + '.opus',
+                'ext': 'webm',
+                'acodec': 'opus',
+                'vcodec': 'none',
+                'abr': 160,
+                'http_headers': {'User-Agent': 'stub'},
+            },
+        ],
+    }
+
+
+def take_slot(host):
+    """Locks one of the host's LIMIT slots, shared between workers through
+    lock files. Returns the open slot and how many were already taken, or
+    None when the host is at its limit."""
+    os.makedirs(STATE, exist_ok=True)
+    taken = 0
+    slot = None
+    for i in range(LIMIT):
+        handle = open(os.path.join(STATE, '%s.%d.lock' % (host, i)), 'w')
+        try:
+            fcntl.flock(handle, fcntl.LOCK_EX | fcntl.LOCK_NB)
+        except BlockingIOError:
+            handle.close()
+            taken += 1
+            continue
+        if slot is None:
+            slot = handle
+        else:
+            handle.close()
+    return (slot, taken) if slot is not None else None
+
+
+def main():
+    for line in sys.stdin:
+        line = line.strip()
+        if not line:
+            continue
+
+        request = json.loads(line)
+        url = request.get('url', '')
+
+        slot = None
+        if LIMIT > 0:
+            slot = take_slot(urlparse(url).hostname or 'unknown')
+            if slot is None:
+                time.sleep(DELAY / 10)
+                respond({'id': request.get('id'), 'ok': False, 'error': 'ERROR: HTTP Error 429: Too Many Requests'})
+                continue
+            slot, taken = slot
+            time.sleep(DELAY * (1 + taken / LIMIT))
+            slot.close()
+        elif DELAY > 0:
+            time.sleep(DELAY)
+
+        if 'crash' in url:
+            sys.exit(1)
+        if 'gone' in url:
+            respond({'id': request.get('id'), 'ok': False, 'error': 'ERROR: Video unavailable. This video has been removed by the uploader'})
+            continue
+        if 'fail' in url:
+            respond({'id': request.get('id'), 'ok': False, 'error': 'ERROR: Stub failure for ' + url})
+            continue
+
+        respond({'id': request.get('id'), 'ok': True}, fake_info(url))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Persistent resolver worker for YoutubeDLd
+#
+# Loads yt-dlp (or youtube-dl) once and then resolves one URL per request.
+#
+# Protocol, one JSON document per line:
+#   < {"id": 1, "url": "https://...", "format": "bestaudio/best"}
+#   > {"id": 1, "ok": true}
+#   > {...info dict...}
+# or on failure:
+#   > {"id": 1, "ok": false, "error": "..."}
+#
+# The format spec is the one the daemon compiled from its configuration,
+# and picks the top-level url. The info dict is cut down to the fields
+# YoutubeDLd uses, with the formats that have audio left in for the daemon
+# to rank alternates from.
+
+import json
+import sys
+
+try:
+    import yt_dlp as ydl_module
+except ImportError:
+    import youtube_dl as ydl_module
+
+OPTIONS = {
+    'quiet': True,
+    'no_warnings': True,
+    'simulate': True,
+    'skip_download': True,
+    'noplaylist': True,
+    'cachedir': False,
+}
+DEFAULT_FORMAT = 'bestaudio/best'
+
+# Keep in sync with TRIMMED_TEMPLATE in YoutubeDL.cpp
+FIELDS = (
+    'title', 'duration', 'artist', 'creator', 'uploader', 'extractor', 'extractor_key',
+    'thumbnail', 'webpage_url', 'original_url', 'url', 'http_headers', 'acodec', 'vcodec', 'abr',
+)
+FORMAT_FIELDS = (
+    'url', 'acodec', 'vcodec', 'ext', 'protocol', 'abr', 'tbr',
+    'filesize', 'filesize_approx', 'http_headers', 'downloader_options',
+)
+
+
+def respond(*documents):
+    for document in documents:
+        sys.stdout.write(json.dumps(document, default=str))
+        sys.stdout.write('\n')
+    sys.stdout.flush()
+
+
+def pick(document, fields):
+    return {key: document[key] for key in fields if document.get(key) is not None}
+
+
+def trim(info):
+    trimmed = pick(info, FIELDS)
+
+    formats = [pick(f, FORMAT_FIELDS) for f in info.get('formats') or [] if f.get('acodec') != 'none']
+    if formats:
+        trimmed['formats'] = formats
+    elif not info.get('url'):
+        # Merged formats only carry their URLs in requested_formats
+        return info
+
+    return trimmed
+
+
+def downloader(ydls, spec):
+    """One YoutubeDL per format spec, the daemon only ever sends the one it
+    was configured with."""
+    if spec not in ydls:
+        ydls[spec] = ydl_module.YoutubeDL(dict(OPTIONS, format=spec))
+    return ydls[spec]
+
+
+def main():
+    ydls = {}
+
+    for line in sys.stdin:
+        line = line.strip()
+        if not line:
+            continue
+
+        request_id = None
+        try:
+            request = json.loads(line)
+            request_id = request.get('id')
+
+            ydl = downloader(ydls, request.get('format') or DEFAULT_FORMAT)
+            info = ydl.extract_info(request['url'], download=False)
+            if hasattr(ydl, 'sanitize_info'):
+                info = ydl.sanitize_info(info)
+
+            respond({'id': request_id, 'ok': True}, trim(info))
+        except Exception as ex:  # pylint: disable=broad-except
+            respond({'id': request_id, 'ok': False, 'error': str(ex)})
+
+
+if __name__ == '__main__':
+    main()
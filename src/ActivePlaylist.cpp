@@ -1,10 +1,18 @@
 #include "ActivePlaylist.hpp"
 #include "Server.hpp"
+#include "Util/AudioCache.hpp"
 #include "Util/GObjectSignalWrapper.hpp"
 #include "Util/Logging.hpp"
+#include "Util/Prefetcher.hpp"
+#include "Util/ResolverCache.hpp"
+#include "Util/WorkQueue.hpp"
+#include "Util/YoutubeDL.hpp"
 
+#include <algorithm>
 #include <random>
 
+#include <cmath>
+
 Gst::Structure structure_from_map(const std::string& type, const std::unordered_map<std::string, std::string>& umap)
 {
     auto ret = Gst::Structure(type);
@@ -14,13 +22,162 @@ Gst::Structure structure_from_map(const std::string& type, const std::unordered_
     return ret;
 }
 
-bool g_tempChange = false;
+// Songs that can't be played right now; failing ones, and playlists still being listed
+bool isUnplayable(const Playlist::Song* aSong)
+{
+    return aSong->isFailed() || aSong->Expanding;
+}
+
+Glib::RefPtr<Gst::Element> filterElement(const Glib::RefPtr<Gst::Element>& aPlaybin, const Glib::ustring& aName)
+{
+    Glib::RefPtr<Gst::Element> filter;
+    aPlaybin->get_property("audio-filter", filter);
+
+    auto bin = Glib::RefPtr<Gst::Bin>::cast_dynamic(filter);
+    if (!bin)
+        return {};
+    return bin->get_element(aName);
+}
+
+void setEnvelope(const Glib::RefPtr<Gst::Element>& aPlaybin, double aVolume)
+{
+    auto envelope = filterElement(aPlaybin, "envelope");
+    if (envelope)
+        envelope->set_property<double>("volume", aVolume);
+}
+
+// Errors from the audio output, rather than the song
+bool isSink(const Glib::RefPtr<Gst::Object>& aObject)
+{
+    return aObject && GST_IS_ELEMENT(aObject->gobj()) && GST_OBJECT_FLAG_IS_SET(aObject->gobj(), GST_ELEMENT_FLAG_SINK);
+}
+
+// Posted by the audio output with the silence it saw between two songs
+constexpr const char* TRANSITION_GAP = "transition-gap";
+
+// Watches the audio on its way out for a stream following another in the
+// same pipeline. The gap is any jump in running time between the two, plus
+// how late the new stream's first buffer came in. The audio sink's own
+// buffer covers some of that lateness, so it's an upper bound
+void watchTransitions(const Glib::RefPtr<Gst::Pad>& aPad)
+{
+    struct Watch
+    {
+        GstSegment Segment;
+        GstClockTime LastEnd;
+        bool NewStream;
+    };
+
+    auto* watch = new Watch{};
+    gst_segment_init(&watch->Segment, GST_FORMAT_TIME);
+    watch->LastEnd = GST_CLOCK_TIME_NONE;
+
+    auto probe = [](GstPad* aPad, GstPadProbeInfo* aInfo, gpointer aData) -> GstPadProbeReturn {
+        auto* watch = static_cast<Watch*>(aData);
+
+        if (GST_PAD_PROBE_INFO_TYPE(aInfo) & GST_PAD_PROBE_TYPE_BUFFER)
+        {
+            auto* buffer = GST_PAD_PROBE_INFO_BUFFER(aInfo);
+            auto start = gst_segment_to_running_time(&watch->Segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+            if (!GST_CLOCK_TIME_IS_VALID(start))
+                return GST_PAD_PROBE_OK;
+
+            if (watch->NewStream)
+            {
+                watch->NewStream = false;
+                GstClockTime gap = start > watch->LastEnd ? start - watch->LastEnd : 0;
+
+                auto* element = GST_PAD_PARENT(aPad);
+                auto* clock = gst_element_get_clock(element);
+                if (clock)
+                {
+                    auto now = gst_clock_get_time(clock) - gst_element_get_base_time(element);
+                    if (now > start)
+                        gap += now - start;
+                    gst_object_unref(clock);
+                }
+
+                gst_element_post_message(element, gst_message_new_application(GST_OBJECT(element),
+                    gst_structure_new(TRANSITION_GAP, "gap", G_TYPE_UINT64, guint64(gap), nullptr)));
+            }
+
+            watch->LastEnd = start + (GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0);
+            return GST_PAD_PROBE_OK;
+        }
+
+        auto* event = GST_PAD_PROBE_INFO_EVENT(aInfo);
+        switch (event ? GST_EVENT_TYPE(event) : GST_EVENT_UNKNOWN)
+        {
+        case GST_EVENT_SEGMENT:
+            gst_event_copy_segment(event, &watch->Segment);
+            break;
+
+        case GST_EVENT_STREAM_START:
+            watch->NewStream = GST_CLOCK_TIME_IS_VALID(watch->LastEnd);
+            break;
+
+        // Seeks aren't one song following another
+        case GST_EVENT_FLUSH_STOP:
+            watch->LastEnd = GST_CLOCK_TIME_NONE;
+            watch->NewStream = false;
+            break;
+
+        default:
+            break;
+        }
+        return GST_PAD_PROBE_OK;
+    };
+
+    gst_pad_add_probe(aPad->gobj(), GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+        probe, watch, [](gpointer aData) { delete static_cast<Watch*>(aData); });
+}
+
+// How long before an overlap the next song starts opening
+const std::chrono::seconds FADE_PREROLL(10);
+
+bool isCached(const Playlist::Song& aSong)
+{
+    return !aSong.isLocal() && !AudioCache::getSingleton().find(aSong.URL).empty();
+}
+
+std::string playbackUri(const Playlist::Song& aSong)
+{
+    return AudioCache::getSingleton().playbackUri(aSong.URL, aSong.DataURL, aSong.isLocal());
+}
 
 ActivePlaylist::ActivePlaylist()
-    : m_server(nullptr)
+    : Playlist()
+    , m_server(nullptr)
     , m_playFlags(0)
     , m_currentSong(nullptr)
-    , Playlist()
+    , m_roundSeed(std::random_device()())
+    , m_recovering(false)
+    , m_reresolving(false)
+    , m_reresolved(false)
+    , m_recoveryTarget(Gst::STATE_NULL)
+    , m_recoveryTimeout(20000)
+    , m_recoveryStats{}
+    , m_changeState(Change_Idle)
+    , m_changeTarget(Gst::STATE_NULL)
+    , m_gaplessLead(30)
+    , m_measureGap(false)
+    , m_measureHandover(false)
+    , m_measureFade(false)
+    , m_transitionStats{}
+    , m_prefetchDepth(2)
+    , m_measureStart(false)
+    , m_startCached(false)
+    , m_startStats{}
+    , m_fadeState(Fade_Idle)
+    , m_fadeSongID(0)
+    , m_fadeRamp(true)
+    , m_fadeUnavailable(false)
+    , m_fadeDuration(0)
+    , m_crossfade(0)
+    , m_mixRampDb(0)
+    , m_mixRampDelay(NAN)
+    , m_windowSize(3)
+    , m_windowDirty(true)
 {
 }
 
@@ -28,12 +185,32 @@ void ActivePlaylist::init(Server& aServer)
 {
     m_server = &aServer;
 
-    m_playbin = Gst::ElementFactory::create_element("playbin");
-    // m_playbin->set_property("audio-sink", Gst::ElementFactory::create_element("autoaudiosink"));
-    // m_playbin->set_property("video-sink", Gst::ElementFactory::create_element("fakesink"));
+    m_playbin = _createPlaybin();
+    m_fadePlaybin = _createPlaybin();
+
+    m_windowSize = m_server->getConfig().getValueConv<uint32_t>("Resolver/Window", 3);
+    m_recoveryTimeout = std::chrono::milliseconds(uint32_t(m_server->getConfig().getValueConv<double>("Playback/RecoveryTimeout", 20) * 1000));
+    m_gaplessLead = std::chrono::seconds(m_server->getConfig().getValueConv<uint32_t>("Playback/GaplessLead", 30));
+    m_crossfade = std::chrono::seconds(m_server->getConfig().getValueConv<uint32_t>("Playback/Crossfade", 0));
+    m_prefetchDepth = m_server->getConfig().getValueConv<uint32_t>("Playback/Prefetch", 2);
+    m_prefetcher.setMaxSize(m_server->getConfig().getValueConv<uint64_t>("Playback/PrefetchMaxSize", 16 * 1024 * 1024));
+
+    // Prefetched songs go into the audio cache, which is off by default
+    if (m_prefetchDepth > 0 && !AudioCache::getSingleton().isOpen())
+        Util::Log(m_server->getConfig().hasValue("Playback/Prefetch") ? Util::Log_Warning : Util::Log_Info) << "[Prefetch] Not prefetching, it needs the audio cache (Cache/Audio)";
+
+    m_changeDispatcher = std::make_unique<Glib::Dispatcher>();
+    m_changeDispatcher->connect(sigc::mem_fun(*this, &ActivePlaylist::_advanceChange));
+}
+
+Glib::RefPtr<Gst::Element> ActivePlaylist::_createPlaybin()
+{
+    auto playbin = Gst::ElementFactory::create_element("playbin");
+    // playbin->set_property("audio-sink", Gst::ElementFactory::create_element("autoaudiosink"));
+    // playbin->set_property("video-sink", Gst::ElementFactory::create_element("fakesink"));
 
     int flags;
-    m_playbin->get_property("flags", flags);
+    playbin->get_property("flags", flags);
 
     flags |= Gst::PLAY_FLAG_AUDIO;
 
@@ -44,22 +221,58 @@ void ActivePlaylist::init(Server& aServer)
     if (m_server->getConfig().getValueConv("Cache/Enabled", false))
         flags |= Gst::PLAY_FLAG_DOWNLOAD;
     if (m_server->getConfig().hasValue("Cache/MaxSize"))
-        m_playbin->set_property("ring-buffer-max-size", m_server->getConfig().getValueConv<uint64_t>("Cache/MaxSize"));
+        playbin->set_property("ring-buffer-max-size", m_server->getConfig().getValueConv<uint64_t>("Cache/MaxSize"));
+
+    playbin->set_property("flags", flags);
 
-    m_playbin->set_property("flags", flags);
+    // The envelope does the fades, separate from the user volume. The level
+    // only reports in while MixRamp needs it
+    auto filter = Gst::Bin::create();
+    auto level = Gst::ElementFactory::create_element("level", "level");
+    auto envelope = Gst::ElementFactory::create_element("volume", "envelope");
+    level->set_property("post-messages", false);
+    filter->add(level)->add(envelope);
+    level->link(envelope);
+    filter->add_pad(Gst::GhostPad::create(level->get_static_pad("sink"), "sink"));
+    filter->add_pad(Gst::GhostPad::create(envelope->get_static_pad("src"), "src"));
+    playbin->set_property("audio-filter", filter);
+    watchTransitions(envelope->get_static_pad("src"));
 
-    m_playbin->get_bus()->add_watch(sigc::mem_fun(*this, &ActivePlaylist::on_bus_message));
+    playbin->get_bus()->add_watch(sigc::mem_fun(*this, &ActivePlaylist::on_bus_message));
 
     signal_callback<void()> signal_wrapper;
-    signal_wrapper("about-to-finish", m_playbin).connect(sigc::mem_fun(*this, &ActivePlaylist::on_about_to_finish));
+    signal_wrapper("about-to-finish", playbin).connect(sigc::bind(sigc::mem_fun(*this, &ActivePlaylist::on_about_to_finish), playbin.operator->()));
 
     signal_callback<void(const Glib::RefPtr<Gst::Element>&)> source_setup_wrapper;
-    source_setup_wrapper("source-setup", m_playbin).connect(sigc::mem_fun(*this, &ActivePlaylist::on_source_setup));
+    source_setup_wrapper("source-setup", playbin).connect(sigc::bind(sigc::mem_fun(*this, &ActivePlaylist::on_source_setup), playbin.operator->()));
+
+    return playbin;
 }
 
 void ActivePlaylist::update()
 {
+    if (m_windowDirty)
+        _updateWindow();
+
+    // Entries of playlists being listed are added as they come in
+    auto songCount = size();
     Playlist::update();
+    if (size() != songCount)
+        m_server->pushEvent(Protocols::Event(Protocols::Event_QueueChange));
+
+    // Pick the current song back up once it has new streams, or move on if it didn't get any
+    if (m_reresolving && m_currentSong && !m_currentSong->UpdateTask.valid())
+    {
+        m_reresolving = false;
+        if (m_currentSong->DataURL.empty())
+            _abandonRecovery("no new streams");
+        else
+            _restartSource();
+    }
+    if (m_recovering && std::chrono::steady_clock::now() - m_recoveryStart > m_recoveryTimeout)
+        _abandonRecovery("took too long");
+    if (m_changeState == Change_Resolving)
+        _advanceChange();
 
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
@@ -72,6 +285,9 @@ void ActivePlaylist::update()
         if (m_playbin->query_position(fmt, pos))
             m_currentSongPos = std::chrono::nanoseconds(pos);
     }
+
+    _prepareUpcoming();
+    _prefetchUpcoming();
 }
 Glib::RefPtr<Gst::Element> ActivePlaylist::getPipeline() const
 {
@@ -97,6 +313,12 @@ void ActivePlaylist::play()
 {
     Util::Log(Util::Log_Debug) << "Play()";
 
+    if (m_changeState == Change_Resolving)
+    {
+        m_changeTarget = Gst::STATE_PLAYING;
+        return;
+    }
+
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
 
@@ -116,10 +338,36 @@ void ActivePlaylist::play()
 }
 void ActivePlaylist::stop()
 {
+    m_measureGap = m_measureHandover = m_measureFade = false;
+    m_measureStart = false;
+    m_changeState = Change_Idle;
+    m_changeTarget = Gst::STATE_NULL;
+    m_changeTask = std::shared_future<bool>();
+    _stopFade();
     m_playbin->set_state(Gst::STATE_NULL);
 }
 void ActivePlaylist::pause()
 {
+    // A start that's held up by hand doesn't say anything about latency
+    m_measureStart = false;
+
+    if (m_changeState == Change_Resolving)
+    {
+        m_changeTarget = Gst::STATE_PAUSED;
+        m_server->pushEvent(Protocols::Event(Protocols::Event_StateChange));
+        return;
+    }
+
+    // The old song would keep playing on its own
+    if (m_fadeState == Fade_Fading)
+        _stopFade();
+    // The stream is being brought back paused already, it stays that way
+    if (m_recovering)
+    {
+        m_recoveryTarget = Gst::STATE_PAUSED;
+        m_server->pushEvent(Protocols::Event(Protocols::Event_StateChange));
+        return;
+    }
     m_playbin->set_state(Gst::STATE_PAUSED);
 }
 void ActivePlaylist::resume()
@@ -127,6 +375,20 @@ void ActivePlaylist::resume()
     if (!m_currentSong)
         return play();
 
+    if (m_changeState == Change_Resolving)
+    {
+        m_changeTarget = Gst::STATE_PLAYING;
+        m_server->pushEvent(Protocols::Event(Protocols::Event_StateChange));
+        return;
+    }
+    // Playing now would start from the top, before the seek back
+    if (m_recovering)
+    {
+        m_recoveryTarget = Gst::STATE_PLAYING;
+        m_server->pushEvent(Protocols::Event(Protocols::Event_StateChange));
+        return;
+    }
+
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
 
@@ -139,6 +401,8 @@ void ActivePlaylist::next()
 {
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
+    if (m_changeState == Change_Resolving)
+        state = m_changeTarget;
 
     changeSong(nextSong(m_currentSong), state);
 }
@@ -146,6 +410,8 @@ void ActivePlaylist::previous()
 {
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
+    if (m_changeState == Change_Resolving)
+        state = m_changeTarget;
 
     changeSong(previousSong(m_currentSong), state);
 }
@@ -162,6 +428,7 @@ void ActivePlaylist::removeSong(const std::string& aSearch)
     auto it = std::find_if(m_playQueue.begin(), m_playQueue.end(), [aSearch](auto* aSong) { return aSong->URL == aSearch || aSong->Title == aSearch; });
     if (it != m_playQueue.end())
         m_playQueue.erase(it);
+    m_windowDirty = true;
     if (*it == m_currentSong)
     {
         if (m_playQueue.empty())
@@ -180,6 +447,7 @@ void ActivePlaylist::removeSong(size_t aSong)
     auto it = std::find_if(m_playQueue.begin(), m_playQueue.end(), [id](auto* aSong) { return aSong->ID == id; });
     if (it != m_playQueue.end())
         m_playQueue.erase(it);
+    m_windowDirty = true;
     if (*it == m_currentSong)
     {
         if (m_playQueue.empty())
@@ -197,6 +465,7 @@ void ActivePlaylist::removeSongID(size_t aID)
     auto it = std::find_if(m_playQueue.begin(), m_playQueue.end(), [aID](auto* aSong) { return aSong->ID == aID; });
     if (it != m_playQueue.end())
         m_playQueue.erase(it);
+    m_windowDirty = true;
     if (*it == m_currentSong)
     {
         if (m_playQueue.empty())
@@ -232,6 +501,10 @@ PlayStatus ActivePlaylist::getStatus() const
     Gst::State state, pending;
     m_playbin->get_state(state, pending, {});
 
+    // A song still resolving counts as what it's going to be
+    if (m_changeState == Change_Resolving)
+        state = m_changeTarget;
+
     switch(state)
     {
     case Gst::STATE_PAUSED:
@@ -312,6 +585,7 @@ void ActivePlaylist::setRepeat(bool aRepeat)
         m_playFlags |= uint8_t(PF_Repeat);
     else
         m_playFlags &= uint8_t(~PF_Repeat);
+    m_windowDirty = true;
     m_server->pushEvent(Protocols::Event(Protocols::Event_OptionChange));
 }
 SingleStatus ActivePlaylist::hasSingle() const
@@ -364,14 +638,74 @@ void ActivePlaylist::setVolume(float aVolume)
 {
     aVolume = std::min(std::max(aVolume, 0.f), 1.f);
     m_playbin->set_property<double>("volume", aVolume);
+    m_fadePlaybin->set_property<double>("volume", aVolume);
     m_server->pushEvent(Protocols::Event(Protocols::Event_VolumeChange));
 }
 
+std::chrono::seconds ActivePlaylist::getCrossfade() const
+{
+    return m_crossfade;
+}
+void ActivePlaylist::setCrossfade(std::chrono::seconds aDuration)
+{
+    m_crossfade = std::max(aDuration, std::chrono::seconds(0));
+    if (m_crossfade.count() == 0 && m_fadeState == Fade_Prerolling)
+        _stopFade();
+    if (m_crossfade.count() > 0 && m_fadeUnavailable)
+        Util::Log(Util::Log_Warning) << "[Crossfade] Not fading, the audio output can't be opened twice";
+    m_server->pushEvent(Protocols::Event(Protocols::Event_OptionChange));
+}
+float ActivePlaylist::getMixRampDb() const
+{
+    return m_mixRampDb;
+}
+void ActivePlaylist::setMixRampDb(float aDb)
+{
+    m_mixRampDb = aDb;
+    m_server->pushEvent(Protocols::Event(Protocols::Event_OptionChange));
+}
+float ActivePlaylist::getMixRampDelay() const
+{
+    return m_mixRampDelay;
+}
+void ActivePlaylist::setMixRampDelay(float aDelay)
+{
+    m_mixRampDelay = aDelay < 0 ? NAN : aDelay;
+    m_mixRampAt = {};
+
+    // Levels only get posted to the bus while MixRamp uses them
+    bool mixRamp = !std::isnan(m_mixRampDelay);
+    for (auto& playbin : { m_playbin, m_fadePlaybin })
+    {
+        auto level = filterElement(playbin, "level");
+        if (level)
+            level->set_property("post-messages", mixRamp);
+    }
+    m_server->pushEvent(Protocols::Event(Protocols::Event_OptionChange));
+}
+
 bool ActivePlaylist::isLive() const
 {
     return (m_playFlags & PF_Live) != 0;
 }
 
+const RecoveryStats& ActivePlaylist::getRecoveryStats() const
+{
+    return m_recoveryStats;
+}
+const TransitionStats& ActivePlaylist::getTransitionStats() const
+{
+    return m_transitionStats;
+}
+const StartStats& ActivePlaylist::getStartStats() const
+{
+    return m_startStats;
+}
+const Prefetcher::Stats& ActivePlaylist::getPrefetchStats() const
+{
+    return m_prefetcher.getStats();
+}
+
 bool ActivePlaylist::changeSong(const Song* aSong, Gst::State aState)
 {
     if (aSong)
@@ -379,12 +713,44 @@ bool ActivePlaylist::changeSong(const Song* aSong, Gst::State aState)
     else
         Util::Log(Util::Log_Debug) << "ChangeSong(null" << ", " << aState << ")";
 
+    _stopFade();
+    _setCurrentSong(aSong);
+    m_measureHandover = m_measureFade = false;
+    {
+        // Whatever was lined up to follow the old song doesn't anymore
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        m_handedOver.reset();
+    }
+
+    // Anything still resolving is picked up from the main loop when it's
+    // done, the old song stops so it isn't heard over the new one
+    if (m_currentSong && m_currentSong->UpdateTask.valid() && !isCached(*m_currentSong))
+    {
+        Util::Log(Util::Log_Debug) << "- Task is available, playing when it finishes";
+        m_changeState = Change_Resolving;
+        m_changeTarget = aState;
+        m_changeTask = m_currentSong->UpdateTask;
+        m_changeStart = std::chrono::steady_clock::now();
+        m_playbin->set_state(Gst::STATE_READY);
+
+        m_server->pushEvent(Protocols::Event(Protocols::Event_QueueChange));
+        return true;
+    }
+
+    m_changeTarget = aState;
+    m_changeStart = std::chrono::steady_clock::now();
+    return _startSong();
+}
+
+void ActivePlaylist::_setCurrentSong(const Song* aSong)
+{
     if (m_currentSong)
     {
         Util::Log(Util::Log_Debug) << "- resetting current song (" << m_currentSong->URL << ")";
 
         if (hasConsume())
         {
+            _cancelUpdate(*m_currentSong);
             m_playQueue.erase(std::find(m_playQueue.begin(), m_playQueue.end(), m_currentSong));
             m_songs.erase(std::find_if(m_songs.begin(), m_songs.end(), [this](auto& it) { return m_currentSong == &it; }));
 
@@ -399,6 +765,16 @@ bool ActivePlaylist::changeSong(const Song* aSong, Gst::State aState)
     }
 
     m_currentSong = const_cast<Song*>(aSong);
+    m_windowDirty = true;
+    m_recovering = m_reresolving = m_reresolved = false;
+    // Until the pipeline reports them, an error would otherwise resume at the
+    // old song's position, and a fade start by the old song's length
+    m_currentSongPos = std::chrono::nanoseconds(0);
+    m_currentSongDur = m_currentSong ? m_currentSong->Duration : std::chrono::nanoseconds(0);
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        m_upcoming.reset();
+    }
 
     if (m_currentSong)
     {
@@ -408,51 +784,57 @@ bool ActivePlaylist::changeSong(const Song* aSong, Gst::State aState)
 
         Util::Log(Util::Log_Debug) << "- setting up new song (" << m_currentSong->URL << ")";
 
-        if (!m_currentSong->UpdateTask.valid() && m_currentSong->NextUpdateTime >= std::chrono::system_clock::now())
-            _queueUpdateSong(*m_currentSong);
+        // Moves the resolve window along, which also refreshes the new song
+        // if its stream is missing or about to run out
+        _updateWindow();
+    }
+}
+
+bool ActivePlaylist::_startSong()
+{
+    m_changeState = Change_Idle;
+    m_changeTask = std::shared_future<bool>();
+    auto state = m_changeTarget;
 
-        // Wait for the current song update to finish before playing it
-        // TODO: timeout and handle that correctly
-        if (m_currentSong->UpdateTask.valid())
+    if (m_currentSong)
+    {
+        // Don't try to play the page itself, move on to something that works
+        if (isUnplayable(m_currentSong))
         {
-            auto task = m_currentSong->UpdateTask;
-            Util::Log(Util::Log_Debug) << "- Task is available, waiting for it";
-            task.wait();
-            Util::Log(Util::Log_Debug) << "- Task finished";
+            Util::Log(Util::Log_Warning) << "[Song] Skipping " << m_currentSong->URL << ", it can't be played yet";
+            return changeSong(nextSong(m_currentSong), state);
         }
 
-        auto uri = m_currentSong->DataURL;
-        if (uri.empty())
-            uri = m_currentSong->URL;
-
-        Gst::State state, pending;
-        m_playbin->get_state(state, pending, {});
+        auto uri = playbackUri(*m_currentSong);
+        if (m_currentSong->isExpired() && uri == m_currentSong->DataURL)
+            Util::Log(Util::Log_Warning) << "[Song] Stream URL for " << m_currentSong->URL << " has expired and could not be refreshed";
 
-        if (state == Gst::STATE_PLAYING)
+        // Taking the pipeline down first makes the new uri apply right away,
+        // instead of after whatever is still queued up of the old stream
+        Util::Log(Util::Log_Debug) << "- Playing (" << uri << ")";
+        m_playbin->set_state(Gst::STATE_READY);
         {
-            Util::Log(Util::Log_Debug) << "- Playing (" << uri << ")";
-            Util::Log(Util::Log_Debug) << "- Sending EOS";
-            g_tempChange = true;
-            m_playbin->send_event(Gst::EventEos::create());
-            m_playbin->set_property("uri", Glib::ustring(uri));
-        }
-        else
-        {
-            Util::Log(Util::Log_Debug) << "- Playing (" << uri << ")";
-            m_playbin->set_property("uri", Glib::ustring(uri));
+            std::lock_guard<std::mutex> _lock(m_sourceMutex);
+            m_source = { m_currentSong->URL, m_currentSong->DataHeaders };
         }
+        m_playbin->set_property("uri", Glib::ustring(uri));
+
+        m_measureStart = state == Gst::STATE_PLAYING;
+        m_startCached = !m_currentSong->isLocal() && uri.compare(0, 7, "file://") == 0;
     }
-    else if (aState == Gst::STATE_PLAYING)
-        aState = Gst::STATE_READY;
+    else if (state == Gst::STATE_PLAYING)
+        state = Gst::STATE_READY;
 
     if (!m_currentSong)
         m_playbin->set_state(Gst::STATE_NULL);
 
-    auto ret = m_playbin->set_state(aState);
+    auto ret = m_playbin->set_state(state);
     if (ret == Gst::STATE_CHANGE_NO_PREROLL)
         m_playFlags |= PF_Live;
     else
         m_playFlags &= ~PF_Live;
+    if (ret == Gst::STATE_CHANGE_ASYNC)
+        m_changeState = Change_Prerolling;
 
     m_server->pushEvent(Protocols::Event(Protocols::Event_QueueChange));
 
@@ -466,33 +848,100 @@ bool ActivePlaylist::changeSong(const Song* aSong, Gst::State aState)
     return true;
 }
 
+void ActivePlaylist::_advanceChange()
+{
+    if (m_changeState != Change_Resolving)
+        return;
+
+    // The resolve is killed at the timeout, but may have queued for a bit
+    bool ready = m_changeTask.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    if (!ready)
+    {
+        auto timeout = YoutubeDL::getSingleton().getTimeout();
+        if (timeout.count() == 0 || std::chrono::steady_clock::now() - m_changeStart < timeout + std::chrono::seconds(5))
+            return;
+
+        Util::Log(Util::Log_Warning) << "[Song] Gave up waiting for " << m_currentSong->URL << " to resolve";
+    }
+
+    Util::Log(Util::Log_Debug) << "- Task finished after " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_changeStart).count() << "ms";
+    _startSong();
+}
+
 const Playlist::Song* ActivePlaylist::nextSong(const Song* aCurSong)
 {
     if (m_songs.empty())
         return nullptr;
     else if (m_playQueue.empty() && !hasRepeat())
         return nullptr;
-    else if (hasRepeat())
-    {
-        resetQueue();
-        if (hasRandom())
-            shuffleQueue();
-    }
+    else if (m_playQueue.empty())
+        _startRound();
 
-    auto curSongIt = std::find(m_playQueue.begin(), m_playQueue.end(), aCurSong);
-    // Should hopefully never happen, but let's be on the safe side
-    if (curSongIt == m_playQueue.end())
-        curSongIt = m_playQueue.begin();
+    auto* next = _peekNextSong(aCurSong);
+    if (next && _wrapsTo(aCurSong, next))
+        _startRound();
+    return next;
+}
 
-    auto nextSongIt = curSongIt + 1;
-    if (nextSongIt == m_playQueue.end())
-    {
-        if (hasRepeat())
-            return m_playQueue.front();
-        return nullptr;
-    }
+const Playlist::Song* ActivePlaylist::_peekNextSong(const Song* aCurSong) const
+{
+    auto upcoming = _upcomingSongs(aCurSong, 1);
+    return upcoming.empty() ? nullptr : upcoming.front();
+}
 
-    return *nextSongIt;
+std::vector<const Playlist::Song*> ActivePlaylist::_upcomingSongs(const Song* aCurSong, size_t aCount) const
+{
+    std::vector<const Song*> songs;
+    if (m_playQueue.empty() || aCount == 0)
+        return songs;
+
+    // Should hopefully never be missing, but let's be on the safe side
+    auto it = std::find(m_playQueue.begin(), m_playQueue.end(), aCurSong);
+    it = it == m_playQueue.end() ? m_playQueue.begin() : it + 1;
+
+    // Songs that can't be played are skipped right away
+    for (; it != m_playQueue.end() && songs.size() < aCount; ++it)
+        if (!isUnplayable(*it))
+            songs.push_back(*it);
+
+    // Repeat carries on into the next round, in the order it will really have
+    if (songs.size() < aCount && hasRepeat())
+        for (auto* song : _nextRound())
+        {
+            if (songs.size() >= aCount)
+                break;
+            if (!isUnplayable(song))
+                songs.push_back(song);
+        }
+
+    return songs;
+}
+
+std::deque<Playlist::Song*> ActivePlaylist::_nextRound() const
+{
+    std::deque<Song*> round;
+    for (auto& song : m_songs)
+        round.push_back(const_cast<Song*>(&song));
+
+    // Seeded, so every look ahead sees the same order until the round starts
+    if (hasRandom())
+        std::shuffle(round.begin(), round.end(), std::mt19937(m_roundSeed));
+    return round;
+}
+
+bool ActivePlaylist::_wrapsTo(const Song* aCurSong, const Song* aNext) const
+{
+    auto cur = std::find(m_playQueue.begin(), m_playQueue.end(), aCurSong);
+    if (cur == m_playQueue.end())
+        return false;
+    return std::find(cur + 1, m_playQueue.end(), aNext) == m_playQueue.end();
+}
+
+void ActivePlaylist::_startRound()
+{
+    m_playQueue = _nextRound();
+    m_roundSeed = std::random_device()();
+    m_windowDirty = true;
 }
 
 const Playlist::Song* ActivePlaylist::previousSong(const Song* aCurSong)
@@ -501,31 +950,37 @@ const Playlist::Song* ActivePlaylist::previousSong(const Song* aCurSong)
         return nullptr;
     else if (m_playQueue.empty() && !hasRepeat())
         return nullptr;
-    else if (hasRepeat())
-    {
-        resetQueue();
-        if (hasRandom())
-            shuffleQueue();
-    }
+    else if (m_playQueue.empty())
+        _startRound();
 
     auto curSongIt = std::find(m_playQueue.begin(), m_playQueue.end(), aCurSong);
     // Should hopefully never happen, but let's be on the safe side
     if (curSongIt == m_playQueue.begin())
         curSongIt = m_playQueue.end() - 1;
 
-    auto nextSongIt = curSongIt - 1;
-    if (nextSongIt == m_playQueue.begin())
+    auto nextSongIt = curSongIt;
+    for (size_t i = 0; i < m_playQueue.size(); ++i)
     {
-        if (hasRepeat())
-            return m_playQueue.back();
-        return nullptr;
+        if (--nextSongIt == m_playQueue.begin())
+        {
+            if (!hasRepeat())
+                return nullptr;
+            nextSongIt = m_playQueue.end() - 1;
+        }
+
+        if (!isUnplayable(*nextSongIt))
+            return *nextSongIt;
     }
 
-    return *nextSongIt;
+    return nullptr;
 }
 
-bool ActivePlaylist::on_bus_message(const Glib::RefPtr<Gst::Bus>& /* aBus */, const Glib::RefPtr<Gst::Message>& aMessage)
+bool ActivePlaylist::on_bus_message(const Glib::RefPtr<Gst::Bus>& aBus, const Glib::RefPtr<Gst::Message>& aMessage)
 {
+    // The other pipeline only matters to the fade itself
+    if (aBus == m_fadePlaybin->get_bus())
+        return _onFadeMessage(aMessage);
+
     switch(aMessage->get_message_type())
     {
     case Gst::MESSAGE_BUFFERING:
@@ -569,10 +1024,87 @@ bool ActivePlaylist::on_bus_message(const Glib::RefPtr<Gst::Bus>& /* aBus */, co
             if ((newState == Gst::STATE_PLAYING && oldState <= Gst::STATE_PAUSED) ||
                 (newState == Gst::STATE_PAUSED && oldState >= Gst::STATE_PLAYING))
                 m_server->pushEvent(Protocols::Event(Protocols::Event_StateChange));
+
+            if (newState == Gst::STATE_PLAYING && m_measureGap)
+            {
+                m_measureGap = false;
+                _recordGap(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_streamEnd));
+            }
+            // Overlapping songs have no gap, unless the old one ran out before the new one played
+            if (newState == Gst::STATE_PLAYING && m_measureFade)
+            {
+                m_measureFade = false;
+                auto gap = std::chrono::milliseconds(0);
+                if (m_fadeOutEnd != std::chrono::steady_clock::time_point())
+                    gap = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_fadeOutEnd);
+                _recordGap(gap);
+            }
+            if (newState == Gst::STATE_PLAYING && m_measureStart)
+            {
+                m_measureStart = false;
+                _recordStart(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_changeStart));
+            }
             Util::Log(Util::Log_Debug) << "State change for " << std::string(msg->get_source()->get_name()) << "(" << (msg->get_source() == m_playbin) << "): " << oldState << " -> " << newState << " (-> " << pendingState << ")";
         }
         break;
 
+    case Gst::MESSAGE_ASYNC_DONE:
+        {
+            if (aMessage->get_source() != m_playbin)
+                break;
+
+            if (m_changeState == Change_Prerolling)
+            {
+                m_changeState = Change_Idle;
+                Util::Log(Util::Log_Debug) << "- Prerolled after " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_changeStart).count() << "ms";
+            }
+            else if (m_recovering && !m_reresolving)
+                _finishRecovery();
+        }
+        break;
+
+    case Gst::MESSAGE_STREAM_START:
+        {
+            if (aMessage->get_source() == m_playbin)
+                _switchToUpcoming();
+        }
+        break;
+
+    case Gst::MESSAGE_EOS:
+        {
+            if (aMessage->get_source() != m_playbin)
+                break;
+
+            // Nothing was ready in time for a gapless switch, so start the next song the slow way
+            Util::Log(Util::Log_Debug) << "End of stream, calling next.";
+            m_streamEnd = std::chrono::steady_clock::now();
+            _finishedStream();
+            m_measureGap = m_currentSong && m_changeTarget == Gst::STATE_PLAYING;
+        }
+        break;
+
+    case Gst::MESSAGE_ELEMENT:
+        {
+            auto structure = aMessage->get_structure();
+            if (structure && structure.get_name() == "level")
+                _measuredLevel(structure);
+        }
+        break;
+
+    case Gst::MESSAGE_APPLICATION:
+        {
+            auto structure = aMessage->get_structure();
+            if (!structure || structure.get_name() != TRANSITION_GAP || !m_measureHandover)
+                break;
+
+            // Only the first stream after a handover is a song following another
+            m_measureHandover = false;
+            guint64 gap = 0;
+            gst_structure_get_uint64(structure.gobj(), "gap", &gap);
+            _recordGap(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(gap)));
+        }
+        break;
+
     case Gst::MESSAGE_CLOCK_LOST:
         {
             Util::Log(Util::Log_Debug) << "Resetting clock";
@@ -607,8 +1139,18 @@ bool ActivePlaylist::on_bus_message(const Glib::RefPtr<Gst::Bus>& /* aBus */, co
         {
             auto errMsg = Glib::RefPtr<Gst::MessageError>::cast_static(aMessage);
 
-            Util::Log(Util::Log_Error) << "Error: " << errMsg->parse_error().what().raw();
+            auto error = errMsg->parse_error();
+            Util::Log(Util::Log_Error) << "Error: " << error.what().raw();
             Util::Log(Util::Log_Error) << errMsg->parse_debug();
+
+            // Forbidden, gone or cut off streams; another format may still work.
+            // A stream cut off mid-song usually fails in the demuxer or decoder
+            bool streamFailed = error.domain() == GST_RESOURCE_ERROR || error.domain() == GST_STREAM_ERROR;
+            if (streamFailed && m_currentSong && !m_currentSong->isLocal())
+            {
+                if (!_failoverSource())
+                    _abandonRecovery(error.what().raw());
+            }
         }
         break;
 
@@ -635,17 +1177,35 @@ bool ActivePlaylist::on_bus_message(const Glib::RefPtr<Gst::Bus>& /* aBus */, co
     return true;
 }
 
-void ActivePlaylist::on_about_to_finish()
+void ActivePlaylist::on_about_to_finish(Gst::Element* aPlaybin)
 {
-    if (g_tempChange)
+    // Runs on a streaming thread, which mustn't touch the queue or wait for a
+    // resolve. The uri has to be set before returning for the switch to be gapless
+    Glib::ustring uri;
     {
-        Util::Log(Util::Log_Debug) << "About to finish after song change.";
-        g_tempChange = false;
-        return;
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        // A song fading out is followed by the one fading in already
+        if (aPlaybin != m_playbin.operator->())
+            return;
+        if (!m_upcoming)
+        {
+            Util::Log(Util::Log_Debug) << "About to finish current stream, nothing ready to follow it.";
+            return;
+        }
+
+        uri = m_upcoming->URI;
+        m_source = m_upcoming->Origin;
+        m_handedOver = std::move(m_upcoming);
+        m_upcoming.reset();
     }
 
-    Util::Log(Util::Log_Debug) << "About to finish current stream, calling next.";
+    // m_playbin may have been swapped by a fade since, this one was checked under the lock
+    Util::Log(Util::Log_Debug) << "About to finish current stream, queueing (" << uri.raw() << ")";
+    aPlaybin->set_property("uri", uri);
+}
 
+void ActivePlaylist::_finishedStream()
+{
     if (hasSingle() > Single_False)
     {
         if (hasSingle() == Single_Oneshot)
@@ -660,17 +1220,469 @@ void ActivePlaylist::on_about_to_finish()
         changeSong(nextSong(m_currentSong), Gst::STATE_PLAYING);
 }
 
-void ActivePlaylist::on_source_setup(const Glib::RefPtr<Gst::Element>& aSource)
+void ActivePlaylist::on_source_setup(const Glib::RefPtr<Gst::Element>& aSource, Gst::Element* aPlaybin)
 {
-    Util::Log(Util::Log_Debug) << "Setting up source of type " << aSource->get_name().raw();
+    // The element name is only "source", the factory tells what it is
+    auto type = aSource->get_factory()->get_name().raw();
+    Util::Log(Util::Log_Debug) << "Setting up source of type " << type;
 
-    if (aSource->get_name().raw() == "souphttpsrc")
+    Source source;
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        source = aPlaybin == m_playbin.operator->() ? m_source : m_fadeSource;
+    }
+
+    if (type == "souphttpsrc")
     {
         aSource->set_property("automatic-redirect", true);
         aSource->set_property("compress", true);
-        aSource->set_property("extra-headers", structure_from_map("extra-headers", m_currentSong->DataHeaders));
+        aSource->set_property("extra-headers", structure_from_map("extra-headers", source.Headers));
         aSource->set_property("ssl-strict", false);
+
+        if (!source.URL.empty())
+        {
+            // Cached songs play from a file, so this one wasn't
+            AudioCache::getSingleton().miss();
+            auto writer = AudioCache::getSingleton().store(source.URL);
+            if (writer)
+                Prefetcher::TeeSource(aSource, std::move(writer));
+        }
+    }
+    else if (type == "filesrc" && !source.URL.empty())
+        AudioCache::getSingleton().use(source.URL);
+}
+
+void ActivePlaylist::_prepareUpcoming()
+{
+    // Follows _finishedStream; single repeats the song, or stops after it.
+    // Consume would drop the song that's playing, so that takes the slow way
+    const Song* next = nullptr;
+    if (m_currentSong && m_changeState == Change_Idle)
+    {
+        if (hasSingle() == Single_False)
+            next = _peekNextSong(m_currentSong);
+        else if (hasRepeat() && !hasConsume())
+            next = m_currentSong;
+    }
+
+    bool ready = next && !isUnplayable(next) && (isCached(*next) || (!next->isExpired() && (next->isLocal() || !next->DataURL.empty())));
+    if (next && !ready && !next->isLocal())
+    {
+        // Make sure it's resolved before the end, ahead of any prefetching
+        auto remaining = m_currentSongDur - m_currentSongPos;
+        if (m_currentSongDur.count() > 0 && remaining < m_gaplessLead && next->Priority != Util::WorkQueue::Priority_Playback)
+        {
+            auto* song = const_cast<Song*>(next);
+            _setPriority(*song, Util::WorkQueue::Priority_Playback);
+            if (!song->UpdateTask.valid())
+                _queueUpdateSong(*song);
+        }
     }
+
+    // Crossfades open the next song in the other pipeline instead
+    bool fade = ready && next != m_currentSong && _canFade(*next);
+    _updateCrossfade(fade ? next : nullptr);
+
+    std::lock_guard<std::mutex> _lock(m_sourceMutex);
+    if (m_handedOver)
+        return;
+    if (!ready || fade || m_fadeState != Fade_Idle)
+    {
+        m_upcoming.reset();
+        return;
+    }
+
+    auto uri = playbackUri(*next);
+    if (m_upcoming && m_upcoming->ID == next->ID && m_upcoming->URI == uri)
+        return;
+
+    Util::Log(Util::Log_Debug) << "- Lining up (" << next->URL << ") to follow";
+    m_upcoming = Upcoming{ next->ID, uri, { next->URL, next->DataHeaders } };
+}
+
+void ActivePlaylist::_switchToUpcoming()
+{
+    std::optional<Upcoming> upcoming;
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        upcoming = std::move(m_handedOver);
+        m_handedOver.reset();
+    }
+    if (!upcoming)
+        return;
+
+    // The gap is recorded once the output has seen the new stream's first audio
+    ++m_transitionStats.Gapless;
+
+    auto* song = getSongID(upcoming->ID);
+    if (!song)
+    {
+        // Removed while its stream was being handed over, which plays anyway
+        Util::Log(Util::Log_Warning) << "[Song] " << upcoming->URI << " started after its song was removed";
+        changeSong(nextSong(m_currentSong), Gst::STATE_PLAYING);
+        return;
+    }
+
+    Util::Log(Util::Log_Debug) << "Gapless switch to (" << song->URL << ")";
+    if (song == m_currentSong && hasSingle() == Single_Oneshot)
+        setSingle(Single_False);
+    _advanceTo(*song);
+    m_measureHandover = true;
+}
+
+void ActivePlaylist::_advanceTo(const Song& aSong)
+{
+    // Moves the queue along the way nextSong would have, a song repeated by
+    // single stays where it is
+    if (hasRepeat() && &aSong != m_currentSong && _wrapsTo(m_currentSong, &aSong))
+        _startRound();
+
+    _setCurrentSong(&aSong);
+
+    m_server->pushEvent(Protocols::Event(Protocols::Event_QueueChange));
+}
+
+void ActivePlaylist::_recordGap(std::chrono::milliseconds aGap)
+{
+    ++m_transitionStats.Transitions;
+    m_transitionStats.LastGap = aGap;
+    m_transitionStats.MaxGap = std::max(m_transitionStats.MaxGap, aGap);
+    m_transitionStats.TotalGap += aGap;
+
+    if (aGap.count() > 0)
+        Util::Log(Util::Log_Debug) << "- " << aGap.count() << "ms between songs";
+}
+
+void ActivePlaylist::_recordStart(std::chrono::milliseconds aLatency)
+{
+    ++m_startStats.Starts;
+    m_startStats.LastLatency = aLatency;
+    m_startStats.TotalLatency += aLatency;
+    if (m_startCached)
+    {
+        ++m_startStats.Cached;
+        m_startStats.TotalCachedLatency += aLatency;
+    }
+
+    Util::Log(Util::Log_Debug) << "- Started after " << aLatency.count() << "ms" << (m_startCached ? " from the cache" : "");
+}
+
+void ActivePlaylist::_prefetchUpcoming()
+{
+    std::vector<Prefetcher::Request> songs;
+    if (m_currentSong && m_changeState == Change_Idle && m_changeTarget >= Gst::STATE_PAUSED && AudioCache::getSingleton().isOpen())
+    {
+        for (auto* song : _upcomingSongs(m_currentSong, m_prefetchDepth))
+        {
+            // A round that wraps back onto the current song has nothing more to fetch
+            if (song == m_currentSong)
+                break;
+
+            // Only whole songs are cached, so endless streams are left alone
+            if (song->isLocal() || song->DataURL.empty() || song->isExpired() || song->Duration.count() == 0)
+                continue;
+
+            songs.push_back(Prefetcher::Request{ song->URL, song->DataURL, song->DataHeaders });
+        }
+    }
+
+    m_prefetcher.update(songs);
+}
+
+bool ActivePlaylist::_canFade(const Song& aNext) const
+{
+    // Live streams don't end, and songs shorter than the fade would be all overlap
+    return m_crossfade.count() > 0 && !m_fadeUnavailable && !isLive() && !m_recovering
+        && m_currentSongDur > std::chrono::nanoseconds(m_crossfade) && m_fadeSkipID != aNext.ID;
+}
+
+void ActivePlaylist::_updateCrossfade(const Song* aNext)
+{
+    auto remaining = m_currentSongDur - m_currentSongPos;
+    switch (m_fadeState)
+    {
+    case Fade_Idle:
+        if (aNext && remaining < m_crossfade + FADE_PREROLL)
+            _prerollFade(*aNext);
+        break;
+
+    case Fade_Prerolling:
+        // The queue changed under it
+        if (!aNext || aNext->ID != m_fadeSongID)
+            _stopFade();
+        else if (m_mixRampAt != std::chrono::steady_clock::time_point() && std::chrono::steady_clock::now() >= m_mixRampAt)
+            _startFade(std::chrono::duration_cast<std::chrono::milliseconds>(remaining), false);
+        else if (remaining <= m_crossfade)
+            _startFade(m_crossfade, true);
+        break;
+
+    case Fade_Fading:
+        break;
+
+    default:
+        break;
+    }
+}
+
+void ActivePlaylist::_prerollFade(const Song& aNext)
+{
+    auto uri = playbackUri(aNext);
+
+    Util::Log(Util::Log_Debug) << "- Prerolling (" << uri << ") to fade in";
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        m_fadeSource = { aNext.URL, aNext.DataHeaders };
+    }
+
+    double volume = 0;
+    m_playbin->get_property<double>("volume", volume);
+    m_fadePlaybin->set_property<double>("volume", volume);
+    m_fadePlaybin->set_property("uri", Glib::ustring(uri));
+    setEnvelope(m_fadePlaybin, 0);
+    m_fadePlaybin->set_state(Gst::STATE_PAUSED);
+
+    m_fadeState = Fade_Prerolling;
+    m_fadeSongID = aNext.ID;
+    m_mixRampAt = {};
+}
+
+void ActivePlaylist::_startFade(std::chrono::milliseconds aDuration, bool aRamp)
+{
+    auto* song = getSongID(m_fadeSongID);
+    if (!song)
+    {
+        _stopFade();
+        return;
+    }
+
+    Util::Log(Util::Log_Debug) << "- " << (aRamp ? "Crossfading" : "MixRamping") << " into (" << song->URL << ") over " << aDuration.count() << "ms";
+
+    // MixRamp overlaps where the old song has gone quiet by itself
+    setEnvelope(m_fadePlaybin, aRamp ? 0 : 1);
+    m_fadePlaybin->set_state(Gst::STATE_PLAYING);
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        std::swap(m_playbin, m_fadePlaybin);
+        std::swap(m_source, m_fadeSource);
+    }
+
+    m_fadeState = Fade_Fading;
+    m_fadeRamp = aRamp;
+    m_fadeDuration = aDuration;
+    m_fadeStart = std::chrono::steady_clock::now();
+    m_fadeTimer = Glib::signal_timeout().connect(sigc::mem_fun(*this, &ActivePlaylist::_stepFade), 20);
+
+    _advanceTo(*song);
+    // Recorded once the new song plays, see on_bus_message
+    m_measureFade = true;
+    m_fadeOutEnd = {};
+}
+
+bool ActivePlaylist::_stepFade()
+{
+    double progress = 1;
+    if (m_fadeDuration.count() > 0)
+        progress = std::min(std::chrono::duration<double>(std::chrono::steady_clock::now() - m_fadeStart) / m_fadeDuration, 1.0);
+
+    // Equal power, so the overlap doesn't dip in the middle
+    if (m_fadeRamp)
+    {
+        setEnvelope(m_playbin, std::sin(progress * M_PI_2));
+        setEnvelope(m_fadePlaybin, std::cos(progress * M_PI_2));
+    }
+
+    if (progress < 1)
+        return true;
+
+    _stopFade();
+    return false;
+}
+
+void ActivePlaylist::_stopFade()
+{
+    if (m_fadeState == Fade_Idle)
+        return;
+
+    m_fadeTimer.disconnect();
+    m_fadePlaybin->set_state(Gst::STATE_NULL);
+    setEnvelope(m_playbin, 1);
+
+    m_fadeState = Fade_Idle;
+    m_mixRampAt = {};
+}
+
+void ActivePlaylist::_measuredLevel(const Gst::Structure& aLevel)
+{
+    if (m_fadeState != Fade_Prerolling || std::isnan(m_mixRampDelay))
+        return;
+
+    auto* rms = gst_structure_get_value(aLevel.gobj(), "rms");
+    if (!rms)
+        return;
+
+    // One value per channel, in dB
+    double loudest = -G_MAXDOUBLE;
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    auto* channels = static_cast<GValueArray*>(g_value_get_boxed(rms));
+    for (guint i = 0; channels && i < channels->n_values; ++i)
+        loudest = std::max(loudest, g_value_get_double(g_value_array_get_nth(channels, i)));
+    G_GNUC_END_IGNORE_DEPRECATIONS
+
+    // Only the end of the song counts, not a quiet bit that gets loud again
+    if (loudest >= m_mixRampDb)
+        m_mixRampAt = {};
+    else if (m_mixRampAt == std::chrono::steady_clock::time_point())
+        m_mixRampAt = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(m_mixRampDelay));
+}
+
+bool ActivePlaylist::_onFadeMessage(const Glib::RefPtr<Gst::Message>& aMessage)
+{
+    switch(aMessage->get_message_type())
+    {
+    case Gst::MESSAGE_ERROR:
+        {
+            auto errMsg = Glib::RefPtr<Gst::MessageError>::cast_static(aMessage);
+            auto error = errMsg->parse_error();
+
+            // Exclusive outputs, like ALSA without dmix, are already held by
+            // the playing pipeline. Songs follow gaplessly from then on
+            if (isSink(aMessage->get_source()))
+            {
+                Util::Log(Util::Log_Warning) << "[Crossfade] Turning crossfade off, a second audio output couldn't be opened: " << error.what().raw();
+                m_fadeUnavailable = true;
+            }
+            else
+            {
+                Util::Log(Util::Log_Warning) << "Error in fade: " << error.what().raw();
+
+                // The song gets another go without a fade once it's current
+                if (m_fadeState == Fade_Prerolling)
+                    m_fadeSkipID = m_fadeSongID;
+            }
+            _stopFade();
+        }
+        break;
+
+    case Gst::MESSAGE_EOS:
+        {
+            if (m_fadeState != Fade_Fading)
+                break;
+
+            if (m_measureFade)
+                m_fadeOutEnd = std::chrono::steady_clock::now();
+            _stopFade();
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return true;
+}
+
+bool ActivePlaylist::_failoverSource()
+{
+    if (m_reresolving)
+        return false;
+
+    // Further failures while recovering keep the original position and start time
+    if (!m_recovering)
+    {
+        m_recovering = true;
+        m_resumePosition = m_currentSongPos;
+        m_recoveryStart = std::chrono::steady_clock::now();
+
+        // Paused songs stay paused once they're back
+        Gst::State state, pending;
+        m_playbin->get_state(state, pending, {});
+        m_recoveryTarget = pending != Gst::STATE_VOID_PENDING ? pending : state;
+        if (m_recoveryTarget < Gst::STATE_PAUSED)
+            m_recoveryTarget = m_changeTarget;
+    }
+
+    // A song that failed before it first prerolled is finished by the
+    // recovery instead, which starts it once the new stream is ready
+    if (m_changeState == Change_Prerolling)
+        m_changeState = Change_Idle;
+
+    // Alternates of an expired stream come from the same resolve, and have expired too
+    auto& song = *m_currentSong;
+    if (!song.DataAlternates.empty() && !song.isExpired())
+    {
+        song.DataURL = std::move(song.DataAlternates.front().URL);
+        song.DataHeaders = std::move(song.DataAlternates.front().Headers);
+        song.DataAlternates.pop_front();
+        ++m_recoveryStats.Failovers;
+
+        Util::Log(Util::Log_Info) << "[Song] Stream for " << song.URL << " failed, switching to another format (" << song.DataAlternates.size() << " left)";
+        _restartSource();
+        return true;
+    }
+
+    if (m_reresolved)
+        return false;
+
+    // Every format from the last resolve failed, so the cached streams are no good either
+    Util::Log(Util::Log_Info) << "[Song] All streams for " << song.URL << " failed, resolving it again";
+    m_reresolving = m_reresolved = true;
+    ++m_recoveryStats.Reresolves;
+    m_playbin->set_state(Gst::STATE_READY);
+
+    ResolverCache::getSingleton().invalidateStream(song.URL);
+    song.DataURL.clear();
+    song.DataAlternates.clear();
+    song.NextUpdateTime = std::chrono::system_clock::now();
+    _setPriority(song, Util::WorkQueue::Priority_Playback);
+    _queueUpdateSong(song);
+
+    return true;
+}
+
+void ActivePlaylist::_restartSource()
+{
+    // The pipeline stays in its error state until it's taken down. Prerolling
+    // paused lets it seek back before anything is heard, see _finishRecovery
+    Util::Log(Util::Log_Debug) << "- Restarting (" << m_currentSong->DataURL << ")";
+    m_playbin->set_state(Gst::STATE_READY);
+    {
+        std::lock_guard<std::mutex> _lock(m_sourceMutex);
+        m_source = { m_currentSong->URL, m_currentSong->DataHeaders };
+    }
+    m_playbin->set_property("uri", Glib::ustring(m_currentSong->DataURL));
+    m_playbin->set_state(Gst::STATE_PAUSED);
+}
+
+void ActivePlaylist::_finishRecovery()
+{
+    m_recovering = false;
+
+    if (m_resumePosition.count() > 0)
+    {
+        Util::Log(Util::Log_Debug) << "- Seeking back to " << m_resumePosition;
+        if (!m_playbin->seek_simple(Gst::FORMAT_TIME, Gst::SEEK_FLAG_FLUSH | Gst::SEEK_FLAG_KEY_UNIT, m_resumePosition.count()))
+            Util::Log(Util::Log_Warning) << "[Song] Failed to seek " << m_currentSong->URL << " back to " << m_resumePosition << ", playing from the start";
+    }
+    // Prerolled paused by _restartSource, so a paused song is already where it belongs
+    if (m_recoveryTarget == Gst::STATE_PLAYING)
+        m_playbin->set_state(Gst::STATE_PLAYING);
+
+    auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_recoveryStart);
+    ++m_recoveryStats.Recoveries;
+    m_recoveryStats.LastLatency = latency;
+    m_recoveryStats.MaxLatency = std::max(m_recoveryStats.MaxLatency, latency);
+    m_recoveryStats.TotalLatency += latency;
+
+    Util::Log(Util::Log_Info) << "[Song] Recovered " << m_currentSong->URL << " at " << std::chrono::duration_cast<std::chrono::seconds>(m_resumePosition).count() << "s in " << latency.count() << "ms";
+}
+
+void ActivePlaylist::_abandonRecovery(const std::string& aReason)
+{
+    Util::Log(Util::Log_Warning) << "[Song] Giving up on " << m_currentSong->URL << "; " << aReason;
+    ++m_recoveryStats.Failures;
+
+    setError("Failed to play " + m_currentSong->URL + "; " + aReason);
+    changeSong(nextSong(m_currentSong), m_recoveryTarget == Gst::STATE_PAUSED ? Gst::STATE_PAUSED : Gst::STATE_PLAYING);
 }
 
 void ActivePlaylist::_addedSong(Song& aSong)
@@ -686,12 +1698,59 @@ void ActivePlaylist::_addedSong(Song& aSong)
     }
     else
         m_playQueue.push_back(&aSong);
+
+    m_windowDirty = true;
 }
 
 void ActivePlaylist::_updatedSong(Song& aSong)
 {
     Playlist::_updatedSong(aSong);
     m_server->pushEvent(Protocols::Event(Protocols::Event_QueueChange));
+
+    if (m_changeState == Change_Resolving && &aSong == m_currentSong)
+        m_changeDispatcher->emit();
+}
+
+bool ActivePlaylist::_shouldResolve(const Song& aSong) const
+{
+    return m_window.count(aSong.ID) > 0;
+}
+
+void ActivePlaylist::_updateWindow()
+{
+    m_windowDirty = false;
+    auto previous = std::move(m_window);
+    m_window.clear();
+
+    if (m_currentSong)
+    {
+        m_window.insert(m_currentSong->ID);
+        _setPriority(*m_currentSong, Util::WorkQueue::Priority_Playback);
+    }
+    // Follow the same prediction playback does, so random mode resolves what it will actually play next
+    for (auto* song : _upcomingSongs(m_currentSong, m_windowSize))
+        m_window.insert(song->ID);
+
+    // Past a wrap the window can hold songs the current round has already consumed
+    auto now = std::chrono::system_clock::now();
+    for (auto& entry : m_songs)
+    {
+        auto* song = &entry;
+        bool inWindow = m_window.count(song->ID) > 0;
+        if (song != m_currentSong)
+        {
+            // Songs that left the window finish any pending update in the background
+            if (inWindow)
+                _setPriority(*song, Util::WorkQueue::Priority_Prefetch);
+            else if (previous.count(song->ID) > 0)
+                _setPriority(*song, Util::WorkQueue::Priority_Background);
+        }
+
+        if (!inWindow || song->isLocal() || song->UpdateTask.valid())
+            continue;
+        if (song->DataURL.empty() || song->NextUpdateTime <= now)
+            _queueUpdateSong(*song);
+    }
 }
 
 void ActivePlaylist::resetQueue()
@@ -699,8 +1758,11 @@ void ActivePlaylist::resetQueue()
     m_playQueue.clear();
     for (auto& song : *this)
         m_playQueue.push_back(&song);
+    m_windowDirty = true;
 }
 void ActivePlaylist::shuffleQueue()
 {
     std::shuffle(m_playQueue.begin(), m_playQueue.end(), std::random_device());
+    m_roundSeed = std::random_device()();
+    m_windowDirty = true;
 }
@@ -1,9 +1,15 @@
 #pragma once
 
 #include "Playlist.hpp"
+#include "Util/Prefetcher.hpp"
 
 #include <gstreamermm.h>
 
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+
 enum PlayFlags : uint8_t
 {
     PF_Consume  = 1u << 0u,
@@ -29,6 +35,47 @@ enum SingleStatus : int8_t
     Single_Oneshot = 2
 };
 
+struct RecoveryStats
+{
+    // Songs picked back up after their stream failed, and those given up on
+    uint64_t Recoveries;
+    uint64_t Failures;
+    // Switches to another format, and fresh resolves once those ran out
+    uint64_t Failovers;
+    uint64_t Reresolves;
+
+    // From the error to playing again at the old position
+    std::chrono::milliseconds LastLatency;
+    std::chrono::milliseconds MaxLatency;
+    std::chrono::milliseconds TotalLatency;
+};
+
+struct TransitionStats
+{
+    // Songs that followed the one before on their own, and those of them
+    // that were queued up in time to play without a gap
+    uint64_t Transitions;
+    uint64_t Gapless;
+
+    // From the end of one song to the next playing
+    std::chrono::milliseconds LastGap;
+    std::chrono::milliseconds MaxGap;
+    std::chrono::milliseconds TotalGap;
+};
+
+struct StartStats
+{
+    // Songs started from scratch rather than handed over, and those of them
+    // that played from the audio cache
+    uint64_t Starts;
+    uint64_t Cached;
+
+    // From the song being picked to it being heard
+    std::chrono::milliseconds LastLatency;
+    std::chrono::milliseconds TotalLatency;
+    std::chrono::milliseconds TotalCachedLatency;
+};
+
 class ActivePlaylist : public Playlist
 {
 public:
@@ -82,18 +129,70 @@ public:
     float getVolume() const;
     void setVolume(float aVolume);
 
+    std::chrono::seconds getCrossfade() const;
+    void setCrossfade(std::chrono::seconds aDuration);
+    // MixRamp starts the overlap once the old song drops below the level,
+    // and the delay after that. NaN turns it off
+    float getMixRampDb() const;
+    void setMixRampDb(float aDb);
+    float getMixRampDelay() const;
+    void setMixRampDelay(float aDelay);
+
     bool isLive() const;
 
+    const RecoveryStats& getRecoveryStats() const;
+    const TransitionStats& getTransitionStats() const;
+    const StartStats& getStartStats() const;
+    const Prefetcher::Stats& getPrefetchStats() const;
+
 private:
     void _addedSong(Song& aSong) override;
     void _updatedSong(Song& aSong) override;
+    bool _shouldResolve(const Song& aSong) const override;
+    void _updateWindow();
+    // Starts playing the song once it's resolved, never waits for it
     bool changeSong(const Song* aSong, Gst::State aState);
+    Glib::RefPtr<Gst::Element> _createPlaybin();
+    void _setCurrentSong(const Song* aSong);
+    bool _startSong();
+    void _advanceChange();
+    void _finishedStream();
+    // Readies the song after the current one for the streaming thread to hand over
+    void _prepareUpcoming();
+    void _switchToUpcoming();
+    void _advanceTo(const Song& aSong);
+    bool _canFade(const Song& aNext) const;
+    // Prerolls the next song in the other pipeline and starts the overlap on time
+    void _updateCrossfade(const Song* aNext);
+    void _prerollFade(const Song& aNext);
+    void _startFade(std::chrono::milliseconds aDuration, bool aRamp);
+    bool _stepFade();
+    void _stopFade();
+    void _measuredLevel(const Gst::Structure& aLevel);
+    bool _onFadeMessage(const Glib::RefPtr<Gst::Message>& aMessage);
+    void _recordGap(std::chrono::milliseconds aGap);
+    void _recordStart(std::chrono::milliseconds aLatency);
+    // Has the songs after the current one downloaded into the audio cache
+    void _prefetchUpcoming();
+    // The song nextSong will return, without moving the queue along
+    const Song* _peekNextSong(const Song* aCurSong) const;
+    // The songs that will play after aCurSong, as far as repeat goes
+    std::vector<const Song*> _upcomingSongs(const Song* aCurSong, size_t aCount) const;
+    // Random mode shuffles once per round, the next round's order is fixed ahead
+    std::deque<Song*> _nextRound() const;
+    bool _wrapsTo(const Song* aCurSong, const Song* aNext) const;
+    void _startRound();
+    // Moves the current song on to its next stream after the one playing failed
+    bool _failoverSource();
+    void _restartSource();
+    void _finishRecovery();
+    void _abandonRecovery(const std::string& aReason);
     void resetQueue();
     void shuffleQueue();
 
     bool on_bus_message(const Glib::RefPtr<Gst::Bus>& aBus, const Glib::RefPtr<Gst::Message>& aMessage);
-    void on_about_to_finish();
-    void on_source_setup(const Glib::RefPtr<Gst::Element>& aSource);
+    void on_about_to_finish(Gst::Element* aPlaybin);
+    void on_source_setup(const Glib::RefPtr<Gst::Element>& aSource, Gst::Element* aPlaybin);
 
     Server* m_server;
     Glib::RefPtr<Gst::Element> m_playbin;
@@ -102,5 +201,98 @@ private:
     Song* m_currentSong;
     std::chrono::nanoseconds m_currentSongDur, m_currentSongPos;
     std::deque<Song*> m_playQueue;
+    uint32_t m_roundSeed;
     std::string m_errorMsg;
+    // Set from a stream failing until the song plays again where it was. All
+    // streams of the current song failing has it resolved again, which only
+    // happens once per play
+    bool m_recovering, m_reresolving, m_reresolved;
+    std::chrono::nanoseconds m_resumePosition;
+    // What the song was doing before it failed, kept up to date by pause and resume
+    Gst::State m_recoveryTarget;
+    std::chrono::steady_clock::time_point m_recoveryStart;
+    std::chrono::milliseconds m_recoveryTimeout;
+    RecoveryStats m_recoveryStats;
+
+    enum ChangeState
+    {
+        // Whatever song is current plays, or doesn't
+        Change_Idle,
+        // Waiting for the new song to resolve
+        Change_Resolving,
+        // Uri set, waiting for the pipeline to preroll it
+        Change_Prerolling,
+    };
+
+    // Song changes finish on the main loop, woken once the song resolves.
+    // The tick catches anything the wakeup misses
+    ChangeState m_changeState;
+    Gst::State m_changeTarget;
+    std::shared_future<bool> m_changeTask;
+    std::chrono::steady_clock::time_point m_changeStart;
+    std::unique_ptr<Glib::Dispatcher> m_changeDispatcher;
+
+    // The song a playbin's next source belongs to, and the headers it needs
+    struct Source
+    {
+        std::string URL;
+        std::unordered_map<std::string, std::string> Headers;
+    };
+    struct Upcoming
+    {
+        size_t ID;
+        std::string URI;
+        Source Origin;
+    };
+
+    // Shared with the streaming threads; the next song as prepared by the
+    // main loop, the one given to playbin but not playing yet, and what
+    // each playbin sets up its next source for
+    std::mutex m_sourceMutex;
+    std::optional<Upcoming> m_upcoming, m_handedOver;
+    Source m_source, m_fadeSource;
+    // How long before the end of a song the next one gets resolved first thing
+    std::chrono::seconds m_gaplessLead;
+    // Gaps are measured from the end of the old stream to the new one playing
+    // after an EOS, from what the output saw after a handover, and from the
+    // old song running out after a crossfade
+    bool m_measureGap, m_measureHandover, m_measureFade;
+    std::chrono::steady_clock::time_point m_streamEnd, m_fadeOutEnd;
+    TransitionStats m_transitionStats;
+
+    Prefetcher m_prefetcher;
+    // How many of the songs coming up to prefetch
+    size_t m_prefetchDepth;
+    bool m_measureStart, m_startCached;
+    StartStats m_startStats;
+
+    enum FadeState
+    {
+        Fade_Idle,
+        // The next song is opening in the other pipeline
+        Fade_Prerolling,
+        // Both are playing, the old one in the other pipeline
+        Fade_Fading,
+    };
+
+    // The only pipeline besides the current one, and only up from just
+    // before an overlap until the old song has faded out
+    Glib::RefPtr<Gst::Element> m_fadePlaybin;
+    FadeState m_fadeState;
+    size_t m_fadeSongID;
+    // A song whose stream failed to preroll follows without a fade
+    std::optional<size_t> m_fadeSkipID;
+    bool m_fadeRamp;
+    // Both pipelines open their own audio output, which not every output allows
+    bool m_fadeUnavailable;
+    std::chrono::steady_clock::time_point m_fadeStart, m_mixRampAt;
+    std::chrono::milliseconds m_fadeDuration;
+    sigc::connection m_fadeTimer;
+    std::chrono::seconds m_crossfade;
+    float m_mixRampDb, m_mixRampDelay;
+
+    // Songs kept resolved, the current one and the next few to play
+    size_t m_windowSize;
+    bool m_windowDirty;
+    std::unordered_set<size_t> m_window;
 };
@@ -1,5 +1,8 @@
 #include "Playlist.hpp"
+#include "Util/AdaptiveLimiter.hpp"
+#include "Util/DirectMedia.hpp"
 #include "Util/Path.hpp"
+#include "Util/ResolverCache.hpp"
 #include "Util/WorkQueue.hpp"
 #include "Util/YoutubeDL.hpp"
 #include "Util/Logging.hpp"
@@ -15,26 +18,198 @@ namespace std
 #endif
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <limits>
+#include <mutex>
 #include <random>
+#include <unordered_set>
 
 using namespace std::chrono_literals;
 
 // TODO: Place somewhere more reasonable?
 Util::WorkQueue s_songUpdateQueue;
+Util::AdaptiveLimiter s_extractorLimiter;
+
+namespace
+{
+
+// Songs move around in their playlist while a resolve runs, so they're found
+// again by ID once the result is back on the main loop
+struct Waiter
+{
+    Playlist* Owner;
+    size_t SongID;
+    // Kept here, as workers can't look at the song itself
+    int Priority;
+};
+
+// Resolves in progress, shared by every song with the same normalised URL
+struct InFlight
+{
+    std::vector<Waiter> Waiters;
+    std::shared_ptr<std::promise<bool>> Promise;
+    std::shared_future<bool> Task;
+    Util::CancelToken Token;
+};
+
+std::mutex s_inFlightMutex;
+std::unordered_map<std::string, InFlight> s_inFlight;
+
+// Resolves that are done, waiting for the main loop to hand them to their songs
+struct Finished
+{
+    InFlight Flight;
+    std::unique_ptr<YoutubeDLResponse> Response;
+    std::string Error;
+    ResolverCache::Failure Failure;
+};
+
+std::mutex s_finishedMutex;
+std::vector<Finished> s_finished;
+std::function<void()> s_notifyFinished;
+
+struct PendingUpdate
+{
+    std::string Key;
+    std::string Url;
+    int Priority;
+    Util::CancelToken Token;
+};
+
+// Resolves waiting to be run together in one batch
+std::mutex s_pendingUpdateMutex;
+std::deque<PendingUpdate> s_pendingUpdates;
+
+// Extractors seen for each host, so that all of a site's URLs share a limit
+std::mutex s_extractorMutex;
+std::unordered_map<std::string, std::string> s_hostExtractors;
+// Hosts that turned out to serve pages when sniffed, even without a dedicated extractor
+std::unordered_set<std::string> s_pageHosts;
+
+std::string urlHost(const std::string& aUrl)
+{
+    auto url = YoutubeDL::NormaliseUrl(aUrl);
+    auto start = url.find("://");
+    if (start == std::string::npos)
+        return {};
+
+    start += 3;
+    return url.substr(start, url.find_first_of("/?", start) - start);
+}
+
+// Limiter key for a URL; its extractor once known, otherwise its host
+std::string limiterKey(const std::string& aUrl)
+{
+    auto host = urlHost(aUrl);
+
+    std::lock_guard<std::mutex> _lock(s_extractorMutex);
+    auto it = s_hostExtractors.find(host);
+    if (it != s_hostExtractors.end())
+        return it->second;
+    return host;
+}
+
+void learnExtractor(const std::string& aUrl, const YoutubeDLResponse& aResponse)
+{
+    auto extractor = aResponse.Extractor;
+    std::transform(extractor.begin(), extractor.end(), extractor.begin(), ::tolower);
+
+    // The generic extractor covers all sorts of unrelated sites
+    if (extractor.empty() || extractor == "generic")
+        return;
+
+    auto host = urlHost(aUrl);
+    std::lock_guard<std::mutex> _lock(s_extractorMutex);
+    s_hostExtractors[host] = extractor;
+}
+
+// Direct media is only probed for its tags, and URLs that might be are
+// sniffed alongside youtube-dl, unless their site is already known to need it
+DirectMedia::Kind mediaKind(const Playlist::Song& aSong)
+{
+    if (aSong.Direct)
+        return DirectMedia::Kind_Direct;
+
+    auto& direct = DirectMedia::getSingleton();
+    auto kind = direct.classify(aSong.URL);
+    if (kind != DirectMedia::Kind_Unknown)
+        return kind;
+    if (!direct.isSniffing())
+        return DirectMedia::Kind_Page;
+
+    auto host = urlHost(aSong.URL);
+    std::lock_guard<std::mutex> _lock(s_extractorMutex);
+    if (s_hostExtractors.count(host) > 0 || s_pageHosts.count(host) > 0)
+        return DirectMedia::Kind_Page;
+    return DirectMedia::Kind_Unknown;
+}
+
+// Whether a resolver error means the site is pushing back on us
+bool isThrottled(const std::string& aError)
+{
+    return aError.find("429") != std::string::npos
+        || aError.find("Too Many Requests") != std::string::npos
+        || aError.find("rate limit") != std::string::npos
+        || aError.find("timed out") != std::string::npos;
+}
+
+// How long before expiry stream URLs are refreshed
+constexpr auto kRefreshMargin = 5min;
+
+// Refresh shortly before the stream expires, short-lived streams halfway
+// through their remaining lifetime
+std::chrono::system_clock::time_point refreshTime(std::chrono::system_clock::time_point aExpiry)
+{
+    auto now = std::chrono::system_clock::now();
+    if (aExpiry == std::chrono::system_clock::time_point())
+        return now + 1h;
+
+    auto left = aExpiry - now;
+    auto margin = std::min<std::chrono::system_clock::duration>(left / 2, kRefreshMargin);
+    return std::max<std::chrono::system_clock::time_point>(aExpiry - margin, now + 1min);
+}
+
+// Identifies the queued task of a resolve, for reprioritising it
+uintptr_t taskKey(const std::string& aKey)
+{
+    return uintptr_t(std::hash<std::string>()(aKey)) | 1;
+}
+
+// A shared resolve is as urgent as the most urgent song waiting on it
+int flightPriority(const InFlight& aFlight)
+{
+    int priority = Util::WorkQueue::Priority_Background;
+    for (auto& waiter : aFlight.Waiters)
+        priority = std::min(priority, waiter.Priority);
+    return priority;
+}
+
+// Largest number of listed entries added per tick, so a huge channel
+// doesn't stall the main loop
+constexpr size_t kMaxExpandedPerTick = 500;
+
+bool isFresh(const YoutubeDLResponse& aResponse)
+{
+    return aResponse.Expiry == std::chrono::system_clock::time_point() || aResponse.Expiry > std::chrono::system_clock::now() + kRefreshMargin;
+}
+
+}
 
 Playlist::Song::Song()
     : ID(0)
-    , Priority(0)
+    , Priority(Util::WorkQueue::Priority_Background)
     , Direct(false)
+    , Expanding(false)
 { }
 Playlist::Song::Song(const std::string& aUrl)
     : URL(aUrl)
     , ID(0)
-    , Priority(0)
+    , Priority(Util::WorkQueue::Priority_Background)
     , Direct(false)
+    , Expanding(false)
 { }
 
 bool Playlist::Song::isDirect() const
@@ -48,6 +223,16 @@ bool Playlist::Song::isLocal() const
     return urlView[0] == '/' || urlView.find("file://") == 0 || urlView.find("://") == std::string::npos;
 }
 
+bool Playlist::Song::isExpired() const
+{
+    return DataExpiry != std::chrono::system_clock::time_point() && DataExpiry <= std::chrono::system_clock::now();
+}
+
+bool Playlist::Song::isFailed() const
+{
+    return FailedUntil > std::chrono::system_clock::now();
+}
+
 bool Playlist::Song::hasArtist() const
 {
     return Tags.count("ARTIST") > 0;
@@ -72,8 +257,61 @@ Playlist::Playlist()
         s_songUpdateQueue.start();
 }
 
+// Entries of a collection URL, handed from the listing task to update()
+struct Playlist::Expansion
+{
+    std::string Url;
+    Util::CancelToken Token;
+    // The song standing in for the collection, until the first entry replaces it
+    size_t PlaceholderID;
+    bool TakenOver;
+    // Where the next entry goes, -1 to append
+    int Position;
+    size_t LastID;
+    size_t Added;
+
+    std::mutex Mutex;
+    std::deque<YoutubeDLResponse> Entries;
+    bool Done;
+    std::string Error;
+};
+
 Playlist::~Playlist()
 {
+    _cancelExpansions();
+
+    // Nothing is left to hand this playlist's results to
+    std::vector<InFlight> orphaned;
+    {
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        for (auto it = s_inFlight.begin(); it != s_inFlight.end();)
+        {
+            auto& waiters = it->second.Waiters;
+            waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [this](auto& waiter) { return waiter.Owner == this; }), waiters.end());
+            if (!waiters.empty())
+            {
+                ++it;
+                continue;
+            }
+
+            orphaned.push_back(std::move(it->second));
+            it = s_inFlight.erase(it);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> _lock(s_finishedMutex);
+        for (auto& done : s_finished)
+        {
+            auto& waiters = done.Flight.Waiters;
+            waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [this](auto& waiter) { return waiter.Owner == this; }), waiters.end());
+        }
+    }
+
+    for (auto& flight : orphaned)
+    {
+        flight.Token.cancel();
+        flight.Promise->set_value(false);
+    }
 }
 
 Playlist::SongArray::const_iterator Playlist::cbegin() const
@@ -145,37 +383,57 @@ const Playlist::Song* Playlist::getSongID(size_t aID) const
 const Playlist::Song& Playlist::addSong(const std::string& aUrl, int aPosition)
 {
     auto& added = _addSong(aUrl, aPosition);
-    if (!added.isLocal())
+    added.Priority = Util::WorkQueue::Priority_Metadata;
+    if (!added.isLocal() && YoutubeDL::IsCollectionUrl(added.URL))
+        _expandSong(added, aPosition);
+    else if (!added.isLocal())
         _queueUpdateSong(added);
 
     return added;
 }
 void Playlist::removeSong(const std::string& aSearch)
 {
-    auto it = std::find_if(cbegin(), cend(), [aSearch](auto& it) {
+    auto it = std::find_if(begin(), end(), [aSearch](auto& it) {
         return it.URL == aSearch || it.Title == aSearch;
     });
 
-    if (it != cend())
+    if (it != end())
+    {
+        _cancelUpdate(*it);
+        m_songPositions.erase(it->ID);
         m_songs.erase(it);
+    }
 }
 void Playlist::removeSong(size_t aSong)
 {
     if (aSong < m_songs.size())
+    {
+        _cancelUpdate(m_songs[aSong]);
+        m_songPositions.erase(m_songs[aSong].ID);
         m_songs.erase(cbegin() + aSong);
+    }
 }
 void Playlist::removeSongID(size_t aID)
 {
-    auto it = std::find_if(cbegin(), cend(), [aID](auto& it) {
+    auto it = std::find_if(begin(), end(), [aID](auto& it) {
         return it.ID == aID;
     });
 
-    if (it != cend())
+    if (it != end())
+    {
+        _cancelUpdate(*it);
+        m_songPositions.erase(it->ID);
         m_songs.erase(it);
+    }
 }
 void Playlist::removeAllSongs()
 {
+    _cancelExpansions();
+    for (auto& song : m_songs)
+        _cancelUpdate(song);
     m_songs.clear();
+    m_songPositions.clear();
+    m_updateTimers.clear();
 }
 void Playlist::shuffle()
 {
@@ -183,16 +441,33 @@ void Playlist::shuffle()
     std::shuffle(m_songs.begin(), m_songs.end(), dev);
 }
 
+void Playlist::setUpdateThreads(uint8_t aCount)
+{
+    s_songUpdateQueue.setWorkerCount(aCount);
+}
+void Playlist::setExtractorConcurrency(double aInitial, double aMax)
+{
+    s_extractorLimiter.setLimits(aInitial, aMax);
+}
+
 void Playlist::update()
 {
-    auto now = std::chrono::system_clock::now();
+    if (!m_expansions.empty())
+        _addExpandedSongs();
 
-    for (auto& it : m_songs)
+    std::vector<Util::TimerQueue::Timer> expired;
+    m_updateTimers.popExpired(std::chrono::system_clock::now(), expired);
+
+    bool rebuilt = false;
+    for (auto& timer : expired)
     {
-        if (it.NextUpdateTime > now)
+        auto* song = _findSongID(timer.Key, rebuilt);
+
+        // Removed, or rescheduled since the timer was set
+        if (!song || song->NextUpdateTime != timer.Time)
             continue;
 
-        _queueUpdateSong(it);
+        _queueUpdateSong(*song);
     }
 }
 
@@ -219,7 +494,12 @@ bool Playlist::loadFromFile(const std::string& aPath)
 {
     auto path = Util::ExpandPath(aPath);
 
+    _cancelExpansions();
+    for (auto& song : m_songs)
+        _cancelUpdate(song);
     m_songs.clear();
+    m_songPositions.clear();
+    m_updateTimers.clear();
     auto fss = std::ifstream(path);
     std::string line;
     while (fss)
@@ -270,18 +550,19 @@ Playlist::Song& Playlist::_addSong(const std::string& aUrl, int aPosition)
         url = aUrl.substr(8);
 
     Song* addPtr;
-    if (aPosition < 0)
+    size_t position;
+    // Past the end appends, rather than landing in front of the last song
+    if (aPosition < 0 || size_t(aPosition) >= m_songs.size())
     {
         m_songs.emplace_back(url);
         addPtr = &m_songs.back();
+        position = m_songs.size() - 1;
     }
     else
     {
-        auto it = m_songs.begin() + aPosition;
-        if (it == m_songs.end())
-            it = m_songs.end() - 1;
-        it = m_songs.emplace(it, url);
+        auto it = m_songs.emplace(m_songs.begin() + aPosition, url);
         addPtr = &(*it);
+        position = it - m_songs.begin();
     }
 
     auto& added = *addPtr;
@@ -294,7 +575,11 @@ Playlist::Song& Playlist::_addSong(const std::string& aUrl, int aPosition)
         added.DataURL = added.URL;
         added.NextUpdateTime = std::chrono::system_clock::now() + 24h;
     }
+    else if (DirectMedia::getSingleton().classify(added.URL) == DirectMedia::Kind_Direct)
+        added.Direct = true;
 
+    m_songPositions[added.ID] = position;
+    _scheduleUpdate(added);
     _addedSong(added);
 
     return added;
@@ -306,6 +591,8 @@ Playlist::Song& Playlist::_addSong(const Song& aSong, int aPosition)
     auto& added = m_songs.back();
     added.ID = m_songCounter++;
 
+    m_songPositions[added.ID] = m_songs.size() - 1;
+    _scheduleUpdate(added);
     _addedSong(added);
 
     return added;
@@ -316,59 +603,562 @@ void Playlist::_addedSong(Song& aSong)
 }
 
 
+Playlist::Song* Playlist::_findSongID(size_t aID, bool& aRebuilt)
+{
+    auto it = m_songPositions.find(aID);
+    if (it == m_songPositions.end())
+        return nullptr;
+    if (it->second < m_songs.size() && m_songs[it->second].ID == aID)
+        return &m_songs[it->second];
+
+    // Songs have moved around since the positions were recorded
+    if (aRebuilt)
+        return nullptr;
+
+    m_songPositions.clear();
+    for (size_t i = 0; i < m_songs.size(); ++i)
+        m_songPositions[m_songs[i].ID] = i;
+    aRebuilt = true;
+
+    it = m_songPositions.find(aID);
+    if (it == m_songPositions.end())
+        return nullptr;
+    return &m_songs[it->second];
+}
+
+void Playlist::_scheduleUpdate(const Song& aSong)
+{
+    m_updateTimers.schedule(aSong.ID, aSong.NextUpdateTime);
+}
+
 void Playlist::_queueUpdateSong(Song& aSong)
 {
     auto now = std::chrono::system_clock::now();
 
-    if (!aSong.isDirect())
+    // Resolved once its first entry takes it over
+    if (aSong.Expanding)
+        return;
+
+    if (!aSong.isLocal())
     {
-        aSong.UpdateTask = s_songUpdateQueue.queueTask<bool>([this,&aSong]() { _updateSong(aSong); return true; });
+        // Cache lookups are cheap enough to do right here, only hand the
+        // song to a worker when the cache can't provide a stream for it
+        YoutubeDLResponse cached;
+        auto hit = ResolverCache::getSingleton().lookup(aSong.URL, cached);
+        if (hit == ResolverCache::Cache_Full && isFresh(cached))
+        {
+            _applyUpdate(aSong, cached);
+            return;
+        }
+        else if (hit != ResolverCache::Cache_Miss)
+            _applyMetadata(aSong, cached);
+
+        // Known to be failing, leave it alone until its backoff runs out
+        ResolverCache::Failure failure;
+        if (ResolverCache::getSingleton().lookupFailure(aSong.URL, failure) && failure.RetryTime > now)
+        {
+            aSong.FailedUntil = aSong.NextUpdateTime = failure.RetryTime;
+            _scheduleUpdate(aSong);
+            return;
+        }
+
+        // Left due, so that it's resolved as soon as it's wanted
+        if (!_shouldResolve(aSong))
+            return;
+
+        // Retry in an hour if the update fails, a successful one reschedules from the stream expiry
         aSong.NextUpdateTime = now + 1h;
+        _scheduleUpdate(aSong);
+
+        auto key = YoutubeDL::NormaliseUrl(aSong.URL);
+        auto priority = Util::WorkQueue::Priority(aSong.Priority);
+        Util::CancelToken token;
+
+        {
+            std::unique_lock<std::mutex> _lock(s_inFlightMutex);
+            auto& flight = s_inFlight[key];
+            if (std::none_of(flight.Waiters.begin(), flight.Waiters.end(), [this, &aSong](auto& it) { return it.Owner == this && it.SongID == aSong.ID; }))
+                flight.Waiters.push_back({ this, aSong.ID, aSong.Priority });
+
+            // Another copy of the song is already being resolved, share its result
+            if (flight.Promise)
+            {
+                aSong.UpdateTask = flight.Task;
+                priority = Util::WorkQueue::Priority(flightPriority(flight));
+                _lock.unlock();
+
+                s_songUpdateQueue.reprioritise(taskKey(key), priority);
+                s_extractorLimiter.reprioritise(taskKey(key), priority);
+                return;
+            }
+
+            flight.Promise = std::make_shared<std::promise<bool>>();
+            flight.Task = flight.Promise->get_future().share();
+            flight.Token = Util::CancelToken::Create();
+            aSong.UpdateTask = flight.Task;
+            token = flight.Token;
+        }
+
+        auto kind = mediaKind(aSong);
+        // Sniffing runs next to youtube-dl, so sites that aren't media don't wait on it
+        if (kind == DirectMedia::Kind_Unknown)
+            s_songUpdateQueue.queuePriorityTask<void>(priority, taskKey(key), [key, url = aSong.URL, token]() {
+                _probeSong(key, url, token, false);
+            });
+
+        if (kind == DirectMedia::Kind_Direct)
+            s_songUpdateQueue.queuePriorityTask<void>(priority, taskKey(key), [key, url = aSong.URL, token]() {
+                _probeSong(key, url, token, true);
+            });
+        // Songs about to play shouldn't wait for a whole batch to resolve
+        else if (YoutubeDL::getSingleton().getBatchSize() > 1 && priority != Util::WorkQueue::Priority_Playback)
+        {
+            {
+                std::lock_guard<std::mutex> _lock(s_pendingUpdateMutex);
+                s_pendingUpdates.push_back({ key, aSong.URL, priority, token });
+            }
+
+            s_songUpdateQueue.queuePriorityTask<void>(priority, taskKey(key), &Playlist::_updatePendingSongs);
+        }
+        else
+            s_songUpdateQueue.queuePriorityTask<void>(priority, taskKey(key), [key, url = aSong.URL, token]() { _resolveSong(key, url, token); });
     }
     else
     {
         aSong.UpdateTime = now;
         aSong.NextUpdateTime = now + 24h;
+        _scheduleUpdate(aSong);
+    }
+}
+
+void Playlist::_cancelUpdate(Song& aSong)
+{
+    if (!aSong.UpdateTask.valid())
+        return;
+
+    aSong.UpdateTask = std::shared_future<bool>();
+
+    auto key = YoutubeDL::NormaliseUrl(aSong.URL);
+    InFlight flight;
+    {
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        auto it = s_inFlight.find(key);
+        if (it == s_inFlight.end())
+            return;
+
+        auto& waiters = it->second.Waiters;
+        waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [this, &aSong](auto& it) { return it.Owner == this && it.SongID == aSong.ID; }), waiters.end());
+        if (!waiters.empty())
+            return;
+
+        flight = std::move(it->second);
+        s_inFlight.erase(it);
+    }
+
+    Util::Log(Util::Log_Debug) << "[Song] Cancelling resolve of " << key;
+
+    // Kills the resolver if it's already running, otherwise the task returns
+    // as soon as a worker picks it up
+    flight.Token.cancel();
+    flight.Promise->set_value(false);
+}
+
+void Playlist::_setPriority(Song& aSong, int aPriority)
+{
+    if (aSong.Priority == aPriority)
+        return;
+
+    aSong.Priority = aPriority;
+    if (!aSong.UpdateTask.valid())
+        return;
+
+    auto key = YoutubeDL::NormaliseUrl(aSong.URL);
+    int priority;
+    {
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        auto it = s_inFlight.find(key);
+        if (it == s_inFlight.end())
+            return;
+
+        for (auto& waiter : it->second.Waiters)
+            if (waiter.Owner == this && waiter.SongID == aSong.ID)
+                waiter.Priority = aPriority;
+        priority = flightPriority(it->second);
     }
+
+    s_songUpdateQueue.reprioritise(taskKey(key), Util::WorkQueue::Priority(priority));
+    s_extractorLimiter.reprioritise(taskKey(key), priority);
 }
 
-void Playlist::_updateSong(Song& aSong)
+void Playlist::_resolveSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken)
 {
     auto& ydl = YoutubeDL::getSingleton();
 
+    // Nothing wants the result any more
+    if (aToken.isCancelled())
+        return;
+
     if (!ydl.isAvailable())
+    {
+        _finishUpdate(aKey, nullptr, {});
         return;
+    }
 
-    try
+    YoutubeDLResponse response;
+    if (ResolverCache::getSingleton().lookup(aUrl, response) == ResolverCache::Cache_Full && isFresh(response))
+    {
+        _finishUpdate(aKey, &response, {});
+        return;
+    }
+
+    int priority;
+    {
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        auto it = s_inFlight.find(aKey);
+        if (it == s_inFlight.end())
+            return;
+        priority = flightPriority(it->second);
+    }
+
+    // Without a free slot the song waits in the limiter instead of holding up a
+    // worker, behind only the songs that are at least as urgent
+    auto limitKey = limiterKey(aUrl);
+    if (!s_extractorLimiter.acquire(limitKey, priority, taskKey(aKey), [aKey, aUrl, aToken, limitKey]() { return _queueRequest(aKey, aUrl, aToken, limitKey); }))
+        return;
+
+    _requestSong(aKey, aUrl, aToken, limitKey);
+}
+
+bool Playlist::_queueRequest(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, const std::string& aLimitKey)
+{
+    if (aToken.isCancelled())
+        return false;
+
+    int priority;
     {
-        auto response = ydl.request({ aSong.URL });
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        auto it = s_inFlight.find(aKey);
+        if (it == s_inFlight.end())
+            return false;
+        priority = flightPriority(it->second);
+    }
+
+    s_songUpdateQueue.queuePriorityTask<void>(Util::WorkQueue::Priority(priority), taskKey(aKey), [aKey, aUrl, aToken, aLimitKey]() {
+        _requestSong(aKey, aUrl, aToken, aLimitKey);
+    });
+    return true;
+}
 
-        aSong.Duration = std::chrono::seconds(response.Duration);
-        aSong.Title = response.Title;
-        aSong.ThumbnailURL = response.ThumbnailUrl;
-        aSong.DataURL = response.DownloadUrl;
-        aSong.DataHeaders = response.DownloadHeaders;
+void Playlist::_requestSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, const std::string& aLimitKey)
+{
+    if (aToken.isCancelled())
+    {
+        s_extractorLimiter.release(aLimitKey, Util::AdaptiveLimiter::Outcome_Failed);
+        return;
+    }
 
-        if (aSong.Tags.count("ARTIST") == 0)
-            aSong.Tags["ARTIST"] = response.Artist;
-        if (aSong.Tags.count("ALBUM") == 0)
-            aSong.Tags["ALBUM"] = response.Extractor;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        auto response = YoutubeDL::getSingleton().request({ aUrl }, aToken);
+        s_extractorLimiter.release(aLimitKey, Util::AdaptiveLimiter::Outcome_Success, std::chrono::steady_clock::now() - start);
 
-        aSong.UpdateTime = std::chrono::system_clock::now();
-        aSong.UpdateTask = std::shared_future<bool>();
+        learnExtractor(aUrl, response);
+        ResolverCache::getSingleton().store(aUrl, response);
 
-        _updatedSong(aSong);
+        _finishUpdate(aKey, &response, {});
     }
     catch(const std::exception& ex)
     {
-        std::string err = ex.what();
-        // TODO: Replace newlines
-        // TODO: Disable updates? Depending on exception type?
-        aSong.UpdateTime = std::chrono::system_clock::now();
-        aSong.UpdateTask = std::shared_future<bool>();
+        std::string error = ex.what();
+        if (aToken.isCancelled())
+            s_extractorLimiter.release(aLimitKey, Util::AdaptiveLimiter::Outcome_Failed);
+        else
+            s_extractorLimiter.release(aLimitKey, isThrottled(error) ? Util::AdaptiveLimiter::Outcome_Throttled : Util::AdaptiveLimiter::Outcome_Failed);
+
+        // The key may already belong to a fresh resolve for a re-added song
+        if (!aToken.isCancelled())
+            _finishUpdate(aKey, nullptr, error);
+    }
+}
+
+void Playlist::_probeSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, bool aDirect)
+{
+    if (aToken.isCancelled())
+        return;
+
+    YoutubeDLResponse response;
+    std::string error;
+    if (DirectMedia::getSingleton().probe(aUrl, response, error))
+    {
+        ResolverCache::getSingleton().store(aUrl, response);
+        _finishUpdate(aKey, &response, {}, aToken);
+
+        // Beat youtube-dl to it, no need to let it finish
+        if (!aDirect)
+            aToken.cancel();
+        return;
+    }
+
+    if (aDirect)
+    {
+        if (!aToken.isCancelled())
+            _finishUpdate(aKey, nullptr, error);
+        return;
+    }
+
+    // Not media after all, leave the site to youtube-dl from now on
+    Util::Log(Util::Log_Debug) << "[Direct] " << aUrl << " isn't direct media; " << error;
+    {
+        std::lock_guard<std::mutex> _lock(s_extractorMutex);
+        s_pageHosts.insert(urlHost(aUrl));
+    }
+}
+
+void Playlist::_finishUpdate(const std::string& aKey, const YoutubeDLResponse* aResponse, const std::string& aError, const Util::CancelToken& aToken)
+{
+    InFlight flight;
+    {
+        std::lock_guard<std::mutex> _lock(s_inFlightMutex);
+        auto it = s_inFlight.find(aKey);
+        if (it == s_inFlight.end())
+            return;
+        // Already finished, and the key now belongs to a fresh resolve
+        if (aToken.valid() && it->second.Token != aToken)
+            return;
+
+        flight = std::move(it->second);
+        s_inFlight.erase(it);
+    }
+
+    if (flight.Waiters.size() > 1)
+        Util::Log(Util::Log_Debug) << "[Song] Resolved " << aKey << " for " << flight.Waiters.size() << " songs";
+
+    Finished finished;
+    if (aResponse)
+        finished.Response = std::make_unique<YoutubeDLResponse>(*aResponse);
+    else if (!aError.empty())
+    {
+        finished.Error = aError;
+        finished.Failure = ResolverCache::getSingleton().storeFailure(aKey, aError);
+        Util::Log(Util::Log_Info) << "[Song] Failed to resolve " << aKey << " (" << finished.Failure.Count << " times, "
+            << (finished.Failure.Class == YoutubeDL::Error_Permanent ? "permanent" : "transient") << "), retrying in "
+            << std::chrono::duration_cast<std::chrono::minutes>(finished.Failure.RetryTime - std::chrono::system_clock::now()).count() << " minutes";
+    }
+    finished.Flight = std::move(flight);
+
+    // Songs are only ever touched from the main loop
+    std::lock_guard<std::mutex> _lock(s_finishedMutex);
+    s_finished.push_back(std::move(finished));
+    if (s_notifyFinished)
+        s_notifyFinished();
+}
+
+void Playlist::deliverUpdates()
+{
+    std::vector<Finished> finished;
+    {
+        std::lock_guard<std::mutex> _lock(s_finishedMutex);
+        finished.swap(s_finished);
+    }
+
+    for (auto& done : finished)
+    {
+        for (auto& waiter : done.Flight.Waiters)
+        {
+            // Removed while it was being resolved
+            bool rebuilt = false;
+            auto* song = waiter.Owner->_findSongID(waiter.SongID, rebuilt);
+            if (!song)
+                continue;
+
+            if (done.Response)
+                waiter.Owner->_applyUpdate(*song, *done.Response);
+            else if (!done.Error.empty())
+                waiter.Owner->_failedUpdate(*song, done.Error, done.Failure.RetryTime);
+            else
+                song->UpdateTask = std::shared_future<bool>();
+        }
+
+        done.Flight.Promise->set_value(done.Response != nullptr);
+    }
+}
+
+void Playlist::setUpdateNotifier(const std::function<void()>& aNotify)
+{
+    std::lock_guard<std::mutex> _lock(s_finishedMutex);
+    s_notifyFinished = aNotify;
+}
+
+void Playlist::_applyMetadata(Song& aSong, const YoutubeDLResponse& aResponse)
+{
+    aSong.Duration = std::chrono::seconds(aResponse.Duration);
+    aSong.Title = aResponse.Title;
+    aSong.ThumbnailURL = aResponse.ThumbnailUrl;
+
+    if (aSong.Tags.count("ARTIST") == 0)
+        aSong.Tags["ARTIST"] = aResponse.Artist;
+    if (aSong.Tags.count("ALBUM") == 0)
+        aSong.Tags["ALBUM"] = aResponse.Extractor;
+}
+
+void Playlist::_applyUpdate(Song& aSong, const YoutubeDLResponse& aResponse)
+{
+    _applyMetadata(aSong, aResponse);
+
+    aSong.DataURL = aResponse.DownloadUrl;
+    aSong.DataHeaders = aResponse.DownloadHeaders;
+    aSong.DataAlternates.clear();
+    for (auto& alternate : aResponse.AlternateFormats)
+        aSong.DataAlternates.push_back({ alternate.Url, alternate.Headers });
+    aSong.DataExpiry = aResponse.Expiry;
+    aSong.FailedUntil = {};
+    if (aResponse.Direct)
+        aSong.Direct = true;
+
+    aSong.UpdateTime = std::chrono::system_clock::now();
+    aSong.NextUpdateTime = refreshTime(aResponse.Expiry);
+    _scheduleUpdate(aSong);
+    aSong.UpdateTask = std::shared_future<bool>();
+
+    _updatedSong(aSong);
+}
+
+void Playlist::_failedUpdate(Song& aSong, const std::string& aError, std::chrono::system_clock::time_point aRetryTime)
+{
+    // TODO: Replace newlines
+    aSong.UpdateTime = std::chrono::system_clock::now();
+    aSong.FailedUntil = aSong.NextUpdateTime = aRetryTime;
+    _scheduleUpdate(aSong);
+    aSong.UpdateTask = std::shared_future<bool>();
+
+    Util::Log(Util::Log_Debug) << "[Song] Exception occured in YDL: " << aError;
+    setError(aError);
+}
+
+void Playlist::_updatePendingSongs()
+{
+    auto& ydl = YoutubeDL::getSingleton();
+
+    std::vector<PendingUpdate> batch;
+    // One slot per site covers all of its songs, the batch runs them one after another
+    std::unordered_map<std::string, size_t> limitKeys;
+    {
+        std::lock_guard<std::mutex> _lock(s_pendingUpdateMutex);
+
+        // Songs may have been reprioritised while waiting
+        {
+            std::lock_guard<std::mutex> _flightLock(s_inFlightMutex);
+            for (auto& entry : s_pendingUpdates)
+            {
+                auto it = s_inFlight.find(entry.Key);
+                if (it != s_inFlight.end())
+                    entry.Priority = flightPriority(it->second);
+            }
+        }
+        std::stable_sort(s_pendingUpdates.begin(), s_pendingUpdates.end(), [](auto& a, auto& b) { return a.Priority < b.Priority; });
+        while (!s_pendingUpdates.empty() && batch.size() < ydl.getBatchSize())
+        {
+            auto entry = std::move(s_pendingUpdates.front());
+            s_pendingUpdates.pop_front();
+            if (entry.Token.isCancelled())
+                continue;
+
+            // Songs for a site that's out of slots get resolved on their own once it has one
+            auto limitKey = limiterKey(entry.Url);
+            if (limitKeys.count(limitKey) == 0)
+            {
+                if (!s_extractorLimiter.acquire(limitKey, entry.Priority, taskKey(entry.Key), [entry, limitKey]() { return _queueRequest(entry.Key, entry.Url, entry.Token, limitKey); }))
+                    continue;
+                limitKeys[limitKey] = 0;
+            }
+
+            ++limitKeys[limitKey];
+            batch.push_back(std::move(entry));
+        }
+    }
+
+    // Another task already picked up the songs queued alongside this one
+    if (batch.empty())
+        return;
+
+    if (!ydl.isAvailable())
+    {
+        for (auto& limitKey : limitKeys)
+            s_extractorLimiter.release(limitKey.first, Util::AdaptiveLimiter::Outcome_Failed);
+        for (auto& entry : batch)
+            _finishUpdate(entry.Key, nullptr, {});
+        return;
+    }
+
+    std::vector<YoutubeDLRequest> requests;
+    requests.reserve(batch.size());
+    for (auto& entry : batch)
+        requests.push_back({ entry.Url });
+
+    Util::Log(Util::Log_Debug) << "[Song] Resolving batch of " << batch.size() << " songs";
+
+    // The batch runs as one process, only kill it once every song in it is cancelled
+    auto token = Util::CancelToken::Create();
+    auto remaining = std::make_shared<std::atomic<size_t>>(batch.size());
+    std::vector<size_t> subscriptions;
+    for (auto& entry : batch)
+        subscriptions.push_back(entry.Token.subscribe([token, remaining]() {
+            if (--*remaining == 0)
+                token.cancel();
+        }));
+
+    std::vector<YoutubeDLResponse> responses;
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        responses = ydl.requestBatch(requests, token);
+    }
+    catch (const std::exception& ex)
+    {
+        error = ex.what();
+    }
+    auto duration = std::chrono::steady_clock::now() - start;
+
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i].Token.unsubscribe(subscriptions[i]);
+
+    for (auto& limitKey : limitKeys)
+    {
+        if (token.isCancelled())
+            s_extractorLimiter.release(limitKey.first, Util::AdaptiveLimiter::Outcome_Failed);
+        else if (!error.empty())
+            s_extractorLimiter.release(limitKey.first, isThrottled(error) ? Util::AdaptiveLimiter::Outcome_Throttled : Util::AdaptiveLimiter::Outcome_Failed);
+        else
+            s_extractorLimiter.release(limitKey.first, Util::AdaptiveLimiter::Outcome_Success, duration / batch.size());
+    }
+
+    // Timed out, retrying the songs one by one would only take longer
+    if (!error.empty())
+    {
+        for (auto& entry : batch)
+            if (!entry.Token.isCancelled())
+                _finishUpdate(entry.Key, nullptr, error);
+        return;
+    }
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        auto& entry = batch[i];
+
+        if (responses[i].Success)
+        {
+            learnExtractor(entry.Url, responses[i]);
+            ResolverCache::getSingleton().store(entry.Url, responses[i]);
+            _finishUpdate(entry.Key, &responses[i], {}, entry.Token);
+            continue;
+        }
 
-        Util::Log(Util::Log_Debug) << "[Song] Exception occured in YDL: " << err;
-        setError(err);
+        // Retry failed entries on their own, to get a proper error for them
+        s_songUpdateQueue.queuePriorityTask<void>(Util::WorkQueue::Priority(entry.Priority), taskKey(entry.Key), [entry]() {
+            _resolveSong(entry.Key, entry.Url, entry.Token);
+        });
     }
 }
 
@@ -376,3 +1166,133 @@ void Playlist::_updatedSong(Song& aSong)
 {
     Util::Log(Util::Log_Debug) << "[Song] Received song information; Title=" << aSong.Title << " duration=" << aSong.Duration.count();
 }
+
+void Playlist::_expandSong(Song& aSong, int aPosition)
+{
+    auto expansion = std::make_shared<Expansion>();
+    expansion->Url = aSong.URL;
+    expansion->Token = Util::CancelToken::Create();
+    expansion->PlaceholderID = aSong.ID;
+    expansion->TakenOver = false;
+    expansion->Position = aPosition;
+    expansion->LastID = aSong.ID;
+    expansion->Added = 0;
+    expansion->Done = false;
+    m_expansions.push_back(expansion);
+
+    aSong.Expanding = true;
+    aSong.Title = aSong.URL;
+
+    Util::Log(Util::Log_Info) << "[Song] Listing entries of " << aSong.URL;
+
+    s_songUpdateQueue.queuePriorityTask<void>(Util::WorkQueue::Priority_Metadata, 0, [expansion]() {
+        std::string error;
+        try
+        {
+            YoutubeDL::getSingleton().expand(expansion->Url, [&expansion](YoutubeDLResponse&& aEntry) {
+                std::lock_guard<std::mutex> _lock(expansion->Mutex);
+                expansion->Entries.push_back(std::move(aEntry));
+            }, expansion->Token);
+        }
+        catch (const std::exception& ex)
+        {
+            error = ex.what();
+        }
+
+        std::lock_guard<std::mutex> _lock(expansion->Mutex);
+        expansion->Done = true;
+        expansion->Error = std::move(error);
+    });
+}
+
+void Playlist::_addExpandedSongs()
+{
+    bool rebuilt = false;
+    size_t budget = kMaxExpandedPerTick;
+
+    for (auto it = m_expansions.begin(); it != m_expansions.end();)
+    {
+        auto& expansion = **it;
+
+        std::deque<YoutubeDLResponse> entries;
+        bool done;
+        {
+            std::lock_guard<std::mutex> _lock(expansion.Mutex);
+            auto count = std::min(budget, expansion.Entries.size());
+            std::move(expansion.Entries.begin(), expansion.Entries.begin() + count, std::back_inserter(entries));
+            expansion.Entries.erase(expansion.Entries.begin(), expansion.Entries.begin() + count);
+            done = expansion.Done && expansion.Entries.empty();
+        }
+        budget -= entries.size();
+
+        auto now = std::chrono::system_clock::now();
+        for (auto& entry : entries)
+        {
+            if (!expansion.TakenOver)
+            {
+                // Removed before anything was listed, nothing wants the rest either
+                auto* placeholder = _findSongID(expansion.PlaceholderID, rebuilt);
+                if (!placeholder)
+                {
+                    expansion.Token.cancel();
+                    done = true;
+                    break;
+                }
+
+                // The first entry takes the place of the collection, so it can start playing right away
+                placeholder->URL = entry.SourceUrl;
+                placeholder->Expanding = false;
+                _applyMetadata(*placeholder, entry);
+                placeholder->NextUpdateTime = now;
+                _scheduleUpdate(*placeholder);
+
+                expansion.TakenOver = true;
+                ++expansion.Added;
+                continue;
+            }
+
+            int position = -1;
+            if (expansion.Position >= 0)
+            {
+                auto* last = _findSongID(expansion.LastID, rebuilt);
+                if (last)
+                    position = int(m_songPositions[last->ID]) + 1;
+            }
+
+            auto& added = _addSong(entry.SourceUrl, position);
+            added.Priority = Util::WorkQueue::Priority_Metadata;
+            _applyMetadata(added, entry);
+            expansion.LastID = added.ID;
+            ++expansion.Added;
+        }
+
+        if (!done)
+        {
+            ++it;
+            continue;
+        }
+
+        if (!expansion.Token.isCancelled())
+        {
+            Util::Log(Util::Log_Info) << "[Song] Listed " << expansion.Added << " entries of " << expansion.Url;
+
+            // Nothing listed, leave the placeholder as a failed song
+            auto* placeholder = expansion.TakenOver ? nullptr : _findSongID(expansion.PlaceholderID, rebuilt);
+            if (placeholder)
+            {
+                auto error = expansion.Error.empty() ? "No entries found in " + expansion.Url : expansion.Error;
+                placeholder->Expanding = false;
+                _failedUpdate(*placeholder, error, ResolverCache::getSingleton().storeFailure(expansion.Url, error).RetryTime);
+            }
+        }
+
+        it = m_expansions.erase(it);
+    }
+}
+
+void Playlist::_cancelExpansions()
+{
+    for (auto& expansion : m_expansions)
+        expansion->Token.cancel();
+    m_expansions.clear();
+}
@@ -1,12 +1,21 @@
 #pragma once
 
+#include "Util/CancelToken.hpp"
+#include "Util/TimerQueue.hpp"
+
 #include <chrono>
 #include <deque>
+#include <functional>
 #include <future>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <cstdint>
 
 class Server;
+struct YoutubeDLResponse;
 
 class Playlist
 {
@@ -15,10 +24,19 @@ public:
     {
         std::string URL;
         size_t ID;
+        // Util::WorkQueue priority class for updates of the song
         int Priority;
 
+        struct Source
+        {
+            std::string URL;
+            std::unordered_map<std::string, std::string> Headers;
+        };
+
         std::string DataURL;
         std::unordered_map<std::string, std::string> DataHeaders;
+        // Other formats of the same resolve to fail over to, best first
+        std::deque<Source> DataAlternates;
         std::string ThumbnailURL;
 
         std::string Title;
@@ -27,13 +45,20 @@ public:
         std::chrono::nanoseconds Duration;
         std::chrono::system_clock::time_point UpdateTime;
         std::chrono::system_clock::time_point NextUpdateTime;
+        std::chrono::system_clock::time_point DataExpiry;
+        // Resolving failed, and won't be tried again before this
+        std::chrono::system_clock::time_point FailedUntil;
 
         std::shared_future<bool> UpdateTask;
 
         bool Direct;
+        // Placeholder for a playlist or channel whose entries are still being listed
+        bool Expanding;
 
         bool isDirect() const;
         bool isLocal() const;
+        bool isExpired() const;
+        bool isFailed() const;
 
         bool hasArtist() const;
         const std::string& getArtist() const;
@@ -76,6 +101,16 @@ public:
     virtual void update();
     virtual void setError(const std::string& aWhat) {}
 
+    // Threads used for resolving songs, 0 to size from the hardware; with more
+    // than one, one is kept free for songs about to play
+    static void setUpdateThreads(uint8_t aCount);
+    // Concurrent resolves per extractor, adapted between 1 and aMax from how the site copes
+    static void setExtractorConcurrency(double aInitial, double aMax);
+    // Called from resolver threads whenever results are waiting for deliverUpdates
+    static void setUpdateNotifier(const std::function<void()>& aNotify);
+    // Hands finished resolves to their songs, only ever from the main loop
+    static void deliverUpdates();
+
     void addFromPlaylist(const Playlist& aPlaylist);
     bool addFromFile(const std::string& aPath);
     bool loadFromFile(const std::string& aPath);
@@ -84,11 +119,40 @@ public:
 protected:
     virtual void _addedSong(Song& aSong);
     virtual void _updatedSong(Song& aSong);
+    // Whether a song needs a playable stream now, or can make do with cached metadata
+    virtual bool _shouldResolve(const Song& /* aSong */) const { return true; }
     Song& _addSong(const Song& aSong, int aPosition = -1);
     Song& _addSong(const std::string& aUrl, int aPosition = -1);
+    Song* _findSongID(size_t aID, bool& aRebuilt);
+    void _scheduleUpdate(const Song& aSong);
     void _queueUpdateSong(Song& aSong);
-    void _updateSong(Song& aSong);
+    // Stops waiting on the song's update, killing the resolve if nothing else wants it
+    void _cancelUpdate(Song& aSong);
+    void _setPriority(Song& aSong, int aPriority);
+    void _applyMetadata(Song& aSong, const YoutubeDLResponse& aResponse);
+    void _applyUpdate(Song& aSong, const YoutubeDLResponse& aResponse);
+    void _failedUpdate(Song& aSong, const std::string& aError, std::chrono::system_clock::time_point aRetryTime);
+    void _expandSong(Song& aSong, int aPosition);
+    void _addExpandedSongs();
+    void _cancelExpansions();
+
+    static void _resolveSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken);
+    // Reads direct media's tags in-process, unless aDirect only as a sniff next to youtube-dl
+    static void _probeSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, bool aDirect);
+    static bool _queueRequest(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, const std::string& aLimitKey);
+    static void _requestSong(const std::string& aKey, const std::string& aUrl, const Util::CancelToken& aToken, const std::string& aLimitKey);
+    // With a token, only finishes the resolve it belongs to
+    static void _finishUpdate(const std::string& aKey, const YoutubeDLResponse* aResponse, const std::string& aError, const Util::CancelToken& aToken = {});
+    static void _updatePendingSongs();
 
     SongArray m_songs;
     size_t m_songCounter;
+
+    // Songs due for an update, and where to find them by ID
+    Util::TimerQueue m_updateTimers;
+    std::unordered_map<size_t, size_t> m_songPositions;
+
+    // Collection URLs being listed in the background
+    struct Expansion;
+    std::vector<std::shared_ptr<Expansion>> m_expansions;
 };
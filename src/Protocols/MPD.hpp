@@ -138,10 +138,13 @@ private:
     int doCommands(const CommandParams& aParams);
     int doCommandList(uint32_t aClient, uint32_t aCommand);
     int doConsume(uint32_t aClient, uint32_t aCommand, bool aConsume);
+    int doCrossfade(uint32_t aClient, uint32_t aCommand, int aSeconds);
     int doCurrentsong(uint32_t aClient, uint32_t aCommand);
     int doDecoders(uint32_t aClient, uint32_t aCommand);
     int doDeleteid(uint32_t aClient, uint32_t aCommand, int aId);
     int doIdle(uint32_t aClient, uint32_t aCommand, uint16_t aIdleFlags);
+    int doMixrampdb(uint32_t aClient, uint32_t aCommand, float aDb);
+    int doMixrampdelay(uint32_t aClient, uint32_t aCommand, float aDelay);
     int doNext(uint32_t aClient, uint32_t aCommand);
     int doNoidle(uint32_t aClient, uint32_t aCommand);
     int doPause(uint32_t aClient, uint32_t aCommand, bool aPause);
@@ -1,11 +1,15 @@
 #include "../MPD.hpp"
 #include "../../Server.hpp"
+#include "../../Util/AudioCache.hpp"
 #include "../../Util/Logging.hpp"
+#include "../../Util/YoutubeDL.hpp"
 #include "Acks.hpp"
 #include "Commands.hpp"
 
 #include <sstream>
 
+#include <cmath>
+
 using Protocols::MPDProto;
 using namespace Protocols::MPD;
 
@@ -105,6 +109,13 @@ int MPDProto::runCommand(uint32_t aClient, uint32_t aCommand, const std::vector<
         case CommandID_command_list_ok_begin:
         case CommandID_command_list_end:
             ret = doCommandList(aClient, aCommand); break;
+        case CommandID_crossfade:
+            {
+                int seconds = std::stoi(std::string(aArgs.front()));
+                if (seconds < 0)
+                    throw MPDError(ACK_ERROR_ARG, command.Name, "Number too small: " + std::string(aArgs.front()));
+                ret = doCrossfade(aClient, aCommand, seconds);
+            } break;
         case CommandID_consume:
         case CommandID_random:
         case CommandID_repeat:
@@ -149,6 +160,10 @@ int MPDProto::runCommand(uint32_t aClient, uint32_t aCommand, const std::vector<
                     }
                 ret = doIdle(aClient, aCommand, flags);
             }break;
+        case CommandID_mixrampdb:
+            ret = doMixrampdb(aClient, aCommand, std::stof(std::string(aArgs.front()))); break;
+        case CommandID_mixrampdelay:
+            ret = doMixrampdelay(aClient, aCommand, std::stof(std::string(aArgs.front()))); break;
         case CommandID_next:
             ret = doNext(aClient, aCommand); break;
         case CommandID_noidle:
@@ -242,6 +257,11 @@ int MPDProto::doConsume(uint32_t aClient, uint32_t aCommand, bool aConsume)
     getServer().getQueue().setConsume(aConsume);
     return ACK_OK;
 }
+int MPDProto::doCrossfade(uint32_t aClient, uint32_t aCommand, int aSeconds)
+{
+    getServer().getQueue().setCrossfade(std::chrono::seconds(aSeconds));
+    return ACK_OK;
+}
 int MPDProto::doCurrentsong(uint32_t aClient, uint32_t aCommand)
 {
     writeData(aClient, helperCursongToStr(getServer().getQueue()));
@@ -380,6 +400,17 @@ int MPDProto::doPlchanges(uint32_t aClient, uint32_t aCommand)
     return ACK_OK;
 }
 
+int MPDProto::doMixrampdb(uint32_t aClient, uint32_t aCommand, float aDb)
+{
+    getServer().getQueue().setMixRampDb(aDb);
+    return ACK_OK;
+}
+int MPDProto::doMixrampdelay(uint32_t aClient, uint32_t aCommand, float aDelay)
+{
+    getServer().getQueue().setMixRampDelay(aDelay);
+    return ACK_OK;
+}
+
 int MPDProto::doPrevious(uint32_t aClient, uint32_t aCommand)
 {
     auto& queue = getServer().getQueue();
@@ -426,6 +457,49 @@ int MPDProto::doStats(uint32_t aClient, uint32_t aCommand)
         << "db_update: 0\n"
         << "playtime: 0\n";
 
+    auto resolver = YoutubeDL::getSingleton().getStats();
+    oss << "resolver_deadlines: " << resolver.Deadlines << "\n"
+        << "resolver_cancellations: " << resolver.Cancellations << "\n"
+        << "resolver_kills: " << resolver.Kills << "\n";
+
+    auto& recovery = getServer().getQueue().getRecoveryStats();
+    oss << "recoveries: " << recovery.Recoveries << "\n"
+        << "recovery_failures: " << recovery.Failures << "\n"
+        << "recovery_failovers: " << recovery.Failovers << "\n"
+        << "recovery_reresolves: " << recovery.Reresolves << "\n"
+        << "recovery_latency_last_ms: " << recovery.LastLatency.count() << "\n"
+        << "recovery_latency_max_ms: " << recovery.MaxLatency.count() << "\n"
+        << "recovery_latency_avg_ms: " << (recovery.Recoveries > 0 ? recovery.TotalLatency.count() / recovery.Recoveries : 0) << "\n";
+
+    auto& transitions = getServer().getQueue().getTransitionStats();
+    oss << "transitions: " << transitions.Transitions << "\n"
+        << "transitions_gapless: " << transitions.Gapless << "\n"
+        << "transition_gap_last_ms: " << transitions.LastGap.count() << "\n"
+        << "transition_gap_max_ms: " << transitions.MaxGap.count() << "\n"
+        << "transition_gap_avg_ms: " << (transitions.Transitions > 0 ? transitions.TotalGap.count() / transitions.Transitions : 0) << "\n";
+
+    auto audioCache = AudioCache::getSingleton().getStats();
+    oss << "audio_cache_hits: " << audioCache.Hits << "\n"
+        << "audio_cache_misses: " << audioCache.Misses << "\n"
+        << "audio_cache_stored: " << audioCache.Stored << "\n"
+        << "audio_cache_evicted: " << audioCache.Evicted << "\n"
+        << "audio_cache_entries: " << audioCache.Entries << "\n"
+        << "audio_cache_bytes: " << audioCache.Size << "\n";
+
+    auto& starts = getServer().getQueue().getStartStats();
+    auto streamed = starts.Starts - starts.Cached;
+    oss << "starts: " << starts.Starts << "\n"
+        << "starts_cached: " << starts.Cached << "\n"
+        << "start_latency_last_ms: " << starts.LastLatency.count() << "\n"
+        << "start_latency_cached_avg_ms: " << (starts.Cached > 0 ? starts.TotalCachedLatency.count() / starts.Cached : 0) << "\n"
+        << "start_latency_streamed_avg_ms: " << (streamed > 0 ? (starts.TotalLatency - starts.TotalCachedLatency).count() / streamed : 0) << "\n";
+
+    auto& prefetch = getServer().getQueue().getPrefetchStats();
+    oss << "prefetch_started: " << prefetch.Started << "\n"
+        << "prefetch_finished: " << prefetch.Finished << "\n"
+        << "prefetch_failed: " << prefetch.Failed << "\n"
+        << "prefetch_dropped: " << prefetch.Dropped << "\n";
+
     writeData(aClient, oss.str());
 
     return ACK_OK;
@@ -448,7 +522,10 @@ int MPDProto::doStatus(uint32_t aClient, uint32_t aCommand)
         << "consume: " << int(queue.hasConsume()) << "\n"
         << "playlist: " << 0 << "\n"
         << "playlistlength: " << queue.size() << "\n"
-        << "xfade: " << 0 << "\n";
+        << "xfade: " << queue.getCrossfade().count() << "\n"
+        << "mixrampdb: " << queue.getMixRampDb() << "\n";
+    if (!std::isnan(queue.getMixRampDelay()))
+        oss << "mixrampdelay: " << queue.getMixRampDelay() << "\n";
 
     switch(status)
     {
@@ -2,7 +2,12 @@
 #include "Protocols/MPD.hpp"
 #include "Protocols/MPRIS.hpp"
 #include "Protocols/REST.hpp"
+#include "Util/AudioCache.hpp"
+#include "Util/DirectMedia.hpp"
+#include "Util/FormatSelector.hpp"
 #include "Util/Logging.hpp"
+#include "Util/Path.hpp"
+#include "Util/ResolverCache.hpp"
 #include "Util/YoutubeDL.hpp"
 
 #include <algorithm>
@@ -17,6 +22,11 @@ Server::Server()
     m_config.loadDefaults();
 }
 
+Server::~Server()
+{
+    Playlist::setUpdateNotifier(nullptr);
+}
+
 void Server::init(int aArgc, const char** aArgv)
 {
     m_config.loadFromArgs(aArgc, aArgv);
@@ -36,6 +46,35 @@ void Server::init(int aArgc, const char** aArgv)
 
     YoutubeDL& ydl = YoutubeDL::getSingleton();
     ydl.findInstall();
+    if (m_config.hasValue("YoutubeDL/Worker"))
+        ydl.setWorkerPool(Util::ExpandPath(m_config.getValue("YoutubeDL/Worker")).string(), m_config.getValueConv<uint8_t>("YoutubeDL/Workers", 0));
+    ydl.setBatchSize(m_config.getValueConv<uint32_t>("YoutubeDL/BatchSize", 5));
+    ydl.setTimeout(std::chrono::seconds(m_config.getValueConv<uint32_t>("YoutubeDL/Timeout", 60)));
+    ydl.setTrimmedOutput(m_config.getValueConv<bool>("YoutubeDL/TrimmedOutput", true));
+
+    FormatSelector::Options formats;
+    formats.Codecs = m_config.getValue("Formats/Codecs", "");
+    formats.Containers = m_config.getValue("Formats/Containers", "");
+    formats.MaxBitrate = m_config.getValueConv<double>("Formats/MaxBitrate", 0);
+    formats.PreferSized = m_config.getValueConv<bool>("Formats/PreferSized", true);
+    formats.Alternates = m_config.getValueConv<uint32_t>("Formats/Alternates", 2);
+    FormatSelector::getSingleton().configure(formats);
+
+    auto& direct = DirectMedia::getSingleton();
+    direct.setHosts(m_config.getValue("Direct/Hosts", ""));
+    direct.setSniffing(m_config.getValueConv<bool>("Direct/Sniff", true));
+    direct.setTimeout(std::chrono::seconds(m_config.getValueConv<uint32_t>("Direct/Timeout", 5)));
+
+    // One of the threads is kept for playback and prefetching, so metadata and
+    // background resolves get at most Resolver/Threads - 1 of them
+    Playlist::setUpdateThreads(m_config.getValueConv<uint8_t>("Resolver/Threads", 0));
+    Playlist::setExtractorConcurrency(m_config.getValueConv<double>("Resolver/ExtractorConcurrency", 2), m_config.getValueConv<double>("Resolver/ExtractorMaxConcurrency", 8));
+
+    if (m_config.getValueConv("Cache/Resolver", true))
+        ResolverCache::getSingleton().open(Util::ExpandPath(m_config.getValue("CacheDir")) / "resolver", m_config.getValueConv<uint64_t>("Cache/ResolverMaxSize", 16 * 1024 * 1024));
+    if (m_config.getValueConv("Cache/Audio", m_config.getValueConv("Cache/Enabled", false)))
+        AudioCache::getSingleton().open(Util::ExpandPath(m_config.getValue("CacheDir")) / "audio", m_config.getValueConv<uint64_t>("Cache/AudioMaxSize", uint64_t(1024) * 1024 * 1024));
+
     if (!ydl.isAvailable())
     {
         Util::Log(Util::Log_Info) << "No YDL found";
@@ -53,6 +92,11 @@ void Server::init(int aArgc, const char** aArgv)
     m_mainLoop = Glib::MainLoop::create();
     m_ticker = Glib::signal_timeout().connect(sigc::mem_fun(*this, &Server::on_tick), 100);
 
+    // Resolves finish on worker threads, their results are applied to songs from here
+    m_resolveDispatcher = std::make_unique<Glib::Dispatcher>();
+    m_resolveDispatcher->connect(sigc::ptr_fun(&Playlist::deliverUpdates));
+    Playlist::setUpdateNotifier([this]() { m_resolveDispatcher->emit(); });
+
     m_activePlaylist.init(*this);
 
     m_pipeline = m_activePlaylist.getPipeline();
@@ -123,6 +167,9 @@ void Server::pushEvent(const Protocols::Event& aEvent)
 
 bool Server::on_tick()
 {
+    // Refresh timers, the resolve window, listings and prefetching all run from here
+    m_activePlaylist.update();
+
     // Update protocols
     for (auto& prot : m_activeProtocols)
     {
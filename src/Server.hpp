@@ -10,12 +10,14 @@
 #include <vector>
 
 #include <gstreamermm.h>
+#include <glibmm/dispatcher.h>
 #include <glibmm/main.h>
 
 class Server
 {
 public:
     Server();
+    ~Server();
 
     void init(int aArgc, const char** aArgv);
     void run();
@@ -43,6 +45,7 @@ private:
     std::chrono::system_clock::time_point m_startTime;
 
     sigc::connection m_ticker;
+    std::unique_ptr<Glib::Dispatcher> m_resolveDispatcher;
 
     Glib::RefPtr<Gst::Element> m_pipeline;
     Glib::RefPtr<Glib::MainLoop> m_mainLoop;
@@ -0,0 +1,188 @@
+#include "AdaptiveLimiter.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using Util::AdaptiveLimiter;
+
+namespace
+{
+
+constexpr double kMinLimit = 1;
+// Latency this far above the best seen counts as the remote struggling
+constexpr double kLatencyFactor = 1.5;
+
+}
+
+AdaptiveLimiter::AdaptiveLimiter()
+    : m_initialLimit(2)
+    , m_maxLimit(8)
+{
+}
+
+void AdaptiveLimiter::setLimits(double aInitial, double aMax)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_maxLimit = std::max(aMax, kMinLimit);
+    m_initialLimit = std::clamp(aInitial, kMinLimit, m_maxLimit);
+}
+
+bool AdaptiveLimiter::acquire(const std::string& aKey, int aPriority, uintptr_t aId, GrantCallback aGranted)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    auto& key = _getKey(aKey);
+
+    if (key.Waiting.empty() && key.Active < size_t(key.Limit))
+    {
+        ++key.Active;
+        return true;
+    }
+
+    _insertWaiter(key, { aPriority, aId, std::move(aGranted) }, false);
+    return false;
+}
+
+void AdaptiveLimiter::release(const std::string& aKey, Outcome aOutcome, std::chrono::nanoseconds aLatency)
+{
+    {
+        std::lock_guard<std::mutex> _lock(m_mutex);
+        auto& key = _getKey(aKey);
+        if (key.Active > 0)
+            --key.Active;
+
+        auto oldLimit = key.Limit;
+        switch (aOutcome)
+        {
+        case Outcome_Throttled:
+            key.Ceiling = key.Limit;
+            key.Limit = std::max(key.Limit / 2, kMinLimit);
+            key.Cooldown = size_t(std::ceil(key.Limit));
+            ++key.Throttled;
+            break;
+
+        case Outcome_Success:
+            if (key.Latency.count() == 0)
+                key.Latency = key.BaseLatency = aLatency;
+            else
+            {
+                key.Latency = (key.Latency * 7 + aLatency) / 8;
+                // Let the baseline creep up, so a remote that got slower for
+                // good doesn't keep the limit pinned down forever
+                key.BaseLatency = std::min(key.Latency, key.BaseLatency + (key.Latency - key.BaseLatency) / 64);
+            }
+
+            if (key.Cooldown > 0)
+                --key.Cooldown;
+            else if (key.Latency > key.BaseLatency * kLatencyFactor)
+            {
+                key.Limit = std::max(key.Limit * 0.8, kMinLimit);
+                key.Cooldown = size_t(std::ceil(key.Limit));
+            }
+            else
+            {
+                // Probe carefully near where the remote last pushed back, one
+                // more slot per window everywhere else
+                if (key.Limit > key.Ceiling)
+                    key.Ceiling = 0;
+
+                double step = 1 / key.Limit;
+                if (key.Ceiling > 0 && key.Limit + 1 >= key.Ceiling)
+                    step /= 4;
+
+                key.Limit = std::min(key.Limit + step, m_maxLimit);
+            }
+            break;
+
+        // Plain failures say nothing about how busy the remote is
+        case Outcome_Failed:
+        default:
+            break;
+        }
+
+        if (size_t(key.Limit) != size_t(oldLimit))
+            Util::Log(Util::Log_Debug) << "[Limit] " << aKey << " concurrency " << size_t(oldLimit) << " -> " << size_t(key.Limit)
+                << (aOutcome == Outcome_Throttled ? " (throttled)" : "");
+    }
+
+    _grant(aKey);
+}
+
+bool AdaptiveLimiter::reprioritise(uintptr_t aId, int aPriority)
+{
+    if (aId == 0)
+        return false;
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    bool found = false;
+    for (auto& key : m_keys)
+    {
+        auto& waiting = key.second.Waiting;
+        auto it = std::find_if(waiting.begin(), waiting.end(), [aId, aPriority](auto& waiter) { return waiter.Id == aId && waiter.Priority != aPriority; });
+        if (it == waiting.end())
+            continue;
+
+        auto waiter = std::move(*it);
+        waiting.erase(it);
+
+        bool promoted = aPriority < waiter.Priority;
+        waiter.Priority = aPriority;
+        _insertWaiter(key.second, std::move(waiter), promoted);
+        found = true;
+    }
+
+    return found;
+}
+
+std::unordered_map<std::string, AdaptiveLimiter::KeyStats> AdaptiveLimiter::getStats() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    std::unordered_map<std::string, KeyStats> stats;
+    for (auto& key : m_keys)
+        stats[key.first] = { key.second.Limit, key.second.Active, key.second.Waiting.size(), key.second.Throttled, key.second.Latency };
+    return stats;
+}
+
+AdaptiveLimiter::Key& AdaptiveLimiter::_getKey(const std::string& aKey)
+{
+    auto it = m_keys.find(aKey);
+    if (it == m_keys.end())
+        it = m_keys.emplace(aKey, Key{ m_initialLimit, 0, {}, {}, {}, 0, 0, 0 }).first;
+    return it->second;
+}
+
+void AdaptiveLimiter::_insertWaiter(Key& aKey, Waiter&& aWaiter, bool aFront)
+{
+    auto& waiting = aKey.Waiting;
+    auto it = aFront
+        ? std::find_if(waiting.begin(), waiting.end(), [&aWaiter](auto& waiter) { return waiter.Priority >= aWaiter.Priority; })
+        : std::find_if(waiting.begin(), waiting.end(), [&aWaiter](auto& waiter) { return waiter.Priority > aWaiter.Priority; });
+    waiting.insert(it, std::move(aWaiter));
+}
+
+void AdaptiveLimiter::_grant(const std::string& aKey)
+{
+    // Callbacks may queue work or take other locks, so run them unlocked
+    while (true)
+    {
+        GrantCallback granted;
+        {
+            std::lock_guard<std::mutex> _lock(m_mutex);
+            auto& key = _getKey(aKey);
+            if (key.Waiting.empty() || key.Active >= size_t(key.Limit))
+                return;
+
+            granted = std::move(key.Waiting.front().Granted);
+            key.Waiting.pop_front();
+            ++key.Active;
+        }
+
+        if (granted())
+            continue;
+
+        std::lock_guard<std::mutex> _lock(m_mutex);
+        --_getKey(aKey).Active;
+    }
+}
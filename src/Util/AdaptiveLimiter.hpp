@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+namespace Util
+{
+
+// Per-key concurrency limit that adapts AIMD-style.
+//
+// Every success grows a key's limit by about one slot per window of
+// requests. Being throttled halves it, and latency climbing well above the
+// best seen for the key shrinks it a little. Callers that don't get a slot
+// are queued by priority and called back once one frees up, so nothing
+// blocks waiting.
+class AdaptiveLimiter
+{
+public:
+    enum Outcome
+    {
+        // Completed, latency is used as a load signal
+        Outcome_Success,
+        // Failed in a way that says nothing about the remote's load
+        Outcome_Failed,
+        // The remote pushed back, rate limited or timed out
+        Outcome_Throttled,
+    };
+
+    struct KeyStats
+    {
+        double Limit;
+        size_t Active;
+        size_t Waiting;
+        uint64_t Throttled;
+        std::chrono::nanoseconds Latency;
+    };
+
+    // Called with the slot already taken, returns false when the slot is no
+    // longer needed, which hands it on to the next waiter instead
+    using GrantCallback = std::function<bool()>;
+
+    AdaptiveLimiter();
+
+    void setLimits(double aInitial, double aMax);
+
+    // Takes a slot for aKey and returns true if one is free, otherwise
+    // queues aGranted to be called once there is one. Lower priorities are
+    // granted first, like WorkQueue::Priority, and in order within one
+    bool acquire(const std::string& aKey, int aPriority, uintptr_t aId, GrantCallback aGranted);
+    void release(const std::string& aKey, Outcome aOutcome, std::chrono::nanoseconds aLatency = {});
+
+    // Moves waiters queued with a non-zero aId, promoted ones to the front of their new priority
+    bool reprioritise(uintptr_t aId, int aPriority);
+
+    std::unordered_map<std::string, KeyStats> getStats() const;
+
+private:
+    struct Waiter
+    {
+        int Priority;
+        uintptr_t Id;
+        GrantCallback Granted;
+    };
+
+    struct Key
+    {
+        double Limit;
+        size_t Active;
+        // Sorted by priority
+        std::deque<Waiter> Waiting;
+
+        std::chrono::nanoseconds Latency;
+        std::chrono::nanoseconds BaseLatency;
+        // Completions left before the limit may grow or shrink on latency again
+        size_t Cooldown;
+        // Limit the remote last throttled at, zero once it has been passed
+        double Ceiling;
+        uint64_t Throttled;
+    };
+
+    Key& _getKey(const std::string& aKey);
+    static void _insertWaiter(Key& aKey, Waiter&& aWaiter, bool aFront);
+    void _grant(const std::string& aKey);
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Key> m_keys;
+    double m_initialLimit,
+           m_maxLimit;
+};
+
+}
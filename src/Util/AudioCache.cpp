@@ -0,0 +1,341 @@
+#include "AudioCache.hpp"
+#include "Logging.hpp"
+#include "YoutubeDL.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr const char* kPartExtension = ".part";
+
+bool writeAll(int aFd, const uint8_t* aData, size_t aSize)
+{
+    while (aSize > 0)
+    {
+        ssize_t len = ::write(aFd, aData, aSize);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        aData += len;
+        aSize -= size_t(len);
+    }
+    return true;
+}
+
+}
+
+AudioCache::Writer::Writer(AudioCache& aCache, const std::string& aKey, const std::filesystem::path& aPath, int aFd, uint64_t aMaxSize)
+    : m_cache(aCache)
+    , m_key(aKey)
+    , m_path(aPath)
+    , m_fd(aFd)
+    , m_written(0)
+    , m_maxSize(aMaxSize)
+{
+}
+
+AudioCache::Writer::~Writer()
+{
+    // Never finished, so there's nothing worth keeping
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        std::error_code ec;
+        std::filesystem::remove(m_path, ec);
+        m_cache._release(m_key);
+    }
+}
+
+bool AudioCache::Writer::write(uint64_t aOffset, const uint8_t* aData, size_t aSize)
+{
+    if (m_fd < 0)
+        return false;
+
+    // Anything but the stream from start to end in order would be a broken file
+    if (aOffset != m_written || m_written + aSize > m_maxSize || !writeAll(m_fd, aData, aSize))
+    {
+        Util::Log(Util::Log_Debug) << "[Cache] Not caching " << m_key << ", the stream " << (aOffset != m_written ? "skipped" : "didn't fit");
+        ::close(m_fd);
+        m_fd = -1;
+
+        std::error_code ec;
+        std::filesystem::remove(m_path, ec);
+        m_cache._release(m_key);
+        return false;
+    }
+
+    m_written += aSize;
+    return true;
+}
+
+void AudioCache::Writer::finish(uint64_t aExpectedSize)
+{
+    if (m_fd < 0)
+        return;
+
+    // A server closing early ends the stream just the same, and the cached
+    // file would stand in for the song on every play after
+    bool whole = aExpectedSize == 0 || m_written == aExpectedSize;
+    if (!whole)
+        Util::Log(Util::Log_Debug) << "[Cache] Not caching " << m_key << ", the stream ended after " << m_written << " of " << aExpectedSize << " bytes";
+
+    // On disk before it's renamed, so the cache only ever holds whole songs
+    bool synced = whole && m_written > 0 && fsync(m_fd) == 0;
+    ::close(m_fd);
+    m_fd = -1;
+
+    if (synced)
+        m_cache._commit(m_key, m_path, m_written);
+    else
+    {
+        std::error_code ec;
+        std::filesystem::remove(m_path, ec);
+        m_cache._release(m_key);
+    }
+}
+
+AudioCache::AudioCache()
+    : m_maxSize(0)
+    , m_size(0)
+    , m_stats{}
+{
+}
+
+AudioCache::~AudioCache()
+{
+    close();
+}
+
+AudioCache& AudioCache::getSingleton()
+{
+    static AudioCache s_cache;
+    return s_cache;
+}
+
+bool AudioCache::open(const std::filesystem::path& aDirectory, uint64_t aMaxSize)
+{
+    close();
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    std::error_code ec;
+    std::filesystem::create_directories(aDirectory, ec);
+    if (ec)
+    {
+        Util::Log(Util::Log_Warning) << "[Cache] Failed to create " << aDirectory.string() << " (" << ec.message() << ")";
+        return false;
+    }
+
+    for (auto& file : std::filesystem::directory_iterator(aDirectory, ec))
+    {
+        if (!file.is_regular_file(ec))
+            continue;
+
+        // Left behind by songs that were playing when the server went down
+        if (file.path().extension() == kPartExtension)
+        {
+            std::filesystem::remove(file.path(), ec);
+            continue;
+        }
+
+        auto size = file.file_size(ec);
+        if (ec)
+            continue;
+
+        m_index[file.path().filename().string()] = Entry{ size, file.last_write_time(ec) };
+        m_size += size;
+    }
+
+    m_directory = aDirectory;
+    m_maxSize = aMaxSize;
+    _evict();
+
+    Util::Log(Util::Log_Info) << "[Cache] Using audio cache in " << aDirectory.string() << " (" << m_index.size() << " songs, " << m_size / (1024 * 1024) << " MiB)";
+    return true;
+}
+
+void AudioCache::close()
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    m_directory.clear();
+    m_index.clear();
+    m_size = 0;
+}
+
+bool AudioCache::isOpen() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    return !m_directory.empty();
+}
+
+std::filesystem::path AudioCache::find(const std::string& aUrl) const
+{
+    auto key = Key(aUrl);
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (m_index.count(key) == 0)
+        return {};
+
+    return m_directory / key;
+}
+
+std::string AudioCache::playbackUri(const std::string& aUrl, const std::string& aDataUrl, bool aLocal) const
+{
+    if (!aLocal)
+    {
+        auto cached = find(aUrl);
+        if (!cached.empty())
+            return "file://" + cached.string();
+    }
+
+    if (!aDataUrl.empty())
+        return aDataUrl;
+    return aUrl;
+}
+
+bool AudioCache::use(const std::string& aUrl)
+{
+    auto key = Key(aUrl);
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    auto it = m_index.find(key);
+    if (it == m_index.end())
+        return false;
+
+    // The file times are the only record of use that survives a restart
+    std::error_code ec;
+    it->second.LastUse = std::filesystem::file_time_type::clock::now();
+    std::filesystem::last_write_time(m_directory / key, it->second.LastUse, ec);
+
+    ++m_stats.Hits;
+    return true;
+}
+
+void AudioCache::miss()
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (!m_directory.empty())
+        ++m_stats.Misses;
+}
+
+std::unique_ptr<AudioCache::Writer> AudioCache::store(const std::string& aUrl, uint64_t aMaxSize)
+{
+    auto key = Key(aUrl);
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (m_directory.empty())
+        return nullptr;
+
+    if (m_index.count(key) > 0 || !m_writing.insert(key).second)
+        return nullptr;
+
+    auto path = m_directory / (key + kPartExtension);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        Util::Log(Util::Log_Warning) << "[Cache] Failed to open " << path.string() << " (" << errno << ")";
+        m_writing.erase(key);
+        return nullptr;
+    }
+
+    // A single song isn't allowed to push out most of the cache
+    auto maxSize = m_maxSize / 4;
+    if (aMaxSize > 0)
+        maxSize = std::min(maxSize, aMaxSize);
+    return std::unique_ptr<Writer>(new Writer(*this, key, path, fd, maxSize));
+}
+
+AudioCache::Stats AudioCache::getStats() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    auto stats = m_stats;
+    stats.Entries = m_index.size();
+    stats.Size = m_size;
+    return stats;
+}
+
+std::string AudioCache::Key(const std::string& aUrl)
+{
+    // FNV-1a, stable across runs and platforms unlike std::hash
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : YoutubeDL::NormaliseUrl(aUrl))
+    {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+    return key;
+}
+
+void AudioCache::_commit(const std::string& aKey, const std::filesystem::path& aPart, uint64_t aSize)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_writing.erase(aKey);
+
+    std::error_code ec;
+    if (m_directory.empty())
+    {
+        std::filesystem::remove(aPart, ec);
+        return;
+    }
+
+    std::filesystem::rename(aPart, m_directory / aKey, ec);
+    if (ec)
+    {
+        Util::Log(Util::Log_Warning) << "[Cache] Failed to store " << aKey << " (" << ec.message() << ")";
+        std::filesystem::remove(aPart, ec);
+        return;
+    }
+
+    m_index[aKey] = Entry{ aSize, std::filesystem::file_time_type::clock::now() };
+    m_size += aSize;
+    ++m_stats.Stored;
+
+    Util::Log(Util::Log_Debug) << "[Cache] Stored " << aKey << " (" << aSize / 1024 << " KiB)";
+    _evict();
+}
+
+void AudioCache::_release(const std::string& aKey)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_writing.erase(aKey);
+}
+
+void AudioCache::_evict()
+{
+    if (m_size <= m_maxSize)
+        return;
+
+    std::vector<std::pair<std::filesystem::file_time_type, std::string>> byUse;
+    byUse.reserve(m_index.size());
+    for (auto& entry : m_index)
+        byUse.emplace_back(entry.second.LastUse, entry.first);
+    std::sort(byUse.begin(), byUse.end());
+
+    std::error_code ec;
+    for (auto& entry : byUse)
+    {
+        if (m_size <= m_maxSize)
+            break;
+
+        std::filesystem::remove(m_directory / entry.second, ec);
+        m_size -= m_index[entry.second].Size;
+        m_index.erase(entry.second);
+        ++m_stats.Evicted;
+    }
+}
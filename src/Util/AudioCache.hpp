@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Path.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cstdint>
+
+// On-disk cache of the audio of played songs, keyed by the song itself
+// rather than by its stream URL, which expires.
+//
+// Streams are copied into a part file as they play, and only take their
+// place in the cache once complete, so a crash never leaves half a song to
+// be served. The least recently played songs make room for new ones.
+class AudioCache
+{
+public:
+    struct Stats
+    {
+        // Songs played from the cache, and streamed while it was open
+        uint64_t Hits;
+        uint64_t Misses;
+        uint64_t Stored;
+        uint64_t Evicted;
+        uint64_t Entries;
+        uint64_t Size;
+    };
+
+    // Copies one stream into the cache as it's read, gives up if the stream skips around
+    class Writer
+    {
+    public:
+        Writer(const Writer&) = delete;
+        ~Writer();
+
+        Writer& operator=(const Writer&) = delete;
+
+        bool write(uint64_t aOffset, const uint8_t* aData, size_t aSize);
+        // The stream ended. With its size known, a stream cut short is thrown out
+        void finish(uint64_t aExpectedSize = 0);
+
+    private:
+        friend class AudioCache;
+
+        Writer(AudioCache& aCache, const std::string& aKey, const std::filesystem::path& aPath, int aFd, uint64_t aMaxSize);
+
+        AudioCache& m_cache;
+        std::string m_key;
+        std::filesystem::path m_path;
+        int m_fd;
+        uint64_t m_written,
+                 m_maxSize;
+    };
+
+    AudioCache();
+    AudioCache(const AudioCache&) = delete;
+    ~AudioCache();
+
+    AudioCache& operator=(const AudioCache&) = delete;
+
+    static AudioCache& getSingleton();
+
+    bool open(const std::filesystem::path& aDirectory, uint64_t aMaxSize);
+    void close();
+    bool isOpen() const;
+
+    // Cached audio for a song, empty if there is none
+    std::filesystem::path find(const std::string& aUrl) const;
+    // What playback opens for a song: its cached audio, then its resolved
+    // stream, then the song URL itself. Local songs never go through the cache
+    std::string playbackUri(const std::string& aUrl, const std::string& aDataUrl, bool aLocal) const;
+    // Counts a play from the cache, and keeps the song from being evicted for a while
+    bool use(const std::string& aUrl);
+    // Counts a play that streamed, while the cache was open
+    void miss();
+    // Starts caching a song as it streams, unless it's cached or being cached
+    // already. Streams bigger than aMaxSize, or a quarter of the cache, aren't kept
+    std::unique_ptr<Writer> store(const std::string& aUrl, uint64_t aMaxSize = 0);
+
+    Stats getStats() const;
+
+    static std::string Key(const std::string& aUrl);
+
+private:
+    struct Entry
+    {
+        uint64_t Size;
+        std::filesystem::file_time_type LastUse;
+    };
+
+    void _commit(const std::string& aKey, const std::filesystem::path& aPart, uint64_t aSize);
+    void _release(const std::string& aKey);
+    void _evict();
+
+    mutable std::mutex m_mutex;
+    std::filesystem::path m_directory;
+    uint64_t m_maxSize,
+             m_size;
+    std::unordered_map<std::string, Entry> m_index;
+    std::unordered_set<std::string> m_writing;
+    Stats m_stats;
+};
@@ -0,0 +1,114 @@
+#include "CancelToken.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+using Util::CancelToken;
+
+struct CancelToken::State
+{
+    std::mutex Mutex;
+    std::atomic_bool Cancelled;
+    std::atomic<Clock::rep> Deadline;
+    std::vector<std::pair<size_t, std::function<void()>>> Callbacks;
+    size_t CallbackCounter;
+
+    State()
+        : Cancelled(false)
+        , Deadline(0)
+        , CallbackCounter(0)
+    { }
+};
+
+CancelToken CancelToken::Create()
+{
+    CancelToken token;
+    token.m_state = std::make_shared<State>();
+    return token;
+}
+
+void CancelToken::cancel() const
+{
+    if (!m_state)
+        return;
+
+    std::lock_guard<std::mutex> _lock(m_state->Mutex);
+    if (m_state->Cancelled.exchange(true))
+        return;
+
+    for (auto& callback : m_state->Callbacks)
+        callback.second();
+}
+
+bool CancelToken::isCancelled() const
+{
+    return m_state && m_state->Cancelled;
+}
+
+void CancelToken::setDeadline(Clock::time_point aDeadline) const
+{
+    if (!m_state)
+        return;
+
+    // Zero marks an unset deadline, so clamp anything landing on it
+    auto ticks = std::max<Clock::rep>(aDeadline.time_since_epoch().count(), 1);
+    Clock::rep unset = 0;
+    m_state->Deadline.compare_exchange_strong(unset, ticks);
+}
+
+bool CancelToken::hasDeadline() const
+{
+    return m_state && m_state->Deadline != 0;
+}
+
+CancelToken::Clock::time_point CancelToken::getDeadline() const
+{
+    if (!hasDeadline())
+        return Clock::time_point::max();
+
+    return Clock::time_point(Clock::duration(m_state->Deadline.load()));
+}
+
+bool CancelToken::isExpired() const
+{
+    return hasDeadline() && Clock::now() >= getDeadline();
+}
+
+int CancelToken::pollTimeout() const
+{
+    if (!hasDeadline())
+        return -1;
+
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(getDeadline() - Clock::now()).count();
+    return int(std::clamp<decltype(left)>(left, 0, std::numeric_limits<int>::max()));
+}
+
+size_t CancelToken::subscribe(std::function<void()> aCallback) const
+{
+    if (!m_state)
+        return 0;
+
+    std::lock_guard<std::mutex> _lock(m_state->Mutex);
+    if (m_state->Cancelled)
+    {
+        aCallback();
+        return 0;
+    }
+
+    auto id = ++m_state->CallbackCounter;
+    m_state->Callbacks.emplace_back(id, std::move(aCallback));
+    return id;
+}
+
+void CancelToken::unsubscribe(size_t aId) const
+{
+    if (!m_state || aId == 0)
+        return;
+
+    std::lock_guard<std::mutex> _lock(m_state->Mutex);
+    auto& callbacks = m_state->Callbacks;
+    callbacks.erase(std::remove_if(callbacks.begin(), callbacks.end(), [aId](auto& it) { return it.first == aId; }), callbacks.end());
+}
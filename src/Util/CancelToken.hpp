@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include <cstddef>
+
+namespace Util
+{
+
+// Shared stop flag and deadline for a piece of long-running work.
+//
+// Copies share their state, so whoever owns the work can cancel it from any
+// thread. Blocking code subscribes a callback that unblocks it, which runs
+// immediately on cancel() - or right away if the token is already cancelled.
+class CancelToken
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A token that can never be cancelled and has no deadline
+    CancelToken() = default;
+
+    static CancelToken Create();
+
+    bool valid() const { return bool(m_state); }
+    // Whether both are copies of the same token
+    bool operator==(const CancelToken& aOther) const { return m_state == aOther.m_state; }
+
+    void cancel() const;
+    bool isCancelled() const;
+
+    // Only the first deadline sticks, so nested users can't extend it
+    void setDeadline(Clock::time_point aDeadline) const;
+    bool hasDeadline() const;
+    Clock::time_point getDeadline() const;
+    bool isExpired() const;
+
+    bool stopRequested() const { return isCancelled() || isExpired(); }
+    // Milliseconds left until the deadline, for poll(), -1 if there is none
+    int pollTimeout() const;
+
+    // Callbacks run under the token lock, unsubscribe() waits for them to finish
+    size_t subscribe(std::function<void()> aCallback) const;
+    void unsubscribe(size_t aId) const;
+
+    // Keeps a callback subscribed until it goes out of scope
+    class Subscription
+    {
+    public:
+        Subscription(const CancelToken& aToken, std::function<void()> aCallback)
+            : m_token(aToken)
+            , m_id(aToken.subscribe(std::move(aCallback)))
+        { }
+        Subscription(const Subscription&) = delete;
+        ~Subscription() { reset(); }
+
+        Subscription& operator=(const Subscription&) = delete;
+
+        void reset() { m_token.unsubscribe(m_id); m_id = 0; }
+
+    private:
+        const CancelToken& m_token;
+        size_t m_id;
+    };
+
+private:
+    struct State;
+
+    std::shared_ptr<State> m_state;
+};
+
+}
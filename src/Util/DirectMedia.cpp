@@ -0,0 +1,180 @@
+#include "DirectMedia.hpp"
+#include "Logging.hpp"
+#include "YoutubeDL.hpp"
+#include "YoutubeDLParser.hpp"
+
+#include <gstreamermm.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string_view>
+
+#include <cctype>
+
+namespace
+{
+
+// Files GStreamer plays by itself, including HLS playlists
+const std::string_view MEDIA_EXTENSIONS[] = {
+    "mp3", "ogg", "oga", "opus", "flac", "wav", "wave", "aac", "m4a", "m4b",
+    "mka", "weba", "webm", "mp4", "aif", "aiff", "wma", "m3u8",
+};
+
+// Sites youtube-dl has extractors for, not worth sniffing (without www.)
+const std::string_view PAGE_HOSTS[] = {
+    "youtube.com", "youtu.be", "soundcloud.com", "bandcamp.com", "vimeo.com",
+    "mixcloud.com", "twitch.tv", "dailymotion.com", "nicovideo.jp", "bilibili.com",
+    "twitter.com", "x.com", "reddit.com", "tiktok.com", "instagram.com", "facebook.com",
+};
+
+bool endsWith(std::string_view aValue, std::string_view aSuffix)
+{
+    return aValue.size() >= aSuffix.size() && aValue.substr(aValue.size() - aSuffix.size()) == aSuffix;
+}
+
+}
+
+DirectMedia::DirectMedia()
+    : m_sniff(true)
+    , m_timeout(5)
+{
+}
+
+DirectMedia& DirectMedia::getSingleton()
+{
+    static DirectMedia s_directMedia;
+    return s_directMedia;
+}
+
+void DirectMedia::setHosts(const std::string& aHosts)
+{
+    std::vector<std::string> hosts;
+
+    std::istringstream iss(aHosts);
+    for (std::string host; std::getline(iss, host, ','); )
+    {
+        host.erase(std::remove_if(host.begin(), host.end(), [](unsigned char c) { return std::isspace(c); }), host.end());
+        std::transform(host.begin(), host.end(), host.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!host.empty())
+            hosts.push_back(std::move(host));
+    }
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_hosts = std::move(hosts);
+}
+
+void DirectMedia::setSniffing(bool aSniff)
+{
+    m_sniff = aSniff;
+}
+bool DirectMedia::isSniffing() const
+{
+    return m_sniff;
+}
+
+void DirectMedia::setTimeout(std::chrono::seconds aTimeout)
+{
+    m_timeout = aTimeout;
+}
+
+DirectMedia::Kind DirectMedia::classify(const std::string& aUrl) const
+{
+    auto url = YoutubeDL::NormaliseUrl(aUrl);
+    if (url.compare(0, 7, "http://") != 0 && url.compare(0, 8, "https://") != 0)
+        return Kind_Page;
+
+    auto host = Host(url);
+    {
+        std::lock_guard<std::mutex> _lock(m_mutex);
+        for (auto& pattern : m_hosts)
+            if (MatchesHost(host, pattern))
+                return Kind_Direct;
+    }
+
+    for (auto pattern : PAGE_HOSTS)
+        if (MatchesHost(host, std::string(pattern)))
+            return Kind_Page;
+
+    // Only the last path segment counts, the query often carries other URLs
+    std::string_view path(url);
+    path = path.substr(0, path.find_first_of("?#", url.find("://") + 3));
+    auto segment = path.substr(path.rfind('/') + 1);
+    auto dot = segment.rfind('.');
+    if (dot != std::string_view::npos)
+    {
+        std::string ext(segment.substr(dot + 1));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (std::find(std::begin(MEDIA_EXTENSIONS), std::end(MEDIA_EXTENSIONS), ext) != std::end(MEDIA_EXTENSIONS))
+            return Kind_Direct;
+    }
+
+    return Kind_Unknown;
+}
+
+bool DirectMedia::probe(const std::string& aUrl, YoutubeDLResponse& aResponse, std::string& aError) const
+{
+    Glib::RefPtr<Gst::DiscovererInfo> info;
+    try
+    {
+        auto discoverer = Gst::Discoverer::create(std::chrono::duration_cast<std::chrono::nanoseconds>(m_timeout).count());
+        info = discoverer->discover_uri(aUrl);
+    }
+    catch (const Glib::Error& ex)
+    {
+        aError = ex.what().raw();
+        return false;
+    }
+
+    if (!info || info->get_result() != Gst::DISCOVERER_OK)
+    {
+        aError = "Not a playable stream";
+        return false;
+    }
+    if (info->get_audio_streams().empty())
+    {
+        aError = "No audio in stream";
+        return false;
+    }
+
+    aResponse = YoutubeDLResponse{ true };
+    aResponse.Direct = true;
+    aResponse.Duration = uint32_t(info->get_duration() / GST_SECOND);
+    aResponse.Extractor = "Direct";
+    aResponse.SourceUrl = aUrl;
+    aResponse.DownloadUrl = aUrl;
+    aResponse.Expiry = YoutubeDLParser::GetExpiry(aUrl, aResponse.Extractor);
+
+    Glib::ustring ustr;
+    auto tags = info->get_tags();
+    if (tags.gobj() && tags.get(Gst::TAG_TITLE, ustr))
+        aResponse.Title = ustr.raw();
+    if (tags.gobj() && tags.get(Gst::TAG_ARTIST, ustr))
+        aResponse.Artist = ustr.raw();
+
+    // Name it after the file when the stream doesn't say
+    if (aResponse.Title.empty())
+    {
+        std::string_view path(aUrl);
+        path = path.substr(0, path.find_first_of("?#", aUrl.find("://") + 3));
+        aResponse.Title = std::string(path.substr(path.rfind('/') + 1));
+    }
+
+    Util::Log(Util::Log_Debug) << "[Direct] " << aUrl << " is direct media (" << aResponse.Duration << "s)";
+    return true;
+}
+
+std::string DirectMedia::Host(const std::string& aUrl)
+{
+    auto start = aUrl.find("://");
+    if (start == std::string::npos)
+        return {};
+
+    // Ports don't matter for telling sites apart
+    start += 3;
+    return aUrl.substr(start, aUrl.find_first_of(":/?#", start) - start);
+}
+
+bool DirectMedia::MatchesHost(const std::string& aHost, const std::string& aPattern)
+{
+    return aHost == aPattern || (endsWith(aHost, aPattern) && aHost[aHost.size() - aPattern.size() - 1] == '.');
+}
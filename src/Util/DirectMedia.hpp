@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct YoutubeDLResponse;
+
+// Tells plain media URLs apart from pages that need youtube-dl.
+//
+// Extensions and the configured hosts decide right away. URLs on sites
+// youtube-dl is known to handle go to it, anything else can be sniffed with
+// a GStreamer discoverer, which also reads the duration and tags that the
+// resolver would otherwise provide.
+class DirectMedia
+{
+public:
+    enum Kind
+    {
+        // Playable as-is
+        Kind_Direct,
+        // Could be either, only a look at the content will tell
+        Kind_Unknown,
+        // A page for youtube-dl
+        Kind_Page,
+    };
+
+    DirectMedia();
+
+    static DirectMedia& getSingleton();
+
+    // Comma-separated hosts whose URLs are always media, subdomains included
+    void setHosts(const std::string& aHosts);
+    void setSniffing(bool aSniff);
+    bool isSniffing() const;
+    void setTimeout(std::chrono::seconds aTimeout);
+
+    Kind classify(const std::string& aUrl) const;
+
+    // Opens the stream far enough to find its type and tags, fills in the
+    // response if it holds audio. Blocks for up to the timeout
+    bool probe(const std::string& aUrl, YoutubeDLResponse& aResponse, std::string& aError) const;
+
+private:
+    static std::string Host(const std::string& aUrl);
+    static bool MatchesHost(const std::string& aHost, const std::string& aPattern);
+
+    mutable std::mutex m_mutex;
+    std::vector<std::string> m_hosts;
+    bool m_sniff;
+    std::chrono::seconds m_timeout;
+};
@@ -0,0 +1,123 @@
+#include "FormatSelector.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <cctype>
+
+namespace
+{
+
+// Names people use for codecs that youtube-dl reports differently
+const std::pair<std::string, std::string> CODEC_ALIASES[] = {
+    { "aac", "mp4a" },
+    { "ogg", "vorbis" },
+};
+
+std::vector<std::string> splitList(const std::string& aList)
+{
+    std::vector<std::string> values;
+
+    std::istringstream iss(aList);
+    for (std::string value; std::getline(iss, value, ','); )
+    {
+        value.erase(std::remove_if(value.begin(), value.end(), [](unsigned char c) { return std::isspace(c); }), value.end());
+        std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!value.empty())
+            values.push_back(std::move(value));
+    }
+
+    return values;
+}
+
+}
+
+FormatSelector::FormatSelector()
+    : FormatSelector(Options())
+{
+}
+
+FormatSelector::FormatSelector(const Options& aOptions)
+{
+    configure(aOptions);
+}
+
+FormatSelector& FormatSelector::getSingleton()
+{
+    static FormatSelector s_selector;
+    return s_selector;
+}
+
+void FormatSelector::configure(const Options& aOptions)
+{
+    m_codecs = splitList(aOptions.Codecs);
+    for (auto& codec : m_codecs)
+        for (auto& alias : CODEC_ALIASES)
+            if (codec == alias.first)
+                codec = alias.second;
+
+    m_containers = splitList(aOptions.Containers);
+    m_maxBitrate = std::max(aOptions.MaxBitrate, 0.0);
+    m_preferSized = aOptions.PreferSized;
+    m_alternates = aOptions.Alternates;
+
+    // youtube-dl takes the first alternative that matches anything, so go
+    // from the most specific to the least
+    std::ostringstream spec;
+    std::string ceiling;
+    if (m_maxBitrate > 0)
+        ceiling = "[abr<=?" + std::to_string(int(m_maxBitrate)) + "]";
+
+    for (auto& codec : m_codecs)
+        spec << "bestaudio[acodec^=" << codec << "]" << ceiling << "/";
+    for (auto& container : m_containers)
+        spec << "bestaudio[ext=" << container << "]" << ceiling << "/";
+    if (!ceiling.empty())
+        spec << "bestaudio" << ceiling << "/worstaudio/best";
+    else
+        spec << "bestaudio/best";
+
+    m_formatSpec = spec.str();
+    Util::Log(Util::Log_Debug) << "[YDL] Selecting formats with " << m_formatSpec;
+}
+
+FormatSelector::Score FormatSelector::score(const Format& aFormat) const
+{
+    Score score{};
+    if (aFormat.Url.empty() || aFormat.ACodec == "none")
+        return score;
+
+    score.Usable = true;
+    score.AudioOnly = aFormat.VCodec == "none";
+    score.Direct = aFormat.Protocol.empty() || aFormat.Protocol == "http" || aFormat.Protocol == "https";
+    score.WithinCeiling = m_maxBitrate <= 0 || aFormat.Abr <= m_maxBitrate;
+    score.Codec = Rank(m_codecs, aFormat.ACodec, true);
+    score.Container = Rank(m_containers, aFormat.Ext, false);
+    score.Sized = m_preferSized && (aFormat.Filesize > 0 || aFormat.ChunkSize > 0);
+    score.Bitrate = score.WithinCeiling ? aFormat.Abr : -aFormat.Abr;
+
+    return score;
+}
+
+const std::string& FormatSelector::getFormatSpec() const
+{
+    return m_formatSpec;
+}
+
+size_t FormatSelector::getAlternates() const
+{
+    return m_alternates;
+}
+
+int FormatSelector::Rank(const std::vector<std::string>& aList, const std::string& aValue, bool aPrefix)
+{
+    for (size_t i = 0; i < aList.size(); ++i)
+    {
+        auto& entry = aList[i];
+        if (aPrefix ? aValue.compare(0, entry.size(), entry) == 0 : aValue == entry)
+            return int(aList.size() - i);
+    }
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// Ranks the formats youtube-dl offers for a song.
+//
+// The preferences are compiled once from the configuration, into codec and
+// container ranks for scoring formats as they're parsed, and into a format
+// spec for youtube-dl itself when it only prints the one it picked.
+class FormatSelector
+{
+public:
+    struct Format
+    {
+        std::string Url;
+        std::string ACodec;
+        std::string VCodec;
+        std::string Ext;
+        std::string Protocol;
+        // Audio bitrate in kbit/s, 0 when unknown
+        double Abr = 0;
+        uint64_t Filesize = 0;
+        uint64_t ChunkSize = 0;
+        std::unordered_map<std::string, std::string> Headers;
+    };
+
+    // Compared member by member, higher is better
+    struct Score
+    {
+        bool Usable;
+        bool AudioOnly;
+        // Plain HTTP rather than a manifest to be demuxed
+        bool Direct;
+        bool WithinCeiling;
+        int Codec;
+        int Container;
+        bool Sized;
+        // Negated above the ceiling, so the smallest overshoot wins
+        double Bitrate;
+
+        auto operator<=>(const Score&) const = default;
+    };
+
+    struct Options
+    {
+        // Comma-separated, most preferred first. Codecs match as prefixes,
+        // so mp4a (or aac) covers mp4a.40.2
+        std::string Codecs;
+        std::string Containers;
+        // Highest audio bitrate in kbit/s to pick while anything fits, 0 for no limit
+        double MaxBitrate = 0;
+        // Prefer formats with a known size or chunked downloads, which seek and resume
+        bool PreferSized = true;
+        // Runner-up formats to keep for when the chosen one stops working
+        size_t Alternates = 2;
+    };
+
+    FormatSelector();
+    explicit FormatSelector(const Options& aOptions);
+
+    static FormatSelector& getSingleton();
+
+    void configure(const Options& aOptions);
+
+    Score score(const Format& aFormat) const;
+    // youtube-dl -f spec for the same preferences, as far as it can express them
+    const std::string& getFormatSpec() const;
+    size_t getAlternates() const;
+
+private:
+    static int Rank(const std::vector<std::string>& aList, const std::string& aValue, bool aPrefix);
+
+    std::vector<std::string> m_codecs,
+                             m_containers;
+    double m_maxBitrate;
+    bool m_preferSized;
+    size_t m_alternates;
+    std::string m_formatSpec;
+};
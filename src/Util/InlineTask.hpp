@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Util
+{
+
+// Move-only void() callable, storing small callables in place instead of
+// allocating them like std::function does.
+class InlineTask
+{
+public:
+    static constexpr size_t kInlineSize = 64;
+
+    InlineTask() = default;
+    template<typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, InlineTask>>>
+    InlineTask(Func&& aFunc);
+    InlineTask(const InlineTask&) = delete;
+    InlineTask(InlineTask&& aMove) noexcept;
+    ~InlineTask();
+
+    InlineTask& operator=(const InlineTask&) = delete;
+    InlineTask& operator=(InlineTask&& aMove) noexcept;
+
+    explicit operator bool() const { return m_ops != nullptr; }
+    void operator()() { m_ops->Invoke(m_storage); }
+
+private:
+    struct Ops
+    {
+        void (*Invoke)(void* aStorage);
+        void (*Move)(void* aFrom, void* aTo);
+        void (*Destroy)(void* aStorage);
+    };
+
+    template<typename Func>
+    static constexpr bool IsInline = sizeof(Func) <= kInlineSize && alignof(Func) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Func>;
+
+    template<typename Func>
+    static const Ops s_inlineOps;
+    template<typename Func>
+    static const Ops s_heapOps;
+
+    void _reset();
+
+    alignas(std::max_align_t) unsigned char m_storage[kInlineSize];
+    const Ops* m_ops = nullptr;
+};
+
+}
+
+template<typename Func>
+const Util::InlineTask::Ops Util::InlineTask::s_inlineOps = {
+    [](void* aStorage) { (*std::launder(reinterpret_cast<Func*>(aStorage)))(); },
+    [](void* aFrom, void* aTo) {
+        auto* from = std::launder(reinterpret_cast<Func*>(aFrom));
+        new (aTo) Func(std::move(*from));
+        from->~Func();
+    },
+    [](void* aStorage) { std::launder(reinterpret_cast<Func*>(aStorage))->~Func(); },
+};
+
+template<typename Func>
+const Util::InlineTask::Ops Util::InlineTask::s_heapOps = {
+    [](void* aStorage) { (**reinterpret_cast<Func**>(aStorage))(); },
+    [](void* aFrom, void* aTo) { *reinterpret_cast<Func**>(aTo) = *reinterpret_cast<Func**>(aFrom); },
+    [](void* aStorage) { delete *reinterpret_cast<Func**>(aStorage); },
+};
+
+template<typename Func, typename>
+Util::InlineTask::InlineTask(Func&& aFunc)
+{
+    using Stored = std::decay_t<Func>;
+    if constexpr (IsInline<Stored>)
+    {
+        new (m_storage) Stored(std::forward<Func>(aFunc));
+        m_ops = &s_inlineOps<Stored>;
+    }
+    else
+    {
+        *reinterpret_cast<Stored**>(m_storage) = new Stored(std::forward<Func>(aFunc));
+        m_ops = &s_heapOps<Stored>;
+    }
+}
+
+inline Util::InlineTask::InlineTask(InlineTask&& aMove) noexcept
+    : m_ops(aMove.m_ops)
+{
+    if (m_ops)
+    {
+        m_ops->Move(aMove.m_storage, m_storage);
+        aMove.m_ops = nullptr;
+    }
+}
+
+inline Util::InlineTask::~InlineTask()
+{
+    _reset();
+}
+
+inline Util::InlineTask& Util::InlineTask::operator=(InlineTask&& aMove) noexcept
+{
+    if (this == &aMove)
+        return *this;
+
+    _reset();
+    m_ops = aMove.m_ops;
+    if (m_ops)
+    {
+        m_ops->Move(aMove.m_storage, m_storage);
+        aMove.m_ops = nullptr;
+    }
+    return *this;
+}
+
+inline void Util::InlineTask::_reset()
+{
+    if (m_ops)
+        m_ops->Destroy(m_storage);
+    m_ops = nullptr;
+}
@@ -0,0 +1,226 @@
+#include "Prefetcher.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <string_view>
+
+namespace
+{
+
+// Posted by a source once its stream can't be cached
+constexpr const char* kAbandoned = "cache-abandoned";
+
+}
+
+Prefetcher::Prefetcher()
+    : m_watch(0)
+    , m_maxSize(0)
+    , m_stats{}
+{
+}
+
+Prefetcher::~Prefetcher()
+{
+    stop();
+}
+
+void Prefetcher::update(const std::vector<Request>& aSongs)
+{
+    if (!m_fetching.empty())
+    {
+        if (std::any_of(aSongs.begin(), aSongs.end(), [this](auto& it) { return it.URL == m_fetching; }))
+            return;
+
+        Util::Log(Util::Log_Debug) << "[Prefetch] Dropping " << m_fetching << ", it's not coming up anymore";
+        ++m_stats.Dropped;
+        _finish(false);
+    }
+
+    auto& cache = AudioCache::getSingleton();
+    for (auto& song : aSongs)
+    {
+        if (m_failed.count(song.URL) > 0 || !cache.find(song.URL).empty())
+            continue;
+
+        if (_start(song))
+            return;
+    }
+}
+
+void Prefetcher::stop()
+{
+    if (!m_fetching.empty())
+        _finish(false);
+    m_failed.clear();
+}
+
+void Prefetcher::setMaxSize(uint64_t aMaxSize)
+{
+    m_maxSize = aMaxSize;
+}
+
+const Prefetcher::Stats& Prefetcher::getStats() const
+{
+    return m_stats;
+}
+
+void Prefetcher::TeeSource(const Glib::RefPtr<Gst::Element>& aSource, std::unique_ptr<AudioCache::Writer> aWriter)
+{
+    auto pad = aSource->get_static_pad("src");
+    if (!pad)
+        return;
+
+    auto probe = [](GstPad* aPad, GstPadProbeInfo* aInfo, gpointer aData) -> GstPadProbeReturn {
+        auto* writer = static_cast<AudioCache::Writer*>(aData);
+
+        if (GST_PAD_PROBE_INFO_TYPE(aInfo) & GST_PAD_PROBE_TYPE_BUFFER)
+        {
+            auto* buffer = GST_PAD_PROBE_INFO_BUFFER(aInfo);
+            GstMapInfo map;
+            if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+                return GST_PAD_PROBE_REMOVE;
+
+            // Manifests only point at the audio, there's nothing to keep in them
+            std::string_view head(reinterpret_cast<const char*>(map.data), std::min<size_t>(map.size, 7));
+            bool manifest = GST_BUFFER_OFFSET(buffer) == 0 && (head == "#EXTM3U" || head.substr(0, 1) == "<");
+
+            bool written = !manifest && writer->write(GST_BUFFER_OFFSET(buffer), map.data, map.size);
+            gst_buffer_unmap(buffer, &map);
+            if (written)
+                return GST_PAD_PROBE_OK;
+
+            // Lets whoever only reads the stream for the cache stop reading it
+            auto* source = GST_PAD_PARENT(aPad);
+            gst_element_post_message(source, gst_message_new_application(GST_OBJECT(source), gst_structure_new_empty(kAbandoned)));
+            return GST_PAD_PROBE_REMOVE;
+        }
+
+        auto* event = GST_PAD_PROBE_INFO_EVENT(aInfo);
+        if (event && GST_EVENT_TYPE(event) == GST_EVENT_EOS)
+        {
+            // The source knows the size from Content-Length, when the server sent one
+            gint64 size = 0;
+            if (!gst_pad_query_duration(aPad, GST_FORMAT_BYTES, &size) || size < 0)
+                size = 0;
+            writer->finish(uint64_t(size));
+            return GST_PAD_PROBE_REMOVE;
+        }
+        return GST_PAD_PROBE_OK;
+    };
+
+    // Whatever isn't finished when the source goes away is thrown out with the writer
+    gst_pad_add_probe(pad->gobj(), GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        probe, aWriter.release(), [](gpointer aData) { delete static_cast<AudioCache::Writer*>(aData); });
+}
+
+bool Prefetcher::_start(const Request& aSong)
+{
+    // Playback may be caching the song itself already
+    auto writer = AudioCache::getSingleton().store(aSong.URL, m_maxSize);
+    if (!writer)
+        return false;
+
+    auto source = Gst::ElementFactory::create_element("souphttpsrc");
+    auto sink = Gst::ElementFactory::create_element("fakesink");
+    if (!source || !sink)
+    {
+        Util::Log(Util::Log_Warning) << "[Prefetch] Missing souphttpsrc or fakesink, not prefetching";
+        m_failed.insert(aSong.URL);
+        return false;
+    }
+
+    auto headers = Gst::Structure("extra-headers");
+    for (auto& kv : aSong.Headers)
+        headers.set_field(kv.first, kv.second);
+
+    source->set_property("location", Glib::ustring(aSong.DataURL));
+    source->set_property("automatic-redirect", true);
+    source->set_property("compress", true);
+    source->set_property("extra-headers", headers);
+    source->set_property("ssl-strict", false);
+    sink->set_property("sync", false);
+
+    m_pipeline = Gst::Pipeline::create();
+    m_pipeline->add(source)->add(sink);
+    source->link(sink);
+    TeeSource(source, std::move(writer));
+
+    m_watch = m_pipeline->get_bus()->add_watch(sigc::mem_fun(*this, &Prefetcher::on_bus_message));
+    m_fetching = aSong.URL;
+    ++m_stats.Started;
+
+    Util::Log(Util::Log_Debug) << "[Prefetch] Fetching " << aSong.URL;
+    if (m_pipeline->set_state(Gst::STATE_PLAYING) == Gst::STATE_CHANGE_FAILURE)
+    {
+        m_failed.insert(aSong.URL);
+        ++m_stats.Failed;
+        _finish(false);
+        return false;
+    }
+
+    return true;
+}
+
+void Prefetcher::_finish(bool aCached)
+{
+    if (aCached)
+    {
+        Util::Log(Util::Log_Debug) << "[Prefetch] Cached " << m_fetching;
+        ++m_stats.Finished;
+    }
+
+    m_pipeline->get_bus()->remove_watch(m_watch);
+    // Takes the source and with it any unfinished writer along
+    m_pipeline->set_state(Gst::STATE_NULL);
+    m_pipeline.reset();
+    m_watch = 0;
+    m_fetching.clear();
+}
+
+bool Prefetcher::on_bus_message(const Glib::RefPtr<Gst::Bus>& aBus, const Glib::RefPtr<Gst::Message>& aMessage)
+{
+    if (!m_pipeline || aBus != m_pipeline->get_bus())
+        return false;
+
+    switch (aMessage->get_message_type())
+    {
+    case Gst::MESSAGE_EOS:
+        {
+            bool cached = !AudioCache::getSingleton().find(m_fetching).empty();
+            if (!cached)
+            {
+                m_failed.insert(m_fetching);
+                ++m_stats.Failed;
+            }
+            _finish(cached);
+        }
+        return false;
+
+    case Gst::MESSAGE_ERROR:
+        {
+            auto msg = Glib::RefPtr<Gst::MessageError>::cast_static(aMessage);
+            Util::Log(Util::Log_Debug) << "[Prefetch] Failed to fetch " << m_fetching << ": " << msg->parse_error().what().raw();
+            m_failed.insert(m_fetching);
+            ++m_stats.Failed;
+            _finish(false);
+        }
+        return false;
+
+    case Gst::MESSAGE_APPLICATION:
+        {
+            if (aMessage->get_structure().get_name() != kAbandoned)
+                break;
+
+            Util::Log(Util::Log_Debug) << "[Prefetch] Not fetching " << m_fetching << ", it's too big or can't be cached";
+            m_failed.insert(m_fetching);
+            ++m_stats.Failed;
+            _finish(false);
+        }
+        return false;
+
+    default:
+        break;
+    }
+
+    return true;
+}
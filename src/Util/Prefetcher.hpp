@@ -0,0 +1,76 @@
+#pragma once
+
+#include "AudioCache.hpp"
+
+#include <gstreamermm.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdint>
+
+// Downloads the songs coming up into the audio cache ahead of their turn.
+//
+// Opening a stream costs a connection, a request and buffering before the
+// first sound, while a cached song starts right off the disk. Songs are
+// fetched whole, one at a time in play order, in a pipeline of their own, so
+// playback never has to switch from the cache to the network halfway in.
+// Streams past the size limit are dropped as soon as they pass it, and left
+// to playback to stream.
+class Prefetcher
+{
+public:
+    struct Request
+    {
+        // What the song is cached under, and where its audio is
+        std::string URL;
+        std::string DataURL;
+        std::unordered_map<std::string, std::string> Headers;
+    };
+
+    struct Stats
+    {
+        // Fetches begun, those that ended up cached, and those that failed
+        // or didn't fit. Dropped ones were no longer coming up
+        uint64_t Started;
+        uint64_t Finished;
+        uint64_t Failed;
+        uint64_t Dropped;
+    };
+
+    Prefetcher();
+    Prefetcher(const Prefetcher&) = delete;
+    ~Prefetcher();
+
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    // The songs to have cached, next first. A fetch of anything else is dropped
+    void update(const std::vector<Request>& aSongs);
+    void stop();
+
+    // The most read of any one song, 0 for the cache's own limit
+    void setMaxSize(uint64_t aMaxSize);
+
+    const Stats& getStats() const;
+
+    // Copies everything the source reads into the cache, up to its end of
+    // stream. Streams that end short of the size the source reported aren't kept
+    static void TeeSource(const Glib::RefPtr<Gst::Element>& aSource, std::unique_ptr<AudioCache::Writer> aWriter);
+
+private:
+    bool _start(const Request& aSong);
+    void _finish(bool aCached);
+
+    bool on_bus_message(const Glib::RefPtr<Gst::Bus>& aBus, const Glib::RefPtr<Gst::Message>& aMessage);
+
+    std::string m_fetching;
+    Glib::RefPtr<Gst::Pipeline> m_pipeline;
+    guint m_watch;
+    // Songs that couldn't be fetched, they're left to playback from then on
+    std::unordered_set<std::string> m_failed;
+    uint64_t m_maxSize;
+    Stats m_stats;
+};
@@ -0,0 +1,381 @@
+#include "Process.hpp"
+#include "Logging.hpp"
+
+#include <array>
+#include <atomic>
+
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+using Util::Process;
+using Util::ProcessResult;
+
+namespace
+{
+
+// Only keep the tail of stderr from long-lived children
+constexpr size_t kMaxStderrBuffer = 64 * 1024;
+
+}
+
+Process::Process()
+    : m_pid(-1)
+    , m_stdinFd(-1)
+    , m_stdoutFd(-1)
+    , m_stderrFd(-1)
+{
+}
+
+Process::Process(Process&& aMove)
+    : m_pid(aMove.m_pid)
+    , m_stdinFd(aMove.m_stdinFd)
+    , m_stdoutFd(aMove.m_stdoutFd)
+    , m_stderrFd(aMove.m_stderrFd)
+    , m_stdoutBuffer(std::move(aMove.m_stdoutBuffer))
+    , m_stderrBuffer(std::move(aMove.m_stderrBuffer))
+    , m_startTime(aMove.m_startTime)
+{
+    aMove.m_pid = -1;
+    aMove.m_stdinFd = aMove.m_stdoutFd = aMove.m_stderrFd = -1;
+}
+
+Process::~Process()
+{
+    _closeFds();
+    if (running())
+    {
+        kill(SIGKILL);
+        wait();
+    }
+}
+
+Process& Process::operator=(Process&& aMove)
+{
+    if (this == &aMove)
+        return *this;
+
+    _closeFds();
+    if (running())
+    {
+        kill(SIGKILL);
+        wait();
+    }
+
+    m_pid = aMove.m_pid;
+    m_stdinFd = aMove.m_stdinFd;
+    m_stdoutFd = aMove.m_stdoutFd;
+    m_stderrFd = aMove.m_stderrFd;
+    m_stdoutBuffer = std::move(aMove.m_stdoutBuffer);
+    m_stderrBuffer = std::move(aMove.m_stderrBuffer);
+    m_startTime = aMove.m_startTime;
+
+    aMove.m_pid = -1;
+    aMove.m_stdinFd = aMove.m_stdoutFd = aMove.m_stderrFd = -1;
+
+    return *this;
+}
+
+bool Process::spawn(const std::vector<std::string>& aArgv, bool aPipeStdin)
+{
+    if (running() || aArgv.empty())
+        return false;
+
+    int inPipe[2] = { -1, -1 }, outPipe[2], errPipe[2];
+    if (aPipeStdin && pipe2(inPipe, O_CLOEXEC) != 0)
+    {
+        Util::Log(Util::Log_Error) << "[Proc] Failed to create pipe (" << errno << ")";
+        return false;
+    }
+    if (pipe2(outPipe, O_CLOEXEC) != 0)
+    {
+        Util::Log(Util::Log_Error) << "[Proc] Failed to create pipe (" << errno << ")";
+        if (aPipeStdin) { close(inPipe[0]); close(inPipe[1]); }
+        return false;
+    }
+    if (pipe2(errPipe, O_CLOEXEC) != 0)
+    {
+        Util::Log(Util::Log_Error) << "[Proc] Failed to create pipe (" << errno << ")";
+        if (aPipeStdin) { close(inPipe[0]); close(inPipe[1]); }
+        close(outPipe[0]); close(outPipe[1]);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (aPipeStdin)
+        posix_spawn_file_actions_adddup2(&actions, inPipe[0], STDIN_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    std::vector<char*> argv;
+    argv.reserve(aArgv.size() + 1);
+    for (auto& arg : aArgv)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    m_startTime = std::chrono::steady_clock::now();
+    int err = posix_spawn(&m_pid, argv.front(), &actions, &attr, argv.data(), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (aPipeStdin)
+        close(inPipe[0]);
+    close(outPipe[1]);
+    close(errPipe[1]);
+
+    if (err != 0)
+    {
+        Util::Log(Util::Log_Error) << "[Proc] Failed to spawn " << aArgv.front() << " (" << err << ")";
+        m_pid = -1;
+        if (aPipeStdin)
+            close(inPipe[1]);
+        close(outPipe[0]);
+        close(errPipe[0]);
+        return false;
+    }
+
+    m_stdinFd = inPipe[1];
+    m_stdoutFd = outPipe[0];
+    m_stderrFd = errPipe[0];
+    m_stdoutBuffer.clear();
+    m_stderrBuffer.clear();
+
+    return true;
+}
+
+ProcessResult Process::communicate(const CancelToken& aToken)
+{
+    ProcessResult result;
+    if (!running())
+        return result;
+
+    closeStdin();
+
+    // Killing the group closes the pipes, which wakes up the poll below
+    std::atomic_bool killed = false;
+    auto subscription = aToken.subscribe([this, &killed]() {
+        killed = true;
+        kill(SIGKILL);
+    });
+
+    result.Stdout = std::move(m_stdoutBuffer);
+    result.Stderr = std::move(m_stderrBuffer);
+
+    std::array<char, 16384> buffer;
+    std::array<pollfd, 2> fds = {{
+        { m_stdoutFd, POLLIN, 0 },
+        { m_stderrFd, POLLIN, 0 }
+    }};
+    std::string* targets[] = { &result.Stdout, &result.Stderr };
+
+    int open = int(m_stdoutFd >= 0) + int(m_stderrFd >= 0);
+    while (open > 0)
+    {
+        // Checked every time round, a child that never stops writing never lets poll time out
+        if (aToken.isExpired())
+        {
+            killed = true;
+            kill(SIGKILL);
+            break;
+        }
+
+        int ready = poll(fds.data(), fds.size(), aToken.pollTimeout());
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+
+            ssize_t len = read(fds[i].fd, buffer.data(), buffer.size());
+            if (len > 0)
+                targets[i]->append(buffer.data(), size_t(len));
+            else if (len == 0 || errno != EINTR)
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --open;
+            }
+        }
+    }
+
+    aToken.unsubscribe(subscription);
+
+    for (auto& fd : fds)
+        if (fd.fd >= 0)
+            close(fd.fd);
+    m_stdoutFd = m_stderrFd = -1;
+    _closeFds();
+
+    result.ExitCode = wait();
+    result.Duration = std::chrono::steady_clock::now() - m_startTime;
+    result.Killed = killed;
+
+    return result;
+}
+
+void Process::kill(int aSignal)
+{
+    if (running())
+        ::kill(-m_pid, aSignal);
+}
+
+bool Process::write(const std::string& aData)
+{
+    if (m_stdinFd < 0)
+        return false;
+
+    size_t written = 0;
+    while (written < aData.size())
+    {
+        ssize_t len = ::write(m_stdinFd, aData.data() + written, aData.size() - written);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        written += size_t(len);
+    }
+
+    return true;
+}
+
+bool Process::readLine(std::string& aLine, const CancelToken& aToken)
+{
+    std::array<char, 16384> buffer;
+
+    while (true)
+    {
+        auto end = m_stdoutBuffer.find('\n');
+        if (end != std::string::npos)
+        {
+            aLine.assign(m_stdoutBuffer, 0, end);
+            m_stdoutBuffer.erase(0, end + 1);
+            return true;
+        }
+
+        if (m_stdoutFd < 0 || aToken.stopRequested())
+            return false;
+
+        std::array<pollfd, 2> fds = {{
+            { m_stdoutFd, POLLIN, 0 },
+            { m_stderrFd, POLLIN, 0 }
+        }};
+
+        int ready = poll(fds.data(), fds[1].fd < 0 ? 1 : 2, aToken.pollTimeout());
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (ready == 0)
+            continue;
+
+        // Keep draining stderr so a chatty child can't block on a full pipe
+        if (fds[1].fd >= 0 && fds[1].revents != 0)
+        {
+            ssize_t len = read(m_stderrFd, buffer.data(), buffer.size());
+            if (len > 0)
+            {
+                m_stderrBuffer.append(buffer.data(), size_t(len));
+                if (m_stderrBuffer.size() > kMaxStderrBuffer)
+                    m_stderrBuffer.erase(0, m_stderrBuffer.size() - kMaxStderrBuffer);
+            }
+            else if (len == 0 || errno != EINTR)
+            {
+                close(m_stderrFd);
+                m_stderrFd = -1;
+            }
+        }
+
+        if (fds[0].revents != 0)
+        {
+            ssize_t len = read(m_stdoutFd, buffer.data(), buffer.size());
+            if (len > 0)
+                m_stdoutBuffer.append(buffer.data(), size_t(len));
+            else if (len == 0 || errno != EINTR)
+            {
+                close(m_stdoutFd);
+                m_stdoutFd = -1;
+            }
+        }
+    }
+}
+
+void Process::closeStdin()
+{
+    if (m_stdinFd >= 0)
+        close(m_stdinFd);
+    m_stdinFd = -1;
+}
+
+std::string Process::takeStderr()
+{
+    std::string ret;
+    std::swap(ret, m_stderrBuffer);
+    return ret;
+}
+
+ProcessResult Process::Run(const std::vector<std::string>& aArgv, const CancelToken& aToken)
+{
+    Process proc;
+    if (!proc.spawn(aArgv))
+        return {};
+
+    return proc.communicate(aToken);
+}
+
+int Process::wait()
+{
+    if (!running())
+        return -1;
+
+    int status = 0;
+    pid_t ret;
+    do
+    {
+        ret = waitpid(m_pid, &status, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    m_pid = -1;
+
+    if (ret < 0)
+        return -1;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return -1;
+}
+
+void Process::_closeFds()
+{
+    closeStdin();
+    if (m_stdoutFd >= 0)
+        close(m_stdoutFd);
+    if (m_stderrFd >= 0)
+        close(m_stderrFd);
+    m_stdoutFd = m_stderrFd = -1;
+}
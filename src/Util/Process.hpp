@@ -0,0 +1,68 @@
+#pragma once
+
+#include "CancelToken.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace Util
+{
+
+struct ProcessResult
+{
+    int ExitCode = -1;
+    std::string Stdout;
+    std::string Stderr;
+    std::chrono::nanoseconds Duration{};
+    // Killed because its token was cancelled or ran past the deadline
+    bool Killed = false;
+};
+
+class Process
+{
+public:
+    Process();
+    Process(const Process&) = delete;
+    Process(Process&& aMove);
+    ~Process();
+
+    Process& operator=(const Process&) = delete;
+    Process& operator=(Process&& aMove);
+
+    // Spawns aArgv[0] directly with the given arguments, no shell involved.
+    // The child leads its own process group, so kill() also reaches anything it started
+    bool spawn(const std::vector<std::string>& aArgv, bool aPipeStdin = false);
+    // Reads stdout/stderr until both are closed, then reaps the child.
+    // The process group is killed as soon as aToken is cancelled or expires
+    ProcessResult communicate(const CancelToken& aToken = {});
+    void kill(int aSignal);
+
+    // Line-based access for long-lived children spawned with aPipeStdin
+    bool write(const std::string& aData);
+    // Gives up without touching the child once aToken is cancelled or expires
+    bool readLine(std::string& aLine, const CancelToken& aToken = {});
+    void closeStdin();
+    std::string takeStderr();
+    int wait();
+
+    bool running() const { return m_pid > 0; }
+    pid_t getPid() const { return m_pid; }
+
+    static ProcessResult Run(const std::vector<std::string>& aArgv, const CancelToken& aToken = {});
+
+private:
+    void _closeFds();
+
+    pid_t m_pid;
+    int m_stdinFd,
+        m_stdoutFd,
+        m_stderrFd;
+    std::string m_stdoutBuffer,
+                m_stderrBuffer;
+    std::chrono::steady_clock::time_point m_startTime;
+};
+
+}
@@ -0,0 +1,385 @@
+#include "RecordStore.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using Util::RecordStore;
+
+namespace
+{
+
+constexpr uint32_t kRecordMagic = 0x52444c59; // YLDR
+constexpr uint32_t kTombstone = UINT32_MAX;
+
+struct RecordHeader
+{
+    uint32_t Magic;
+    uint32_t KeySize;
+    uint32_t ValueSize;
+    uint32_t Reserved;
+    int64_t Expiry;
+};
+static_assert(sizeof(RecordHeader) == 24, "Record header must stay packed");
+
+bool writeAll(int aFd, const char* aData, size_t aSize, uint64_t aOffset)
+{
+    while (aSize > 0)
+    {
+        ssize_t len = pwrite(aFd, aData, aSize, off_t(aOffset));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        aData += len;
+        aSize -= size_t(len);
+        aOffset += uint64_t(len);
+    }
+    return true;
+}
+
+int64_t toSeconds(RecordStore::Clock::time_point aTime)
+{
+    if (aTime == RecordStore::Clock::time_point())
+        return 0;
+    return std::chrono::duration_cast<std::chrono::seconds>(aTime.time_since_epoch()).count();
+}
+
+RecordStore::Clock::time_point fromSeconds(int64_t aSeconds)
+{
+    if (aSeconds == 0)
+        return RecordStore::Clock::time_point();
+    return RecordStore::Clock::time_point(std::chrono::seconds(aSeconds));
+}
+
+}
+
+RecordStore::RecordStore()
+    : m_fd(-1)
+    , m_map(nullptr)
+    , m_mapSize(0)
+    , m_fileSize(0)
+    , m_liveSize(0)
+    , m_maxSize(0)
+    , m_useCounter(0)
+{
+}
+
+RecordStore::~RecordStore()
+{
+    close();
+}
+
+bool RecordStore::open(const std::filesystem::path& aPath, uint64_t aMaxSize)
+{
+    close();
+
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    std::error_code ec;
+    std::filesystem::create_directories(aPath.parent_path(), ec);
+
+    m_fd = ::open(aPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        Util::Log(Util::Log_Warning) << "[Store] Failed to open " << aPath.string() << " (" << errno << ")";
+        return false;
+    }
+
+    m_path = aPath;
+    m_maxSize = aMaxSize;
+
+    if (!_load())
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    if (m_fileSize > m_maxSize)
+        _compact();
+
+    Util::Log(Util::Log_Debug) << "[Store] Opened " << m_path.string() << " with " << m_index.size() << " records";
+
+    return true;
+}
+
+void RecordStore::close()
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    _unmap();
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+    m_fd = -1;
+    m_fileSize = m_liveSize = 0;
+    m_index.clear();
+}
+
+bool RecordStore::isOpen() const
+{
+    return m_fd >= 0;
+}
+
+bool RecordStore::get(const std::string& aKey, std::string& aValue, Clock::time_point* aExpiry) const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+
+    auto it = m_index.find(aKey);
+    if (it == m_index.end())
+        return false;
+
+    auto& entry = it->second;
+    if (entry.Expiry != Clock::time_point() && entry.Expiry <= Clock::now())
+        return false;
+
+    auto end = entry.Offset + sizeof(RecordHeader) + entry.KeySize + entry.ValueSize;
+    if (end > m_mapSize && !_map())
+        return false;
+
+    aValue.assign(m_map + entry.Offset + sizeof(RecordHeader) + entry.KeySize, entry.ValueSize);
+    if (aExpiry)
+        *aExpiry = entry.Expiry;
+    entry.LastUse = ++m_useCounter;
+
+    return true;
+}
+
+void RecordStore::put(const std::string& aKey, const std::string& aValue, Clock::time_point aExpiry)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (m_fd < 0)
+        return;
+
+    uint64_t offset;
+    if (!_append(aKey, &aValue, aExpiry, offset))
+        return;
+
+    auto it = m_index.find(aKey);
+    if (it != m_index.end())
+        m_liveSize -= sizeof(RecordHeader) + it->second.KeySize + it->second.ValueSize;
+
+    m_index[aKey] = Entry{ offset, uint32_t(aKey.size()), uint32_t(aValue.size()), aExpiry, ++m_useCounter };
+    m_liveSize += sizeof(RecordHeader) + aKey.size() + aValue.size();
+
+    if (m_fileSize > m_maxSize)
+        _compact();
+}
+
+void RecordStore::erase(const std::string& aKey)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (m_fd < 0)
+        return;
+
+    auto it = m_index.find(aKey);
+    if (it == m_index.end())
+        return;
+
+    uint64_t offset;
+    if (!_append(aKey, nullptr, Clock::time_point(), offset))
+        return;
+
+    m_liveSize -= sizeof(RecordHeader) + it->second.KeySize + it->second.ValueSize;
+    m_index.erase(it);
+}
+
+void RecordStore::compact()
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    if (m_fd >= 0)
+        _compact();
+}
+
+size_t RecordStore::size() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    return m_index.size();
+}
+
+uint64_t RecordStore::getFileSize() const
+{
+    return m_fileSize;
+}
+
+bool RecordStore::_append(const std::string& aKey, const std::string* aValue, Clock::time_point aExpiry, uint64_t& aOffset)
+{
+    RecordHeader header{ kRecordMagic, uint32_t(aKey.size()), aValue ? uint32_t(aValue->size()) : kTombstone, 0, toSeconds(aExpiry) };
+
+    std::string record;
+    record.reserve(sizeof(header) + aKey.size() + (aValue ? aValue->size() : 0));
+    record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(aKey);
+    if (aValue)
+        record.append(*aValue);
+
+    if (!writeAll(m_fd, record.data(), record.size(), m_fileSize))
+    {
+        Util::Log(Util::Log_Warning) << "[Store] Failed to write to " << m_path.string() << " (" << errno << ")";
+        return false;
+    }
+
+    aOffset = m_fileSize;
+    m_fileSize += record.size();
+    return true;
+}
+
+bool RecordStore::_load()
+{
+    struct stat st;
+    if (fstat(m_fd, &st) != 0)
+        return false;
+
+    m_fileSize = uint64_t(st.st_size);
+    m_liveSize = 0;
+    m_index.clear();
+
+    if (m_fileSize == 0)
+        return true;
+    if (!_map())
+        return false;
+
+    uint64_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= m_fileSize)
+    {
+        RecordHeader header;
+        std::memcpy(&header, m_map + offset, sizeof(header));
+        if (header.Magic != kRecordMagic)
+            break;
+
+        uint64_t valueSize = header.ValueSize == kTombstone ? 0 : header.ValueSize;
+        uint64_t recordSize = sizeof(header) + header.KeySize + valueSize;
+        if (offset + recordSize > m_fileSize)
+            break;
+
+        std::string key(m_map + offset + sizeof(header), header.KeySize);
+        auto it = m_index.find(key);
+        if (it != m_index.end())
+        {
+            m_liveSize -= sizeof(RecordHeader) + it->second.KeySize + it->second.ValueSize;
+            m_index.erase(it);
+        }
+
+        if (header.ValueSize != kTombstone)
+        {
+            m_index.emplace(std::move(key), Entry{ offset, header.KeySize, header.ValueSize, fromSeconds(header.Expiry), ++m_useCounter });
+            m_liveSize += recordSize;
+        }
+
+        offset += recordSize;
+    }
+
+    // Drop whatever a crash left half-written at the end
+    if (offset != m_fileSize)
+    {
+        Util::Log(Util::Log_Warning) << "[Store] Truncating " << (m_fileSize - offset) << "B of damaged records from " << m_path.string();
+        _unmap();
+        if (ftruncate(m_fd, off_t(offset)) != 0)
+            return false;
+        m_fileSize = offset;
+    }
+
+    return true;
+}
+
+bool RecordStore::_map() const
+{
+    _unmap();
+    if (m_fileSize == 0)
+        return false;
+
+    void* map = mmap(nullptr, m_fileSize, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        Util::Log(Util::Log_Warning) << "[Store] Failed to map " << m_path.string() << " (" << errno << ")";
+        return false;
+    }
+
+    m_map = static_cast<char*>(map);
+    m_mapSize = m_fileSize;
+    return true;
+}
+
+void RecordStore::_unmap() const
+{
+    if (m_map)
+        munmap(m_map, m_mapSize);
+    m_map = nullptr;
+    m_mapSize = 0;
+}
+
+void RecordStore::_compact()
+{
+    if (m_fileSize > m_mapSize && !_map())
+        return;
+
+    auto now = Clock::now();
+
+    std::vector<std::pair<const std::string*, Entry*>> live;
+    live.reserve(m_index.size());
+    for (auto& it : m_index)
+    {
+        if (it.second.Expiry != Clock::time_point() && it.second.Expiry <= now)
+            continue;
+        live.emplace_back(&it.first, &it.second);
+    }
+
+    // Keep the most recently used records, leaving some headroom
+    std::sort(live.begin(), live.end(), [](auto& a, auto& b) { return a.second->LastUse > b.second->LastUse; });
+
+    auto tmpPath = m_path;
+    tmpPath += ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        Util::Log(Util::Log_Warning) << "[Store] Failed to compact " << m_path.string() << " (" << errno << ")";
+        return;
+    }
+
+    std::unordered_map<std::string, Entry> index;
+    uint64_t offset = 0, limit = m_maxSize / 4 * 3;
+    for (auto& it : live)
+    {
+        auto& entry = *it.second;
+        uint64_t recordSize = sizeof(RecordHeader) + entry.KeySize + entry.ValueSize;
+        if (offset + recordSize > limit)
+            break;
+
+        if (!writeAll(fd, m_map + entry.Offset, recordSize, offset))
+        {
+            ::close(fd);
+            unlink(tmpPath.c_str());
+            return;
+        }
+
+        index.emplace(*it.first, Entry{ offset, entry.KeySize, entry.ValueSize, entry.Expiry, entry.LastUse });
+        offset += recordSize;
+    }
+
+    if (fsync(fd) != 0 || rename(tmpPath.c_str(), m_path.c_str()) != 0)
+    {
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        return;
+    }
+
+    Util::Log(Util::Log_Debug) << "[Store] Compacted " << m_path.string() << " from " << m_fileSize << "B to " << offset << "B";
+
+    _unmap();
+    ::close(m_fd);
+
+    m_fd = fd;
+    m_fileSize = m_liveSize = offset;
+    m_index = std::move(index);
+}
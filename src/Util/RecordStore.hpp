@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Path.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+namespace Util
+{
+
+// Size-bounded key/value store on top of an append-only record log.
+//
+// The log is mmap'd for reads and indexed in memory on open, so lookups
+// never touch the disk. Updates and removals append new records, and the
+// log is compacted - dropping dead, expired and least recently used
+// records - once it outgrows its size limit.
+class RecordStore
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    RecordStore();
+    RecordStore(const RecordStore&) = delete;
+    ~RecordStore();
+
+    RecordStore& operator=(const RecordStore&) = delete;
+
+    bool open(const std::filesystem::path& aPath, uint64_t aMaxSize);
+    void close();
+    bool isOpen() const;
+
+    bool get(const std::string& aKey, std::string& aValue, Clock::time_point* aExpiry = nullptr) const;
+    void put(const std::string& aKey, const std::string& aValue, Clock::time_point aExpiry = Clock::time_point());
+    void erase(const std::string& aKey);
+    void compact();
+
+    size_t size() const;
+    uint64_t getFileSize() const;
+
+private:
+    struct Entry
+    {
+        uint64_t Offset;
+        uint32_t KeySize;
+        uint32_t ValueSize;
+        Clock::time_point Expiry;
+        mutable uint64_t LastUse;
+    };
+
+    bool _append(const std::string& aKey, const std::string* aValue, Clock::time_point aExpiry, uint64_t& aOffset);
+    bool _load();
+    bool _map() const;
+    void _unmap() const;
+    void _compact();
+
+    mutable std::mutex m_mutex;
+    std::filesystem::path m_path;
+    int m_fd;
+    mutable char* m_map;
+    mutable size_t m_mapSize;
+    uint64_t m_fileSize,
+             m_liveSize,
+             m_maxSize;
+    mutable uint64_t m_useCounter;
+    std::unordered_map<std::string, Entry> m_index;
+};
+
+}
@@ -0,0 +1,248 @@
+#include "ResolverCache.hpp"
+#include "Logging.hpp"
+
+#include "../External/json.hpp"
+
+#include <algorithm>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+// Backoff after the first failure and the most it grows to
+constexpr std::chrono::seconds kTransientBackoff = 1min,
+                               kTransientMaxBackoff = 6h,
+                               kPermanentBackoff = 6h,
+                               kPermanentMaxBackoff = 7 * 24h;
+
+std::chrono::seconds backoff(YoutubeDL::ErrorClass aClass, uint32_t aCount)
+{
+    auto base = aClass == YoutubeDL::Error_Permanent ? kPermanentBackoff : kTransientBackoff;
+    auto max = aClass == YoutubeDL::Error_Permanent ? kPermanentMaxBackoff : kTransientMaxBackoff;
+
+    auto delay = base;
+    for (uint32_t i = 1; i < aCount && delay < max; ++i)
+        delay *= 2;
+    return std::min(delay, max);
+}
+
+// Failure history is kept around for a while past the retry, so a URL that
+// keeps failing keeps backing off further
+ResolverCache::Clock::time_point forgetTime(const ResolverCache::Failure& aFailure)
+{
+    return aFailure.RetryTime + backoff(aFailure.Class, aFailure.Count) * 2;
+}
+
+}
+
+ResolverCache s_resolverCache;
+ResolverCache& ResolverCache::getSingleton()
+{
+    return s_resolverCache;
+}
+
+bool ResolverCache::open(const std::filesystem::path& aDirectory, uint64_t aMaxSize)
+{
+    // Stream URLs are small and short-lived, give most of the space to metadata
+    if (!m_metadata.open(aDirectory / "metadata.db", aMaxSize / 8 * 5))
+        return false;
+    if (!m_streams.open(aDirectory / "streams.db", aMaxSize / 4))
+    {
+        m_metadata.close();
+        return false;
+    }
+    if (!m_failureStore.open(aDirectory / "failures.db", aMaxSize / 8))
+    {
+        m_metadata.close();
+        m_streams.close();
+        return false;
+    }
+
+    Util::Log(Util::Log_Info) << "[Cache] Using resolver cache in " << aDirectory.string() << " (" << m_metadata.size() << " songs)";
+    return true;
+}
+
+void ResolverCache::close()
+{
+    m_metadata.close();
+    m_streams.close();
+    m_failureStore.close();
+}
+
+bool ResolverCache::isOpen() const
+{
+    return m_metadata.isOpen();
+}
+
+ResolverCache::LookupResult ResolverCache::lookup(const std::string& aUrl, YoutubeDLResponse& aResponse) const
+{
+    if (!isOpen())
+        return Cache_Miss;
+
+    auto key = YoutubeDL::NormaliseUrl(aUrl);
+
+    std::string value;
+    if (!m_metadata.get(key, value))
+        return Cache_Miss;
+
+    try
+    {
+        auto data = nlohmann::json::parse(value);
+
+        aResponse.Success = true;
+        aResponse.Duration = data.value("duration", uint32_t(0));
+        aResponse.Title = data.value("title", std::string());
+        aResponse.ThumbnailUrl = data.value("thumbnail", std::string());
+        aResponse.Artist = data.value("artist", std::string());
+        aResponse.Extractor = data.value("extractor", std::string());
+        aResponse.SourceUrl = data.value("source", std::string());
+        aResponse.Direct = aResponse.Extractor == "Direct";
+
+        if (!m_streams.get(key, value, &aResponse.Expiry))
+            return Cache_Metadata;
+
+        data = nlohmann::json::parse(value);
+        aResponse.DownloadUrl = data.value("url", std::string());
+        aResponse.DownloadHeaders = data.value("headers", std::unordered_map<std::string, std::string>());
+        for (auto& alternate : data.value("alternates", nlohmann::json::array()))
+            aResponse.AlternateFormats.push_back({
+                alternate.value("url", std::string()),
+                alternate.value("headers", std::unordered_map<std::string, std::string>())
+            });
+    }
+    catch (const std::exception& ex)
+    {
+        Util::Log(Util::Log_Warning) << "[Cache] Invalid cache entry for " << aUrl << "; " << ex.what();
+        return Cache_Miss;
+    }
+
+    return aResponse.DownloadUrl.empty() ? Cache_Metadata : Cache_Full;
+}
+
+void ResolverCache::store(const std::string& aUrl, const YoutubeDLResponse& aResponse)
+{
+    if (!aResponse.Success)
+        return;
+
+    clearFailure(aUrl);
+    if (!isOpen())
+        return;
+
+    auto metadata = nlohmann::json{
+        { "duration", aResponse.Duration },
+        { "title", aResponse.Title },
+        { "thumbnail", aResponse.ThumbnailUrl },
+        { "artist", aResponse.Artist },
+        { "extractor", aResponse.Extractor },
+        { "source", aResponse.SourceUrl },
+    }.dump();
+
+    auto key = YoutubeDL::NormaliseUrl(aUrl);
+
+    // Refreshes mostly return the same metadata, don't grow the log for those
+    std::string existing;
+    if (!m_metadata.get(key, existing) || existing != metadata)
+        m_metadata.put(key, metadata);
+
+    if (!aResponse.DownloadUrl.empty())
+    {
+        auto alternates = nlohmann::json::array();
+        for (auto& alternate : aResponse.AlternateFormats)
+            alternates.push_back({ { "url", alternate.Url }, { "headers", alternate.Headers } });
+
+        m_streams.put(key, nlohmann::json{
+            { "url", aResponse.DownloadUrl },
+            { "headers", aResponse.DownloadHeaders },
+            { "alternates", std::move(alternates) },
+        }.dump(), aResponse.Expiry);
+    }
+}
+
+void ResolverCache::invalidateStream(const std::string& aUrl)
+{
+    if (isOpen())
+        m_streams.erase(YoutubeDL::NormaliseUrl(aUrl));
+}
+
+bool ResolverCache::lookupFailure(const std::string& aUrl, Failure& aFailure) const
+{
+    auto key = YoutubeDL::NormaliseUrl(aUrl);
+
+    std::lock_guard<std::mutex> _lock(m_failureMutex);
+    auto it = m_failures.find(key);
+    if (it != m_failures.end())
+    {
+        if (forgetTime(it->second) <= Clock::now())
+        {
+            m_failures.erase(it);
+            return false;
+        }
+
+        aFailure = it->second;
+        return true;
+    }
+
+    std::string value;
+    if (!m_failureStore.isOpen() || !m_failureStore.get(key, value))
+        return false;
+
+    try
+    {
+        auto data = nlohmann::json::parse(value);
+
+        aFailure.Class = YoutubeDL::ErrorClass(data.value("class", int(YoutubeDL::Error_Transient)));
+        aFailure.Count = data.value("count", uint32_t(1));
+        aFailure.RetryTime = Clock::time_point(std::chrono::seconds(data.value("retry", int64_t(0))));
+        aFailure.Error = data.value("error", std::string());
+    }
+    catch (const std::exception& ex)
+    {
+        Util::Log(Util::Log_Warning) << "[Cache] Invalid failure entry for " << aUrl << "; " << ex.what();
+        return false;
+    }
+
+    m_failures[key] = aFailure;
+    return true;
+}
+
+ResolverCache::Failure ResolverCache::storeFailure(const std::string& aUrl, const std::string& aError)
+{
+    Failure failure{ YoutubeDL::ClassifyError(aError), 1, {}, aError };
+
+    Failure previous;
+    if (lookupFailure(aUrl, previous))
+        failure.Count = previous.Count + 1;
+
+    auto delay = backoff(failure.Class, failure.Count);
+    failure.RetryTime = Clock::now() + delay;
+
+    auto key = YoutubeDL::NormaliseUrl(aUrl);
+    {
+        std::lock_guard<std::mutex> _lock(m_failureMutex);
+        m_failures[key] = failure;
+    }
+
+    if (m_failureStore.isOpen())
+        m_failureStore.put(key, nlohmann::json{
+            { "class", int(failure.Class) },
+            { "count", failure.Count },
+            { "retry", std::chrono::duration_cast<std::chrono::seconds>(failure.RetryTime.time_since_epoch()).count() },
+            { "error", failure.Error },
+        }.dump(), forgetTime(failure));
+
+    return failure;
+}
+
+void ResolverCache::clearFailure(const std::string& aUrl)
+{
+    auto key = YoutubeDL::NormaliseUrl(aUrl);
+    {
+        std::lock_guard<std::mutex> _lock(m_failureMutex);
+        if (m_failures.erase(key) == 0 && !m_failureStore.isOpen())
+            return;
+    }
+
+    if (m_failureStore.isOpen())
+        m_failureStore.erase(key);
+}
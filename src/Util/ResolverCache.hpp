@@ -0,0 +1,60 @@
+#pragma once
+
+#include "RecordStore.hpp"
+#include "YoutubeDL.hpp"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Persistent cache of resolved songs, keyed by source URL.
+//
+// Song metadata is long-lived and kept separate from the stream URLs,
+// which expire and are only handed out while still valid. Failed URLs are
+// remembered too, so they're not retried until their backoff runs out.
+class ResolverCache
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    struct Failure
+    {
+        YoutubeDL::ErrorClass Class;
+        // Failures in a row, the backoff doubles with each one
+        uint32_t Count;
+        Clock::time_point RetryTime;
+        std::string Error;
+    };
+
+    enum LookupResult
+    {
+        Cache_Miss,
+        Cache_Metadata,
+        Cache_Full,
+    };
+
+    static ResolverCache& getSingleton();
+
+    bool open(const std::filesystem::path& aDirectory, uint64_t aMaxSize);
+    void close();
+    bool isOpen() const;
+
+    LookupResult lookup(const std::string& aUrl, YoutubeDLResponse& aResponse) const;
+    void store(const std::string& aUrl, const YoutubeDLResponse& aResponse);
+    void invalidateStream(const std::string& aUrl);
+
+    // Failure history of a URL, whether or not its backoff has run out yet
+    bool lookupFailure(const std::string& aUrl, Failure& aFailure) const;
+    // Records another failure and works out when to try again
+    Failure storeFailure(const std::string& aUrl, const std::string& aError);
+    void clearFailure(const std::string& aUrl);
+
+private:
+    Util::RecordStore m_metadata;
+    Util::RecordStore m_streams;
+    Util::RecordStore m_failureStore;
+
+    // Also kept in memory, so failures are remembered with the cache disabled
+    mutable std::mutex m_failureMutex;
+    mutable std::unordered_map<std::string, Failure> m_failures;
+};
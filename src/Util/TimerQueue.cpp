@@ -0,0 +1,70 @@
+#include "TimerQueue.hpp"
+
+#include <algorithm>
+
+using Util::TimerQueue;
+
+namespace
+{
+
+struct Later
+{
+    bool operator()(const TimerQueue::Timer& aLhs, const TimerQueue::Timer& aRhs) const
+    {
+        return aLhs.Time > aRhs.Time;
+    }
+};
+
+}
+
+TimerQueue::TimerQueue(const TimerQueue& aCopy)
+{
+    std::lock_guard<std::mutex> _lock(aCopy.m_mutex);
+    m_heap = aCopy.m_heap;
+}
+
+TimerQueue& TimerQueue::operator=(const TimerQueue& aCopy)
+{
+    if (this == &aCopy)
+        return *this;
+
+    std::scoped_lock _lock(m_mutex, aCopy.m_mutex);
+    m_heap = aCopy.m_heap;
+    return *this;
+}
+
+void TimerQueue::schedule(size_t aKey, Clock::time_point aTime)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_heap.push_back({ aTime, aKey });
+    std::push_heap(m_heap.begin(), m_heap.end(), Later());
+}
+
+void TimerQueue::popExpired(Clock::time_point aNow, std::vector<Timer>& aExpired)
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    while (!m_heap.empty() && m_heap.front().Time <= aNow)
+    {
+        std::pop_heap(m_heap.begin(), m_heap.end(), Later());
+        aExpired.push_back(m_heap.back());
+        m_heap.pop_back();
+    }
+}
+
+void TimerQueue::clear()
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    m_heap.clear();
+}
+
+size_t TimerQueue::size() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    return m_heap.size();
+}
+
+bool TimerQueue::empty() const
+{
+    std::lock_guard<std::mutex> _lock(m_mutex);
+    return m_heap.empty();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+
+namespace Util
+{
+
+// Min-heap of (time, key) timers.
+//
+// Timers are never removed or moved, rescheduling a key just adds another
+// entry. Callers are expected to check popped entries against their own
+// state and drop the stale ones.
+class TimerQueue
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    struct Timer
+    {
+        Clock::time_point Time;
+        size_t Key;
+    };
+
+    TimerQueue() = default;
+    TimerQueue(const TimerQueue& aCopy);
+    TimerQueue& operator=(const TimerQueue& aCopy);
+
+    void schedule(size_t aKey, Clock::time_point aTime);
+    // Moves all timers due at aNow into aExpired, earliest first
+    void popExpired(Clock::time_point aNow, std::vector<Timer>& aExpired);
+    void clear();
+
+    size_t size() const;
+    bool empty() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<Timer> m_heap;
+};
+
+}
@@ -1,14 +1,25 @@
 #include "WorkQueue.hpp"
 
+#include <algorithm>
+
 using Util::WorkQueue;
 
-WorkQueue::WorkQueue(uint8_t aCount)
-    : m_running(false)
+namespace
+{
+
+uint8_t defaultWorkerCount()
 {
-    if (aCount == 0)
-        aCount = 4; // TODO: detect
+    // Tasks mostly sit waiting on child processes, so don't go below a few workers
+    return uint8_t(std::clamp(std::thread::hardware_concurrency(), 2u, 16u));
+}
 
-    m_workThreads.resize(aCount);
+}
+
+WorkQueue::WorkQueue(uint8_t aCount)
+    : m_workerCount(aCount == 0 ? defaultWorkerCount() : aCount)
+    , m_lowPriorityBusy(0)
+    , m_running(false)
+{
 }
 
 WorkQueue::~WorkQueue()
@@ -18,55 +29,139 @@ WorkQueue::~WorkQueue()
 
 void WorkQueue::setWorkerCount(uint8_t aCount)
 {
-    auto running = m_running;
+    auto running = m_running.load();
 
     if (running)
         stop();
 
-    m_workThreads.resize(aCount);
+    m_workerCount = aCount == 0 ? defaultWorkerCount() : aCount;
 
     if (running)
         start();
 }
 uint8_t WorkQueue::getWorkerCount() const
 {
-    return uint8_t(m_workThreads.size());
+    return m_workerCount;
 }
 
 void WorkQueue::start()
 {
     m_running = true;
+    m_workThreads.resize(m_workerCount);
     for (auto& thr : m_workThreads)
         thr = std::thread(&WorkQueue::_workThread, this);
 }
 
 void WorkQueue::stop()
 {
-    m_running = false;
+    {
+        std::lock_guard<std::mutex> _lock(m_queueMutex);
+        m_running = false;
+    }
     m_queueCV.notify_all();
 
     for (auto& thread : m_workThreads)
         if (thread.joinable())
             thread.join();
+    m_workThreads.clear();
+}
+
+bool WorkQueue::reprioritise(uintptr_t aKey, Priority aPriority)
+{
+    if (aKey == 0)
+        return false;
+
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> _lock(m_queueMutex);
+        for (uint8_t i = 0; i < Priority_Count; ++i)
+        {
+            if (i == aPriority)
+                continue;
+
+            auto& queue = m_taskQueues[i];
+            auto it = std::stable_partition(queue.begin(), queue.end(), [aKey](auto& task) { return task.Key != aKey; });
+            if (it == queue.end())
+                continue;
+
+            auto& target = m_taskQueues[aPriority];
+            // Promoted tasks jump the line, demoted ones wait their turn
+            if (aPriority < i)
+                target.insert(target.begin(), std::make_move_iterator(it), std::make_move_iterator(queue.end()));
+            else
+                target.insert(target.end(), std::make_move_iterator(it), std::make_move_iterator(queue.end()));
+            queue.erase(it, queue.end());
+            found = true;
+        }
+    }
+
+    if (found)
+        m_queueCV.notify_all();
+
+    return found;
+}
+
+void WorkQueue::_queueTask(Priority aPriority, uintptr_t aKey, InlineTask&& aFunc)
+{
+    {
+        std::lock_guard<std::mutex> _lock(m_queueMutex);
+        m_taskQueues[aPriority].push_back({ aKey, std::move(aFunc) });
+    }
+
+    // A worker held back from low priority work might be the only one able to take it
+    if (aPriority < Priority_Metadata)
+        m_queueCV.notify_all();
+    else
+        m_queueCV.notify_one();
+}
+
+bool WorkQueue::_takeTask(Task& aTask, bool& aLowPriority)
+{
+    // Keep one worker free for playback and prefetching, so that those never
+    // wait for more than a single low priority task to finish
+    bool allowLow = m_workThreads.size() < 2 || m_lowPriorityBusy < m_workThreads.size() - 1;
+
+    for (uint8_t i = 0; i < Priority_Count; ++i)
+    {
+        auto& queue = m_taskQueues[i];
+        if (queue.empty())
+            continue;
+
+        aLowPriority = i >= Priority_Metadata;
+        if (aLowPriority && !allowLow)
+            return false;
+
+        aTask = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+
+    return false;
 }
 
 void WorkQueue::_workThread()
 {
-    std::unique_lock<std::mutex> _lock(m_queueMutex, std::defer_lock);
+    std::unique_lock<std::mutex> _lock(m_queueMutex);
     while (m_running)
     {
-        _lock.lock();
-        m_queueCV.wait(_lock, [this]() { return !m_taskQueue.empty(); });
+        Task task;
+        bool lowPriority = false;
+        m_queueCV.wait(_lock, [&]() { return !m_running || _takeTask(task, lowPriority); });
+        if (!task.Func)
+            continue;
 
-        if (!m_taskQueue.empty())
-        {
-            auto job = m_taskQueue.front();
-            m_taskQueue.erase(m_taskQueue.begin());
-            _lock.unlock();
+        if (lowPriority)
+            ++m_lowPriorityBusy;
+        _lock.unlock();
+
+        task.Func();
 
-            job();
+        _lock.lock();
+        if (lowPriority)
+        {
+            --m_lowPriorityBusy;
+            // A reserved worker may now be allowed to pick up low priority work again
+            m_queueCV.notify_one();
         }
-        else
-            _lock.unlock();
     }
 }
@@ -1,21 +1,42 @@
 #pragma once
 
+#include "InlineTask.hpp"
+
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include <cstdint>
+
 namespace Util
 {
 
+// Thread pool around one locked set of task deques, one per priority class.
+//
+// While there's more than one worker, one of them is always kept free of
+// metadata and background work, so those run on at most count - 1 workers.
 class WorkQueue
 {
 public:
+    // Most urgent first, workers always take from the most urgent non-empty class
+    enum Priority : uint8_t
+    {
+        Priority_Playback,
+        Priority_Prefetch,
+        Priority_Metadata,
+        Priority_Background,
+
+        Priority_Count
+    };
+
+    // A count of 0 sizes the pool from the hardware concurrency
     WorkQueue(uint8_t aCount = 0);
     WorkQueue(const WorkQueue&) = delete;
-    WorkQueue(WorkQueue&&) = default;
     ~WorkQueue();
 
     void setWorkerCount(uint8_t aCount);
@@ -29,16 +50,31 @@ public:
     std::future<Ret> queueTask(Func&& aFunc);
     template<typename Ret, typename Func, typename... Args>
     std::future<Ret> queueTask(Func&& aFunc, Args&&... aArgs);
+    // Tasks queued with a non-zero key can be moved to another class while still waiting
+    template<typename Ret, typename Func>
+    std::future<Ret> queuePriorityTask(Priority aPriority, uintptr_t aKey, Func&& aFunc);
+
+    bool reprioritise(uintptr_t aKey, Priority aPriority);
 
 private:
+    struct Task
+    {
+        uintptr_t Key;
+        InlineTask Func;
+    };
+
+    void _queueTask(Priority aPriority, uintptr_t aKey, InlineTask&& aFunc);
+    bool _takeTask(Task& aTask, bool& aLowPriority);
     void _workThread();
 
     std::condition_variable m_queueCV;
     std::mutex m_queueMutex;
-    std::vector<std::function<void()>> m_taskQueue;
+    std::deque<Task> m_taskQueues[Priority_Count];
     std::vector<std::thread> m_workThreads;
+    uint8_t m_workerCount;
+    size_t m_lowPriorityBusy;
 
-    bool m_running;
+    std::atomic<bool> m_running;
 };
 
 }
@@ -46,30 +82,35 @@ private:
 template<typename Ret, typename Func>
 std::future<Ret> Util::WorkQueue::queueTask(Func&& aFunc)
 {
-    auto task = std::make_shared<std::packaged_task<Ret()>>(std::forward<Func>(aFunc));
-    auto future = task->get_future();
-
-    {
-        std::lock_guard<std::mutex> _lock(m_queueMutex);
-        m_taskQueue.push_back([task = std::move(task)]() { (*task)(); } );
-    }
-
-    m_queueCV.notify_one();
-
-    return future;
+    return queuePriorityTask<Ret>(Priority_Background, 0, std::forward<Func>(aFunc));
 }
 template<typename Ret, typename Func, typename... Args>
 std::future<Ret> Util::WorkQueue::queueTask(Func&& aFunc, Args&&... aArgs)
 {
-    auto task = std::make_shared<std::packaged_task<Ret()>>(std::bind(std::forward<Func>(aFunc), std::forward<Args>(aArgs)...));
-    auto future = task->get_future();
-
-    {
-        std::lock_guard<std::mutex> _lock(m_queueMutex);
-        m_taskQueue.push_back([task = std::move(task)]() { (*task)(); });
-    }
-
-    m_queueCV.notify_one();
+    return queuePriorityTask<Ret>(Priority_Background, 0, std::bind(std::forward<Func>(aFunc), std::forward<Args>(aArgs)...));
+}
+template<typename Ret, typename Func>
+std::future<Ret> Util::WorkQueue::queuePriorityTask(Priority aPriority, uintptr_t aKey, Func&& aFunc)
+{
+    std::promise<Ret> promise;
+    auto future = promise.get_future();
+
+    _queueTask(aPriority, aKey, [func = std::forward<Func>(aFunc), promise = std::move(promise)]() mutable {
+        try
+        {
+            if constexpr (std::is_void_v<Ret>)
+            {
+                func();
+                promise.set_value();
+            }
+            else
+                promise.set_value(func());
+        }
+        catch (...)
+        {
+            promise.set_exception(std::current_exception());
+        }
+    });
 
     return future;
 }
@@ -1,16 +1,21 @@
 #include "YoutubeDL.hpp"
+#include "FormatSelector.hpp"
 #include "Logging.hpp"
+#include "Process.hpp"
+#include "YoutubeDLParser.hpp"
+#include "YoutubeDLPool.hpp"
 
 #include "../External/json.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <experimental/filesystem>
 #include <iomanip>
 #include <fstream>
-#include <random>
 #include <sstream>
+#include <string_view>
 
-#include <cstdio>
+#include <csignal>
 
 namespace fs = std::experimental::filesystem;
 
@@ -28,6 +33,114 @@ const std::string SAFE_AUDIO_FORMATS[] = {
     "m4a", "opus", "vorbis", "wav"
 };
 
+// Only the fields a response is built from, printed as one small JSON object
+// per URL instead of the full info dict with every format and caption
+const std::string TRIMMED_TEMPLATE = "%(.{title,duration,artist,creator,uploader,extractor,extractor_key,"
+                                     "thumbnail,webpage_url,original_url,url,http_headers,acodec,vcodec,abr})j";
+// Printed on the line after, when alternate formats are wanted
+const std::string TRIMMED_FORMATS_TEMPLATE = "%(formats.:.{url,acodec,vcodec,ext,protocol,abr,tbr,"
+                                             "filesize,filesize_approx,http_headers})j";
+
+enum TrimSupport
+{
+    Trim_Unknown,
+    Trim_Supported,
+    Trim_Unsupported,
+};
+
+// Whether the installed binary understands the template, learned on first use
+std::atomic<int> s_trimSupport(Trim_Unknown);
+
+std::atomic<uint64_t> s_deadlines(0),
+                      s_cancellations(0),
+                      s_kills(0);
+
+// Errors about the song itself rather than about reaching it
+const std::string_view PERMANENT_ERRORS[] = {
+    "Video unavailable", "This video is unavailable", "video is not available",
+    "Private video", "This video is private", "has been removed", "has been terminated",
+    "not available in your country", "geo restriction", "geo-restricted", "blocked it in your country",
+    "Unsupported URL", "HTTP Error 404", "HTTP Error 410",
+    "members-only", "Join this channel", "confirm your age",
+};
+
+// Path prefixes of collection pages, per host (without www.)
+const std::pair<std::string_view, std::string_view> COLLECTION_PATHS[] = {
+    { "youtube.com", "/playlist" }, { "youtube.com", "/channel/" }, { "youtube.com", "/c/" },
+    { "youtube.com", "/user/" }, { "youtube.com", "/@" },
+    { "music.youtube.com", "/playlist" }, { "music.youtube.com", "/browse/" },
+    { "soundcloud.com", "/sets/" }, { "soundcloud.com", "/likes" },
+    { "vimeo.com", "/channels/" }, { "vimeo.com", "/album/" }, { "vimeo.com", "/showcase/" },
+};
+
+// Whether the binary printed the trimmed template, rather than rejecting
+// -O outright (youtube-dl) or printing "NA" for the field subset (old yt-dlp).
+// Splices format lists into the object printed before them, so the output
+// reads like -j with one info dict per line
+bool joinTrimmed(Util::ProcessResult& aResult)
+{
+    for (auto option : { "no such option", "unrecognized arguments" })
+        if (aResult.Stderr.find(option) != std::string::npos)
+            return false;
+
+    std::string joined;
+    bool open = false;
+
+    std::istringstream iss(aResult.Stdout);
+    for (std::string line; std::getline(iss, line); )
+    {
+        if (line.empty())
+            continue;
+
+        if (line.front() == '{' && line.back() == '}')
+        {
+            if (open)
+                joined += "}\n";
+            line.pop_back();
+            joined += line;
+            open = true;
+        }
+        else if (open && line.front() == '[')
+            joined += (joined.back() == '{' ? "\"formats\":" : ",\"formats\":") + line;
+        // Extractors without a format list
+        else if (!(open && line == "NA"))
+            return false;
+    }
+
+    if (open)
+        joined += "}\n";
+
+    aResult.Stdout = std::move(joined);
+    return true;
+}
+
+// Query parameters that only track where a link was shared from, or where
+// in the song it was opened; neither changes what youtube-dl resolves
+bool isTrackingParam(std::string_view aName)
+{
+    return aName == "feature" || aName == "si" || aName == "t" || aName.substr(0, 4) == "utm_";
+}
+
+std::string toLower(std::string_view aStr)
+{
+    std::string ret(aStr);
+    std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
+    return ret;
+}
+
+YoutubeDLResponse parseInfo(const std::string& aInfo)
+{
+    try
+    {
+        return YoutubeDLParser::Parse(aInfo);
+    }
+    catch(const std::exception& ex)
+    {
+        Util::Log(Util::Log_Error) << ex.what();
+        throw;
+    }
+}
+
 }
 
 YoutubeDL s_youtubeDL;
@@ -36,7 +149,97 @@ YoutubeDL& YoutubeDL::getSingleton()
     return s_youtubeDL;
 }
 
+std::string YoutubeDL::NormaliseUrl(const std::string& aUrl)
+{
+    std::string_view url = aUrl;
+    url = url.substr(0, url.find('#'));
+
+    auto schemeEnd = url.find("://");
+    if (schemeEnd == std::string_view::npos)
+        return std::string(url);
+
+    auto scheme = toLower(url.substr(0, schemeEnd));
+    if (scheme == "http")
+        scheme = "https";
+
+    auto rest = url.substr(schemeEnd + 3);
+    auto hostEnd = std::min(rest.find_first_of("/?"), rest.size());
+    auto host = toLower(rest.substr(0, hostEnd));
+    rest = rest.substr(hostEnd);
+
+    auto queryStart = std::min(rest.find('?'), rest.size());
+    std::string path(rest.substr(0, queryStart));
+    std::string_view query = rest.substr(std::min(queryStart + 1, rest.size()));
+
+    if (host.substr(0, 4) == "www.")
+        host = host.substr(4);
+    else if (host.substr(0, 2) == "m.")
+        host = host.substr(2);
+
+    std::string params;
+    if (host == "youtu.be" && path.size() > 1)
+    {
+        params = "v=" + path.substr(1);
+        host = "youtube.com";
+        path = "/watch";
+    }
+
+    while (!query.empty())
+    {
+        auto paramEnd = std::min(query.find('&'), query.size());
+        auto param = query.substr(0, paramEnd);
+        query = query.substr(std::min(paramEnd + 1, query.size()));
+
+        if (param.empty() || isTrackingParam(param.substr(0, param.find('='))))
+            continue;
+
+        if (!params.empty())
+            params += '&';
+        params += param;
+    }
+
+    if (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+
+    return scheme + "://" + host + path + (params.empty() ? "" : "?" + params);
+}
+
+YoutubeDL::ErrorClass YoutubeDL::ClassifyError(const std::string& aError)
+{
+    for (auto& permanent : PERMANENT_ERRORS)
+        if (aError.find(permanent) != std::string::npos)
+            return Error_Permanent;
+
+    return Error_Transient;
+}
+
+bool YoutubeDL::IsCollectionUrl(const std::string& aUrl)
+{
+    auto url = NormaliseUrl(aUrl);
+    auto hostStart = url.find("://");
+    if (hostStart == std::string::npos)
+        return false;
+
+    hostStart += 3;
+    auto pathStart = std::min(url.find_first_of("/?", hostStart), url.size());
+    std::string_view host(url.data() + hostStart, pathStart - hostStart);
+    std::string_view path(url.data() + pathStart, url.size() - pathStart);
+
+    for (auto& collection : COLLECTION_PATHS)
+        if (host == collection.first && path.substr(0, collection.second.size()) == collection.second)
+            return true;
+
+    // Bandcamp albums live on the artist's own subdomain
+    if (host.size() > 13 && host.substr(host.size() - 13) == ".bandcamp.com" && path.substr(0, 7) == "/album/")
+        return true;
+
+    return false;
+}
+
 YoutubeDL::YoutubeDL()
+    : m_batchSize(1)
+    , m_timeout(60)
+    , m_trimmed(true)
 {
 }
 
@@ -70,6 +273,7 @@ void YoutubeDL::findInstall(const std::vector<std::string>& aSearchPaths)
         {
             // TODO: Only use executable files
             m_installPath = file.string();
+            s_trimSupport = Trim_Unknown;
             return;
         }
     }
@@ -92,15 +296,65 @@ bool YoutubeDL::canLocalInstall() const
     return false;
 }
 
+void YoutubeDL::setWorkerPool(const std::string& aWorker, uint8_t aCount)
+{
+    if (m_pool)
+        m_pool->stop();
+
+    m_pool = std::make_shared<YoutubeDLPool>();
+    m_pool->setWorker(aWorker);
+    m_pool->setWorkerCount(aCount);
+
+    if (m_pool->start())
+        Util::Log(Util::Log_Info) << "[YDL] Using " << int(m_pool->getWorkerCount()) << " resolver workers from " << aWorker;
+    else
+        m_pool.reset();
+}
+
+void YoutubeDL::setBatchSize(size_t aSize)
+{
+    m_batchSize = std::max(aSize, size_t(1));
+}
+size_t YoutubeDL::getBatchSize() const
+{
+    return m_batchSize;
+}
+void YoutubeDL::setTimeout(std::chrono::seconds aTimeout)
+{
+    m_timeout = aTimeout;
+}
+std::chrono::seconds YoutubeDL::getTimeout() const
+{
+    return m_timeout;
+}
+void YoutubeDL::setTrimmedOutput(bool aTrimmed)
+{
+    m_trimmed = aTrimmed;
+}
+bool YoutubeDL::getTrimmedOutput() const
+{
+    return m_trimmed;
+}
+
+YoutubeDLStats YoutubeDL::getStats() const
+{
+    // Worker kills are counted by the pool, which only knows after the fact
+    uint64_t poolKills = m_pool ? m_pool->getKills() : 0;
+    return { s_deadlines, s_cancellations, s_kills + poolKills };
+}
+
 bool YoutubeDL::isAvailable() const
 {
+    if (m_pool && m_pool->running())
+        return true;
+
     return !m_installPath.empty() && fs::is_regular_file(m_installPath);
 }
 
 std::string YoutubeDL::getVersion() const
 {
     std::string ver;
-    const_cast<YoutubeDL*>(this)->execute("--version", ver);
+    const_cast<YoutubeDL*>(this)->execute({ "--version" }, ver);
     return ver.substr(0, ver.find('\n'));
 }
 
@@ -125,7 +379,7 @@ bool YoutubeDL::update()
         return false;
 
     std::string out;
-    execute("--update", out);
+    execute({ "--update" }, out);
 
     if (out.find("Please use that to update.") != std::string::npos)
         return false;
@@ -156,7 +410,7 @@ YoutubeDLResponse YoutubeDL::download(const YoutubeDLRequest& aRequest)
     if (!validRequest(aRequest))
         return { false };
 
-    std::ostringstream oss;
+    std::vector<std::string> args;
 
     if (aRequest.Url.empty())
     {
@@ -164,23 +418,22 @@ YoutubeDLResponse YoutubeDL::download(const YoutubeDLRequest& aRequest)
         return { false };
     }
     else
-        oss << std::quoted(aRequest.Url, '\'') << " ";
+        args.push_back(aRequest.Url);
 
     if (!aRequest.VideoFormat.empty())
-        oss << "--format=" << aRequest.VideoFormat << " ";
+        args.push_back("--format=" + aRequest.VideoFormat);
     else
-        oss << "--format=bestaudio ";
+        args.push_back("--format=bestaudio");
 
     if (aRequest.ExtractAudio)
-        oss << "--extract-audio ";
+        args.push_back("--extract-audio");
 
     if (!aRequest.AudioFormat.empty())
-        oss << "--audio-format=" << aRequest.AudioFormat << " ";
+        args.push_back("--audio-format=" + aRequest.AudioFormat);
 
-    auto cmd = oss.str();
     std::string ret;
 
-    if (execute(cmd, ret) != 0)
+    if (execute(args, ret) != 0)
         return { false };
 
     // TODO: Read output
@@ -188,166 +441,309 @@ YoutubeDLResponse YoutubeDL::download(const YoutubeDLRequest& aRequest)
     return { true };
 }
 
-YoutubeDLResponse YoutubeDL::request(const YoutubeDLRequest& aRequest)
+YoutubeDLResponse YoutubeDL::request(const YoutubeDLRequest& aRequest, const Util::CancelToken& aToken)
 {
     if (!validRequest(aRequest))
         return { false };
 
-    std::ostringstream oss;
-
     if (aRequest.Url.empty())
     {
         // TODO
         return { false };
     }
-    else
+
+    auto token = arm(aToken);
+    if (token.stopRequested())
+        stopped(token, false);
+
+    if (m_pool && m_pool->running())
     {
-        oss << "-C -q -s -j " << std::quoted(aRequest.Url, '\'') << " ";
+        std::string info;
+        try
+        {
+            info = m_pool->resolve(aRequest.Url, FormatSelector::getSingleton().getFormatSpec(), token);
+        }
+        catch (const std::exception&)
+        {
+            if (token.stopRequested())
+                stopped(token, false);
+            throw;
+        }
+
+        return parseInfo(info);
     }
 
+    std::vector<std::string> args = { aRequest.Url };
+
     if (aRequest.ExtractAudio)
-        oss << "--extract-audio ";
+        args.push_back("--extract-audio");
     if (!aRequest.AudioFormat.empty())
-        oss << "--audio-format=" << aRequest.AudioFormat << " ";
+        args.push_back("--audio-format=" + aRequest.AudioFormat);
 
-    auto cmd = oss.str();
-    std::string ret;
+    auto result = runInfo(args, token);
+    if (result.ExitCode != 0)
+        throw std::runtime_error(result.Stderr);
 
-    int result = execute(cmd, ret);
-    if (result != 0)
-        throw std::runtime_error(ret);
+    return parseInfo(result.Stdout);
+}
 
-    Util::Log(Util::Log_Debug) << "[YDL] > \"" << cmd << "\" returned (" << result << "|" << ret.size() << "B)";
+std::vector<YoutubeDLResponse> YoutubeDL::requestBatch(const std::vector<YoutubeDLRequest>& aRequests, const Util::CancelToken& aToken)
+{
+    std::vector<YoutubeDLResponse> responses(aRequests.size(), YoutubeDLResponse{ false });
 
-    try
+    std::vector<size_t> pending;
+    std::vector<std::string> normalised(aRequests.size());
+    std::vector<std::string> args = { "--ignore-errors" };
+    for (size_t i = 0; i < aRequests.size(); ++i)
     {
-        auto data = nlohmann::json::parse(ret);
-        if (data["duration"].is_null())
-            data["duration"] = 0;
+        if (!validRequest(aRequests[i]) || aRequests[i].Url.empty())
+            continue;
 
-        if (data["thumbnail"].is_null())
+        pending.push_back(i);
+        normalised[i] = NormaliseUrl(aRequests[i].Url);
+        args.push_back(aRequests[i].Url);
+    }
+
+    if (pending.empty())
+        return responses;
+
+    auto token = arm(aToken);
+    if (token.stopRequested())
+        stopped(token, false);
+
+    // The workers only take one URL at a time, feed them in order instead
+    if (m_pool && m_pool->running())
+    {
+        for (auto i : pending)
         {
-            auto thumbnails = data["thumbnails"];
-            if (thumbnails.empty())
-                data["thumbnail"] = "";
-            else
-                data["thumbnail"] = thumbnails.front();
+            try
+            {
+                responses[i] = parseInfo(m_pool->resolve(aRequests[i].Url, FormatSelector::getSingleton().getFormatSpec(), token));
+            }
+            catch (const std::exception& ex)
+            {
+                if (token.stopRequested())
+                    stopped(token, false);
+                Util::Log(Util::Log_Debug) << "[YDL] Batch entry " << aRequests[i].Url << " failed; " << ex.what();
+            }
         }
 
-        auto response = YoutubeDLResponse{ true, data["duration"], data["title"], data["thumbnail"] };
+        return responses;
+    }
 
-        if (data.count("artist") > 0 && !data["artist"].is_null())
-            response.Artist = data["artist"];
-        else if (data.count("creator") > 0 && !data["creator"].is_null())
-            response.Artist = data["creator"];
-        else if (data.count("uploader") > 0 && !data["uploader"].is_null())
-            response.Artist = data["uploader"];
+    auto result = runInfo(args, token);
 
-        if (data.count("extractor_key") > 0 && !data["extractor_key"].is_null())
-            response.Extractor = data["extractor_key"];
-        else if (data.count("extractor") > 0 && !data["extractor"].is_null())
-            response.Extractor = data["extractor"];
+    std::vector<YoutubeDLResponse> parsed;
+    std::istringstream iss(result.Stdout);
+    for (std::string line; std::getline(iss, line); )
+    {
+        if (line.empty())
+            continue;
 
-        nlohmann::json chosenFormat = { { "abr", -1.0 } };
+        try
+        {
+            parsed.push_back(parseInfo(line));
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
 
-        // Direct format match
-        if (data.count("url") > 0)
+    // Match results back by the URL they were requested with, fall back to
+    // output order only when every entry produced a result. youtube-dl
+    // reports the canonical page URL, so both sides are normalised first
+    if (parsed.size() == pending.size() && std::none_of(parsed.begin(), parsed.end(), [](auto& it) { return !it.SourceUrl.empty(); }))
+    {
+        for (size_t i = 0; i < pending.size(); ++i)
+            responses[pending[i]] = std::move(parsed[i]);
+    }
+    else
+    {
+        size_t cursor = 0;
+        for (size_t j = 0; j < parsed.size(); ++j)
         {
-            chosenFormat = data;
+            auto& response = parsed[j];
+            auto source = NormaliseUrl(response.SourceUrl);
+            auto it = std::find_if(pending.begin() + cursor, pending.end(), [&normalised, &source](size_t i) {
+                return normalised[i] == source;
+            });
+
+            // Only fall back to the entry's own slot when that is still ahead
+            // and unclaimed, or it would overwrite a matched result
+            if (it == pending.end() && parsed.size() == pending.size() && j >= cursor && !responses[pending[j]].Success)
+                it = pending.begin() + j;
+            if (it == pending.end())
+                continue;
+
+            responses[*it] = std::move(response);
+            cursor = (it - pending.begin()) + 1;
         }
-        else
+    }
+
+    if (result.ExitCode != 0)
+        Util::Log(Util::Log_Debug) << "[YDL] Batch of " << pending.size() << " returned " << parsed.size() << " results; " << result.Stderr;
+
+    return responses;
+}
+
+bool YoutubeDL::expand(const std::string& aUrl, const std::function<void(YoutubeDLResponse&&)>& aEntry, const Util::CancelToken& aToken)
+{
+    if (!validRequest({ aUrl }) || m_installPath.empty())
+        return false;
+
+    std::vector<std::string> argv = { m_installPath, "-C", "-q", "--flat-playlist", "-j", aUrl };
+
+    Util::Log(Util::Log_Debug) << "[YDL] Expanding " << aUrl;
+
+    Util::Process proc;
+    if (!proc.spawn(argv))
+        return false;
+
+    Util::CancelToken::Subscription killer(aToken, [&proc]() { proc.kill(SIGKILL); });
+
+    // One small document per entry, so they can be handed on as they arrive
+    size_t count = 0;
+    std::string line;
+    while (proc.readLine(line, aToken))
+    {
+        if (line.empty())
+            continue;
+
+        try
         {
-            nlohmann::json formats;
-            // Multiple format matches
-            if (data.count("requested_formats") > 0)
-            {
-                formats = data["requested_formats"];
-            }
-            // No format match, iterate all available formats
-            else
-            {
-                formats = data["formats"];
-            }
+            auto data = nlohmann::json::parse(line);
+
+            YoutubeDLResponse entry{ true };
+            entry.SourceUrl = data.value("url", std::string());
+            entry.Title = data.value("title", std::string());
+            entry.Duration = uint32_t(data.value("duration", 0.0));
+            entry.Extractor = data.value("ie_key", std::string());
+            entry.Artist = data.value("uploader", data.value("channel", std::string()));
 
-            for (auto& format : formats)
+            // Older youtube-dl versions only list the video ID
+            if (entry.SourceUrl.find("://") == std::string::npos)
             {
-                if (format["acodec"] == "none")
-                    continue;
-                if (format["vcodec"] != "none")
+                auto id = data.value("id", std::string());
+                if (entry.Extractor != "Youtube" || id.empty())
                     continue;
+                entry.SourceUrl = "https://www.youtube.com/watch?v=" + id;
+            }
 
-                if (format["abr"].is_null())
-                    format["abr"] = 1.0;
+            ++count;
+            aEntry(std::move(entry));
+        }
+        catch (const std::exception& ex)
+        {
+            Util::Log(Util::Log_Debug) << "[YDL] Skipping invalid playlist entry; " << ex.what();
+        }
+    }
 
-                if (format["abr"].get<double>() > chosenFormat["abr"].get<double>())
-                {
-                    chosenFormat = format;
-                    Util::Log(Util::Log_Debug) << "Using format " << chosenFormat.dump();
-                }
-            }
+    killer.reset();
+    auto stopped = aToken.stopRequested();
+    if (stopped)
+        proc.kill(SIGKILL);
 
-            // Unable to find a suitable format, fall back to first one
-            if (chosenFormat["url"].is_null())
-            {
-                chosenFormat = *std::find_if(formats.begin(), formats.end(), [](auto& format) { return format["acodec"] != "none"; });
+    auto error = proc.takeStderr();
+    auto exitCode = proc.wait();
 
-                Util::Log(Util::Log_Debug) << "Falling back to format " << chosenFormat.dump();
-            }
-        }
+    Util::Log(Util::Log_Debug) << "[YDL] Expanded " << aUrl << " into " << count << " entries (" << exitCode << ")";
 
-        response.DownloadUrl = chosenFormat["url"];
-        response.DownloadHeaders = chosenFormat["http_headers"].get<std::unordered_map<std::string, std::string>>();
+    if (stopped)
+        return false;
+    if (exitCode != 0 && count == 0)
+        throw std::runtime_error(error);
 
-        return response;
-    }
-    catch(const std::exception& ex)
-    {
-        Util::Log(Util::Log_Error) << ex.what();
-        throw ex;
-    }
+    return true;
+}
+
+int YoutubeDL::execute(const std::vector<std::string>& aArgs, std::string& aOut)
+{
+    auto result = run(aArgs);
+
+    if (result.ExitCode == 0)
+        aOut = std::move(result.Stdout);
+    else
+        aOut = std::move(result.Stderr);
+
+    return result.ExitCode;
 }
 
-int YoutubeDL::execute(const std::string& args, std::string& out)
+Util::ProcessResult YoutubeDL::run(const std::vector<std::string>& aArgs, const Util::CancelToken& aToken)
 {
+    std::vector<std::string> argv;
+    argv.reserve(aArgs.size() + 1);
+    argv.push_back(m_installPath);
+    argv.insert(argv.end(), aArgs.begin(), aArgs.end());
+
     std::ostringstream oss;
-    oss << m_installPath << " " << args;
+    for (auto& arg : argv)
+        oss << " " << std::quoted(arg, '\'');
+    auto cmd = oss.str();
 
-    std::random_device dev;
-    std::uniform_int_distribution<int> dist(100000, 999999);
-    int val = dist(dev);
+    Util::Log(Util::Log_Debug) << "[YDL] <" << cmd;
 
-    auto tmpdir = fs::temp_directory_path();
-    auto outname = tmpdir / ("ydl_out" + std::to_string(val));
-    auto errname = tmpdir / ("ydl_err" + std::to_string(val));
+    auto result = Util::Process::Run(argv, aToken);
 
-    Util::Log(Util::Log_Debug) << "[YDL] < " << oss.str();
+    Util::Log(Util::Log_Debug) << "[YDL] >" << cmd << " returned (" << result.ExitCode << "|" << result.Stdout.size() << "B|" << result.Stderr.size() << "B) in " << result.Duration;
 
-    int ret = 255;
-    try
+    return result;
+}
+
+Util::ProcessResult YoutubeDL::runInfo(const std::vector<std::string>& aArgs, const Util::CancelToken& aToken)
+{
+    bool trimmed = m_trimmed && s_trimSupport != Trim_Unsupported;
+
+    // Trimmed output only carries the format youtube-dl picked, so it needs
+    // to pick by the same preferences
+    std::vector<std::string> args = { "-C", "-q", "-s", "-f", FormatSelector::getSingleton().getFormatSpec() };
+    if (trimmed)
     {
-        std::string scommand = oss.str();
-        std::string cmd = scommand + " 1> " + outname.string() + " 2> " + errname.string();
-        ret = std::system(cmd.c_str());
-
-        std::string filename;
-        if (ret == 0)
-            filename = outname;
-        else
-            filename = errname;
-
-        std::ifstream file(filename, std::ios::in | std::ios::binary);
-        std::string line;
-        while (file)
-        {
-            std::getline(file, line);
-            out.append(line);
-        }
-        file.close();
+        args.insert(args.end(), { "-O", TRIMMED_TEMPLATE });
+        if (FormatSelector::getSingleton().getAlternates() > 0)
+            args.insert(args.end(), { "-O", TRIMMED_FORMATS_TEMPLATE });
     }
-    catch(...) { }
+    else
+        args.push_back("-j");
+    args.insert(args.end(), aArgs.begin(), aArgs.end());
 
-    fs::remove(errname);
-    fs::remove(outname);
+    auto result = run(args, aToken);
+    if (result.Killed)
+        stopped(aToken, true);
+    if (!trimmed)
+        return result;
 
-    return ret;
+    if (joinTrimmed(result))
+    {
+        if (!result.Stdout.empty() && s_trimSupport.exchange(Trim_Supported) == Trim_Unknown)
+            Util::Log(Util::Log_Debug) << "[YDL] " << m_installPath << " prints field templates, resolving with trimmed output";
+        return result;
+    }
+
+    if (s_trimSupport.exchange(Trim_Unsupported) != Trim_Unsupported)
+        Util::Log(Util::Log_Info) << "[YDL] " << m_installPath << " can't print field templates, falling back to full info dicts";
+
+    return runInfo(aArgs, aToken);
+}
+
+Util::CancelToken YoutubeDL::arm(const Util::CancelToken& aToken) const
+{
+    auto token = aToken.valid() ? aToken : Util::CancelToken::Create();
+    if (m_timeout.count() > 0)
+        token.setDeadline(Util::CancelToken::Clock::now() + m_timeout);
+    return token;
+}
+
+void YoutubeDL::stopped(const Util::CancelToken& aToken, bool aKilled) const
+{
+    if (aKilled)
+        ++s_kills;
+
+    if (aToken.isCancelled())
+    {
+        ++s_cancellations;
+        throw std::runtime_error("Request was cancelled");
+    }
+
+    ++s_deadlines;
+    throw std::runtime_error("Request timed out after " + std::to_string(m_timeout.count()) + "s");
 }
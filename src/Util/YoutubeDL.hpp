@@ -1,35 +1,79 @@
 #pragma once
 
+#include "CancelToken.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <cstdint>
+
+class YoutubeDLPool;
+
+namespace Util { struct ProcessResult; }
+
 struct YoutubeDLRequest
 {
     std::string Url;
 
-    bool ExtractAudio;
-    std::string AudioFormat;
-    std::string VideoFormat;
+    bool ExtractAudio = false;
+    std::string AudioFormat{};
+    std::string VideoFormat{};
+};
+
+struct YoutubeDLFormat
+{
+    std::string Url;
+    std::unordered_map<std::string, std::string> Headers;
 };
 
 struct YoutubeDLResponse
 {
-    bool Success;
+    bool Success = false;
 
-    uint32_t Duration;
-    std::string Title;
-    std::string ThumbnailUrl;
-    std::string DownloadUrl;
-    std::unordered_map<std::string, std::string> DownloadHeaders;
+    uint32_t Duration = 0;
+    std::string Title{};
+    std::string ThumbnailUrl{};
+    std::string DownloadUrl{};
+    std::unordered_map<std::string, std::string> DownloadHeaders{};
+    // Next best formats, for when DownloadUrl fails
+    std::vector<YoutubeDLFormat> AlternateFormats{};
 
-    std::string Extractor;
-    std::string Artist;
+    std::string Extractor{};
+    std::string Artist{};
+    std::string SourceUrl{};
+
+    // Plays straight from the source URL, found out without youtube-dl
+    bool Direct = false;
+
+    // When DownloadUrl stops working, taken from the URL itself or guessed per extractor
+    std::chrono::system_clock::time_point Expiry{};
+};
+
+struct YoutubeDLStats
+{
+    // Requests that ran past their deadline
+    uint64_t Deadlines;
+    // Requests cancelled because nothing wanted their result any more
+    uint64_t Cancellations;
+    // Resolver processes killed for either of the above
+    uint64_t Kills;
 };
 
 class YoutubeDL
 {
 public:
+    enum ErrorClass
+    {
+        // Worth retrying soon; network trouble, throttling, timeouts
+        Error_Transient,
+        // Won't go away by itself; removed, private or region-locked songs
+        Error_Permanent,
+    };
+
     YoutubeDL();
     YoutubeDL(const YoutubeDL&) = default;
     YoutubeDL(YoutubeDL&&) = default;
@@ -40,9 +84,28 @@ public:
 
     static YoutubeDL& getSingleton();
 
+    // Reduces a source URL to a key shared by all the ways of writing it
+    static std::string NormaliseUrl(const std::string& aUrl);
+    // Sorts a failed request by the error youtube-dl printed
+    static ErrorClass ClassifyError(const std::string& aError);
+    // Whether the URL points at a playlist, channel or album rather than a single song
+    static bool IsCollectionUrl(const std::string& aUrl);
+
     void findInstall();
     void findInstall(const std::vector<std::string>& aSearchPaths);
     bool canLocalInstall() const;
+    void setWorkerPool(const std::string& aWorker, uint8_t aCount = 0);
+    void setBatchSize(size_t aSize);
+    size_t getBatchSize() const;
+    // How long a single request may run, zero to wait forever
+    void setTimeout(std::chrono::seconds aTimeout);
+    std::chrono::seconds getTimeout() const;
+    // Ask for just the fields a response needs instead of the full info
+    // dict, when the binary supports -O templates
+    void setTrimmedOutput(bool aTrimmed);
+    bool getTrimmedOutput() const;
+
+    YoutubeDLStats getStats() const;
 
     bool isAvailable() const;
     std::string getVersion() const;
@@ -54,10 +117,27 @@ public:
     bool validRequest(const YoutubeDLRequest& aRequest) const;
 
     YoutubeDLResponse download(const YoutubeDLRequest& aRequest);
-    YoutubeDLResponse request(const YoutubeDLRequest& aRequest);
+    // Throws if aToken is cancelled or the request runs past the timeout,
+    // which is armed on aToken the first time it's used for a request
+    YoutubeDLResponse request(const YoutubeDLRequest& aRequest, const Util::CancelToken& aToken = {});
+    // Resolves all requests in one invocation, failed entries are returned with Success = false
+    std::vector<YoutubeDLResponse> requestBatch(const std::vector<YoutubeDLRequest>& aRequests, const Util::CancelToken& aToken = {});
+    // Lists the entries of a collection URL as youtube-dl finds them, without
+    // resolving them. Entries only carry what the listing has, no DownloadUrl.
+    // Not bound by the request timeout, large channels take a while
+    bool expand(const std::string& aUrl, const std::function<void(YoutubeDLResponse&&)>& aEntry, const Util::CancelToken& aToken = {});
 
 private:
-    int execute(const std::string& args, std::string& out);
+    int execute(const std::vector<std::string>& aArgs, std::string& aOut);
+    Util::ProcessResult run(const std::vector<std::string>& aArgs, const Util::CancelToken& aToken = {});
+    // Runs a resolve for the URLs in aArgs, trimmed if possible and with -j otherwise
+    Util::ProcessResult runInfo(const std::vector<std::string>& aArgs, const Util::CancelToken& aToken);
+    Util::CancelToken arm(const Util::CancelToken& aToken) const;
+    [[noreturn]] void stopped(const Util::CancelToken& aToken, bool aKilled) const;
 
     std::string m_installPath;
+    std::shared_ptr<YoutubeDLPool> m_pool;
+    size_t m_batchSize;
+    std::chrono::seconds m_timeout;
+    bool m_trimmed;
 };
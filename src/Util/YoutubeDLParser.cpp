@@ -0,0 +1,396 @@
+#include "YoutubeDLParser.hpp"
+#include "FormatSelector.hpp"
+#include "Logging.hpp"
+
+#include "../External/json.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <cstdlib>
+
+namespace
+{
+
+using json = nlohmann::json;
+using namespace std::chrono_literals;
+
+// Stream lifetimes for extractors that don't put an expiry into their URLs
+const std::unordered_map<std::string_view, std::chrono::seconds> kExtractorLifetimes = {
+    { "Youtube", 6h },
+    { "Soundcloud", 30min },
+    { "Vimeo", 1h },
+    { "Bandcamp", 12h },
+    { "Generic", 24h },
+    { "Direct", 24h },
+};
+constexpr std::chrono::seconds kDefaultLifetime = 1h;
+
+// Expiry parameters seen in signed stream URLs, either as a query parameter
+// or as a path segment like googlevideo's /expire/<timestamp>/
+constexpr std::string_view kExpiryKeys[] = { "expire", "expires", "Expires" };
+
+bool findExpiry(std::string_view aUrl, int64_t& aValue)
+{
+    for (auto key : kExpiryKeys)
+    {
+        for (size_t pos = aUrl.find(key); pos != std::string_view::npos; pos = aUrl.find(key, pos + 1))
+        {
+            if (pos == 0)
+                continue;
+
+            char before = aUrl[pos - 1];
+            size_t valuePos = pos + key.size();
+            if (valuePos >= aUrl.size())
+                break;
+
+            char after = aUrl[valuePos];
+            if (!((before == '?' || before == '&') && after == '=') && !(before == '/' && after == '/'))
+                continue;
+
+            const char* start = aUrl.data() + valuePos + 1;
+            char* end;
+            auto value = std::strtoll(start, &end, 10);
+            if (end == start)
+                continue;
+
+            aValue = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+using Format = FormatSelector::Format;
+
+// The best few formats, best first
+struct FormatList
+{
+    std::vector<std::pair<FormatSelector::Score, Format>> Ranked;
+};
+
+class InfoHandler : public nlohmann::json_sax<json>
+{
+public:
+    explicit InfoHandler(const FormatSelector& aSelector)
+        : m_selector(aSelector)
+    { }
+
+    bool null() override { return true; }
+    bool boolean(bool) override { return true; }
+    bool number_integer(number_integer_t aVal) override { return number(double(aVal)); }
+    bool number_unsigned(number_unsigned_t aVal) override { return number(double(aVal)); }
+    bool number_float(number_float_t aVal, const string_t&) override { return number(double(aVal)); }
+
+    bool string(string_t& aVal) override
+    {
+        switch (context())
+        {
+        case Ctx_Root:
+            if (m_key == "title") m_response.Title = std::move(aVal);
+            else if (m_key == "thumbnail") m_response.ThumbnailUrl = std::move(aVal);
+            else if (m_key == "artist") m_artist = std::move(aVal);
+            else if (m_key == "creator") m_creator = std::move(aVal);
+            else if (m_key == "uploader") m_uploader = std::move(aVal);
+            else if (m_key == "extractor_key") m_extractorKey = std::move(aVal);
+            else if (m_key == "extractor") m_extractor = std::move(aVal);
+            else if (m_key == "original_url") m_originalUrl = std::move(aVal);
+            else if (m_key == "webpage_url") m_webpageUrl = std::move(aVal);
+            else
+                formatString(m_root, aVal);
+            break;
+
+        case Ctx_Format:
+            formatString(m_current, aVal);
+            break;
+
+        case Ctx_RootHeaders:
+            m_root.Headers[m_key] = std::move(aVal);
+            break;
+
+        case Ctx_FormatHeaders:
+            m_current.Headers[m_key] = std::move(aVal);
+            break;
+
+        case Ctx_Thumbnail:
+            if (m_thumbnailIndex == 0 && m_key == "url")
+                m_thumbnail = std::move(aVal);
+            break;
+
+        default:
+            break;
+        }
+
+        return true;
+    }
+
+    bool start_object(std::size_t) override
+    {
+        if (m_stack.empty())
+        {
+            m_stack.push_back(Ctx_Root);
+            return true;
+        }
+
+        auto ctx = context();
+        if (ctx == Ctx_Root && m_key == "http_headers")
+            m_stack.push_back(Ctx_RootHeaders);
+        else if (ctx == Ctx_Format && m_key == "http_headers")
+            m_stack.push_back(Ctx_FormatHeaders);
+        else if (ctx == Ctx_Format && m_key == "downloader_options")
+            m_stack.push_back(Ctx_FormatOptions);
+        else if (ctx == Ctx_FormatList)
+        {
+            m_current = Format();
+            m_stack.push_back(Ctx_Format);
+        }
+        else if (ctx == Ctx_Thumbnails)
+            m_stack.push_back(Ctx_Thumbnail);
+        else
+            m_stack.push_back(Ctx_Skip);
+
+        return true;
+    }
+
+    bool key(string_t& aVal) override
+    {
+        m_key.swap(aVal);
+        return true;
+    }
+
+    bool end_object() override
+    {
+        auto ctx = context();
+        m_stack.pop_back();
+
+        if (ctx == Ctx_Format)
+        {
+            // Parent context holds the key that opened this list
+            scoreFormat(m_currentList == List_Requested ? m_requested : m_formats);
+            m_key.clear();
+        }
+        else if (ctx == Ctx_Thumbnail)
+            ++m_thumbnailIndex;
+
+        return true;
+    }
+
+    bool start_array(std::size_t) override
+    {
+        if (context() == Ctx_Root && m_key == "formats")
+        {
+            m_currentList = List_Formats;
+            m_stack.push_back(Ctx_FormatList);
+        }
+        else if (context() == Ctx_Root && m_key == "requested_formats")
+        {
+            m_currentList = List_Requested;
+            m_stack.push_back(Ctx_FormatList);
+        }
+        else if (context() == Ctx_Root && m_key == "thumbnails")
+            m_stack.push_back(Ctx_Thumbnails);
+        else
+            m_stack.push_back(Ctx_Skip);
+
+        return true;
+    }
+
+    bool end_array() override
+    {
+        m_stack.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& aEx) override
+    {
+        throw std::runtime_error(aEx.what());
+    }
+
+    YoutubeDLResponse finish()
+    {
+        const Format* chosen = nullptr;
+        const FormatList* list = nullptr;
+
+        // Score every format there is, then the ones youtube-dl picked, and
+        // only take its single pick as-is when that's all it printed
+        if (!m_formats.Ranked.empty())
+            list = &m_formats;
+        else if (!m_requested.Ranked.empty())
+            list = &m_requested;
+
+        if (list)
+            chosen = &list->Ranked.front().second;
+        else if (!m_root.Url.empty())
+            chosen = &m_root;
+
+        if (chosen == nullptr)
+            throw std::runtime_error("No usable format found");
+
+        if (chosen->VCodec != "none")
+            Util::Log(Util::Log_Debug) << "[YDL] Falling back to format " << chosen->ACodec << "/" << chosen->VCodec;
+        Util::Log(Util::Log_Debug) << "[YDL] Using format " << chosen->ACodec << "@" << chosen->Abr << " (" << chosen->Ext << ")";
+
+        m_response.Success = true;
+        m_response.Duration = uint32_t(m_duration);
+        if (m_response.ThumbnailUrl.empty())
+            m_response.ThumbnailUrl = std::move(m_thumbnail);
+
+        if (!m_artist.empty())
+            m_response.Artist = std::move(m_artist);
+        else if (!m_creator.empty())
+            m_response.Artist = std::move(m_creator);
+        else
+            m_response.Artist = std::move(m_uploader);
+
+        m_response.Extractor = !m_extractorKey.empty() ? std::move(m_extractorKey) : std::move(m_extractor);
+        m_response.SourceUrl = !m_originalUrl.empty() ? std::move(m_originalUrl) : std::move(m_webpageUrl);
+
+        m_response.DownloadUrl = chosen->Url;
+        m_response.DownloadHeaders = chosen->Headers;
+        if (list)
+            for (auto it = list->Ranked.begin() + 1; it != list->Ranked.end(); ++it)
+                m_response.AlternateFormats.push_back({ std::move(it->second.Url), std::move(it->second.Headers) });
+        m_response.Expiry = YoutubeDLParser::GetExpiry(m_response.DownloadUrl, m_response.Extractor);
+
+        return std::move(m_response);
+    }
+
+private:
+    enum Context
+    {
+        Ctx_Root,
+        Ctx_Skip,
+        Ctx_RootHeaders,
+        Ctx_FormatList,
+        Ctx_Format,
+        Ctx_FormatHeaders,
+        Ctx_FormatOptions,
+        Ctx_Thumbnails,
+        Ctx_Thumbnail,
+    };
+
+    enum ListKind
+    {
+        List_Formats,
+        List_Requested,
+    };
+
+    Context context() const
+    {
+        return m_stack.empty() ? Ctx_Skip : m_stack.back();
+    }
+
+    bool number(double aVal)
+    {
+        auto ctx = context();
+        if (ctx == Ctx_Root && m_key == "duration")
+            m_duration = aVal;
+        else if (ctx == Ctx_Root)
+            formatNumber(m_root, aVal);
+        else if (ctx == Ctx_Format)
+            formatNumber(m_current, aVal);
+        else if (ctx == Ctx_FormatOptions && m_key == "http_chunk_size")
+            m_current.ChunkSize = uint64_t(aVal);
+
+        return true;
+    }
+
+    void formatNumber(Format& aFormat, double aVal)
+    {
+        if (m_key == "abr")
+            aFormat.Abr = aVal;
+        // Audio-only formats often only list their total bitrate
+        else if (m_key == "tbr" && aFormat.Abr == 0)
+            aFormat.Abr = aVal;
+        else if (m_key == "filesize" || (m_key == "filesize_approx" && aFormat.Filesize == 0))
+            aFormat.Filesize = uint64_t(aVal);
+    }
+
+    void formatString(Format& aFormat, string_t& aVal)
+    {
+        if (m_key == "url")
+            aFormat.Url = std::move(aVal);
+        else if (m_key == "acodec")
+            aFormat.ACodec = std::move(aVal);
+        else if (m_key == "vcodec")
+            aFormat.VCodec = std::move(aVal);
+        else if (m_key == "ext")
+            aFormat.Ext = std::move(aVal);
+        else if (m_key == "protocol")
+            aFormat.Protocol = std::move(aVal);
+    }
+
+    void scoreFormat(FormatList& aList)
+    {
+        auto score = m_selector.score(m_current);
+        if (!score.Usable)
+            return;
+
+        // The same stream is often listed more than once
+        auto& ranked = aList.Ranked;
+        for (auto& entry : ranked)
+            if (entry.second.Url == m_current.Url)
+                return;
+
+        auto it = std::find_if(ranked.begin(), ranked.end(), [&score](auto& entry) { return score > entry.first; });
+        if (it == ranked.end() && ranked.size() > m_selector.getAlternates())
+            return;
+
+        ranked.emplace(it, score, std::move(m_current));
+        if (ranked.size() > m_selector.getAlternates() + 1)
+            ranked.pop_back();
+    }
+
+    const FormatSelector& m_selector;
+    std::vector<Context> m_stack;
+    string_t m_key;
+
+    YoutubeDLResponse m_response{ false };
+    double m_duration = 0;
+    std::string m_artist, m_creator, m_uploader;
+    std::string m_extractorKey, m_extractor;
+    std::string m_originalUrl, m_webpageUrl;
+    std::string m_thumbnail;
+    size_t m_thumbnailIndex = 0;
+
+    Format m_root;
+    Format m_current;
+    ListKind m_currentList = List_Formats;
+    FormatList m_formats, m_requested;
+};
+
+}
+
+YoutubeDLResponse YoutubeDLParser::Parse(const std::string& aInfo)
+{
+    return Parse(aInfo, FormatSelector::getSingleton());
+}
+
+YoutubeDLResponse YoutubeDLParser::Parse(const std::string& aInfo, const FormatSelector& aSelector)
+{
+    InfoHandler handler(aSelector);
+    json::sax_parse(aInfo, &handler);
+    return handler.finish();
+}
+
+std::chrono::system_clock::time_point YoutubeDLParser::GetExpiry(const std::string& aUrl, const std::string& aExtractor)
+{
+    auto now = std::chrono::system_clock::now();
+
+    int64_t value;
+    if (findExpiry(aUrl, value))
+    {
+        // Small values are lifetimes rather than timestamps
+        if (value < 1000000000)
+            return now + std::chrono::seconds(value);
+        return std::chrono::system_clock::time_point(std::chrono::seconds(value));
+    }
+
+    auto it = kExtractorLifetimes.find(aExtractor);
+    if (it != kExtractorLifetimes.end())
+        return now + it->second;
+    return now + kDefaultLifetime;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "YoutubeDL.hpp"
+
+#include <string>
+
+class FormatSelector;
+
+class YoutubeDLParser
+{
+public:
+    // Streams a youtube-dl info dict, keeping only the fields that end up in
+    // the response and picking the format as they arrive, by the selector's
+    // preferences (the configured singleton unless given one). Throws on invalid
+    // input or when no usable format is found.
+    static YoutubeDLResponse Parse(const std::string& aInfo);
+    static YoutubeDLResponse Parse(const std::string& aInfo, const FormatSelector& aSelector);
+
+    // Finds when a resolved stream URL expires, from an expiry parameter in
+    // the URL if there is one and the typical lifetime for the extractor
+    // otherwise.
+    static std::chrono::system_clock::time_point GetExpiry(const std::string& aUrl, const std::string& aExtractor);
+};
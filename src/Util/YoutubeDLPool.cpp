@@ -0,0 +1,219 @@
+#include "YoutubeDLPool.hpp"
+#include "Logging.hpp"
+
+#include "../External/json.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <csignal>
+
+YoutubeDLPool::YoutubeDLPool()
+    : m_requestCounter(0)
+    , m_kills(0)
+    , m_restarts(0)
+    , m_running(false)
+{
+}
+
+YoutubeDLPool::~YoutubeDLPool()
+{
+    stop();
+}
+
+void YoutubeDLPool::setWorker(const std::string& aPath)
+{
+    m_workerPath = aPath;
+}
+const std::string& YoutubeDLPool::getWorker() const
+{
+    return m_workerPath;
+}
+
+void YoutubeDLPool::setWorkerCount(uint8_t aCount)
+{
+    if (aCount == 0)
+        aCount = uint8_t(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+    bool running = m_running;
+
+    if (running)
+        stop();
+
+    m_workers.clear();
+    for (uint8_t i = 0; i < aCount; ++i)
+        m_workers.push_back(std::make_unique<Worker>());
+
+    if (running)
+        start();
+}
+uint8_t YoutubeDLPool::getWorkerCount() const
+{
+    return uint8_t(m_workers.size());
+}
+
+bool YoutubeDLPool::start()
+{
+    if (m_workerPath.empty())
+        return false;
+    if (m_workers.empty())
+        setWorkerCount(0);
+
+    std::lock_guard<std::mutex> _lock(m_workerMutex);
+
+    bool any = false;
+    for (auto& worker : m_workers)
+        any = _startWorker(*worker) || any;
+
+    m_running = any;
+    return any;
+}
+
+void YoutubeDLPool::stop()
+{
+    std::unique_lock<std::mutex> _lock(m_workerMutex);
+    m_running = false;
+    m_workerCV.notify_all();
+
+    // Let in-flight requests finish before tearing down their workers
+    m_workerCV.wait(_lock, [this]() {
+        return std::none_of(m_workers.begin(), m_workers.end(), [](auto& worker) { return worker->Busy; });
+    });
+
+    for (auto& worker : m_workers)
+    {
+        worker->Proc.closeStdin();
+        worker->Proc.kill(SIGTERM);
+        worker->Proc.wait();
+    }
+}
+
+std::string YoutubeDLPool::resolve(const std::string& aUrl, const std::string& aFormat, const Util::CancelToken& aToken)
+{
+    Worker* worker = nullptr;
+    uint64_t id;
+    {
+        Util::CancelToken::Subscription wakeup(aToken, [this]() {
+            std::lock_guard<std::mutex> _lock(m_workerMutex);
+            m_workerCV.notify_all();
+        });
+
+        std::unique_lock<std::mutex> _lock(m_workerMutex);
+        auto ready = [this, &aToken]() {
+            return !m_running || aToken.isCancelled() || std::any_of(m_workers.begin(), m_workers.end(), [](auto& worker) { return !worker->Busy; });
+        };
+        if (aToken.hasDeadline())
+            m_workerCV.wait_until(_lock, aToken.getDeadline(), ready);
+        else
+            m_workerCV.wait(_lock, ready);
+
+        if (!m_running)
+            throw std::runtime_error("Resolver pool is not running");
+        if (aToken.stopRequested())
+            throw std::runtime_error("Request stopped while waiting for a resolver worker");
+
+        worker = std::find_if(m_workers.begin(), m_workers.end(), [](auto& worker) { return !worker->Busy; })->get();
+        worker->Busy = true;
+        id = ++m_requestCounter;
+    }
+
+    std::string result;
+    bool ok = _roundTrip(*worker, id, aUrl, aFormat, aToken, result);
+
+    {
+        std::lock_guard<std::mutex> _lock(m_workerMutex);
+        worker->Busy = false;
+    }
+    m_workerCV.notify_all();
+
+    if (!ok)
+        throw std::runtime_error(result);
+
+    return result;
+}
+
+bool YoutubeDLPool::_startWorker(Worker& aWorker)
+{
+    if (aWorker.Proc.running())
+    {
+        aWorker.Proc.kill(SIGKILL);
+        aWorker.Proc.wait();
+    }
+
+    if (!aWorker.Proc.spawn({ m_workerPath }, true))
+    {
+        Util::Log(Util::Log_Error) << "[YDL] Failed to start resolver worker " << m_workerPath;
+        return false;
+    }
+
+    Util::Log(Util::Log_Debug) << "[YDL] Started resolver worker " << int(aWorker.Proc.getPid());
+    return true;
+}
+
+bool YoutubeDLPool::_roundTrip(Worker& aWorker, uint64_t aId, const std::string& aUrl, const std::string& aFormat, const Util::CancelToken& aToken, std::string& aResult)
+{
+    auto request = nlohmann::json{ { "id", aId }, { "url", aUrl }, { "format", aFormat } }.dump() + "\n";
+
+    // A worker that died since its last request gets one fresh restart
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        if (aToken.stopRequested())
+            break;
+
+        if (attempt > 0 || !aWorker.Proc.running())
+        {
+            ++aWorker.Restarts;
+            ++m_restarts;
+            Util::Log(Util::Log_Warning) << "[YDL] Restarting resolver worker (" << aWorker.Restarts << " restarts); " << aWorker.Proc.takeStderr();
+            if (!_startWorker(aWorker))
+                break;
+        }
+
+        // The worker is only reaped once unsubscribed, so the pid stays valid for the callback
+        Util::CancelToken::Subscription killer(aToken, [&aWorker]() { aWorker.Proc.kill(SIGKILL); });
+
+        std::string header;
+        if (!aWorker.Proc.write(request) || !aWorker.Proc.readLine(header, aToken))
+            continue;
+
+        try
+        {
+            auto status = nlohmann::json::parse(header);
+            if (status.value("id", uint64_t(0)) != aId)
+            {
+                // Out of sync with the worker, restart it to be safe
+                Util::Log(Util::Log_Warning) << "[YDL] Resolver worker replied out of order";
+                continue;
+            }
+
+            if (!status.value("ok", false))
+            {
+                aResult = status.value("error", std::string("Unknown resolver error"));
+                return false;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            Util::Log(Util::Log_Warning) << "[YDL] Invalid reply from resolver worker; " << ex.what();
+            continue;
+        }
+
+        if (aWorker.Proc.readLine(aResult, aToken))
+            return true;
+    }
+
+    // Leave the worker dead so the next request restarts it
+    aWorker.Proc.kill(SIGKILL);
+    aWorker.Proc.wait();
+
+    if (aToken.stopRequested())
+    {
+        ++m_kills;
+        aResult = aToken.isCancelled() ? "Resolver request was cancelled" : "Resolver request timed out";
+        return false;
+    }
+
+    aResult = "Resolver worker failed";
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Process.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// Pool of long-lived resolver helpers (see scripts/ydl-worker.py), each
+// keeping youtube_dl/yt_dlp loaded and answering one URL per line.
+class YoutubeDLPool
+{
+public:
+    YoutubeDLPool();
+    YoutubeDLPool(const YoutubeDLPool&) = delete;
+    ~YoutubeDLPool();
+
+    YoutubeDLPool& operator=(const YoutubeDLPool&) = delete;
+
+    void setWorker(const std::string& aPath);
+    const std::string& getWorker() const;
+    void setWorkerCount(uint8_t aCount);
+    uint8_t getWorkerCount() const;
+
+    bool running() const { return m_running; }
+    bool start();
+    void stop();
+
+    // Returns the raw info dict for the given URL, picking by the youtube-dl
+    // format spec aFormat, throws on failure. Stopping aToken mid-request
+    // kills the worker, it's restarted on next use
+    std::string resolve(const std::string& aUrl, const std::string& aFormat, const Util::CancelToken& aToken = {});
+    // Workers killed because their request was cancelled or timed out
+    uint64_t getKills() const { return m_kills; }
+    // Workers started again after dying or being killed
+    uint64_t getRestarts() const { return m_restarts; }
+
+private:
+    struct Worker
+    {
+        Util::Process Proc;
+        bool Busy;
+        uint32_t Restarts;
+
+        Worker()
+            : Busy(false)
+            , Restarts(0)
+        { }
+    };
+
+    bool _startWorker(Worker& aWorker);
+    bool _roundTrip(Worker& aWorker, uint64_t aId, const std::string& aUrl, const std::string& aFormat, const Util::CancelToken& aToken, std::string& aResult);
+
+    std::string m_workerPath;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::mutex m_workerMutex;
+    std::condition_variable m_workerCV;
+    uint64_t m_requestCounter;
+    std::atomic<uint64_t> m_kills;
+    std::atomic<uint64_t> m_restarts;
+    std::atomic<bool> m_running;
+};
@@ -1,6 +1,8 @@
 #include "Server.hpp"
 #include "Util/Logging.hpp"
 
+#include <csignal>
+
 namespace
 {
 
@@ -31,6 +33,9 @@ int main(int argc, const char** argv)
     Util::SetLogger(timeLogger);
     Util::SetLogLevel(Util::Log_Info);
 
+    // Resolver workers may go away under us, handle that as a write error
+    std::signal(SIGPIPE, SIG_IGN);
+
     Server srv;
 
     srv.init(argc, argv);
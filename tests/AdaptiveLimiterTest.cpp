@@ -0,0 +1,77 @@
+#include "Check.hpp"
+#include "Util/AdaptiveLimiter.hpp"
+#include "Util/Logging.hpp"
+
+#include <string>
+#include <vector>
+
+// Waiters for a full key are granted most urgent first, in order within a
+// priority, and can be moved while they wait.
+
+namespace
+{
+
+constexpr const char* kKey = "example";
+
+// Queues a waiter that notes its name once granted, and keeps the slot
+void wait(Util::AdaptiveLimiter& aLimiter, int aPriority, uintptr_t aId, const std::string& aName, std::vector<std::string>& aGranted)
+{
+    CHECK(!aLimiter.acquire(kKey, aPriority, aId, [aName, &aGranted]() { aGranted.push_back(aName); return true; }));
+}
+
+// Frees the slots one by one, each handing on to the next waiter
+void drain(Util::AdaptiveLimiter& aLimiter, size_t aCount)
+{
+    for (size_t i = 0; i < aCount; ++i)
+        aLimiter.release(kKey, Util::AdaptiveLimiter::Outcome_Failed);
+}
+
+void testOrder()
+{
+    Util::AdaptiveLimiter limiter;
+    limiter.setLimits(1, 1);
+    CHECK(limiter.acquire(kKey, 3, 0, []() { return true; }));
+
+    std::vector<std::string> granted;
+    wait(limiter, 3, 0, "background", granted);
+    wait(limiter, 2, 0, "metadata", granted);
+    wait(limiter, 0, 0, "playback", granted);
+    wait(limiter, 2, 0, "metadata 2", granted);
+
+    drain(limiter, 4);
+    CHECK(granted == std::vector<std::string>({ "playback", "metadata", "metadata 2", "background" }));
+}
+
+void testReprioritise()
+{
+    Util::AdaptiveLimiter limiter;
+    limiter.setLimits(1, 1);
+    CHECK(limiter.acquire(kKey, 3, 0, []() { return true; }));
+
+    std::vector<std::string> granted;
+    wait(limiter, 0, 0, "playback", granted);
+    wait(limiter, 2, 1, "metadata", granted);
+    wait(limiter, 3, 2, "background", granted);
+    wait(limiter, 0, 3, "playback 2", granted);
+
+    // Promoted ahead of what was already waiting at its new priority
+    CHECK(limiter.reprioritise(2, 0));
+    CHECK(limiter.reprioritise(3, 3));
+    CHECK(!limiter.reprioritise(4, 0));
+    CHECK(!limiter.reprioritise(0, 0));
+
+    drain(limiter, 4);
+    CHECK(granted == std::vector<std::string>({ "background", "playback", "metadata", "playback 2" }));
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    testOrder();
+    testReprioritise();
+
+    return Check::Result();
+}
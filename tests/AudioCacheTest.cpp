@@ -0,0 +1,163 @@
+#include "Check.hpp"
+#include "Util/AudioCache.hpp"
+#include "Util/Logging.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Which URI playback opens as songs go in and out of the audio cache.
+
+namespace
+{
+
+constexpr const char* kSong = "https://www.youtube.com/watch?v=dQw4w9WgXcQ";
+constexpr const char* kStream = "https://media.example.com/videoplayback?id=1";
+
+bool cacheSong(AudioCache& aCache, const std::string& aUrl, size_t aSize)
+{
+    auto writer = aCache.store(aUrl);
+    if (!writer)
+        return false;
+
+    std::vector<uint8_t> data(aSize, 0x42);
+    if (!writer->write(0, data.data(), data.size()))
+        return false;
+    writer->finish(aSize);
+    return true;
+}
+
+void testMiss(AudioCache& aCache)
+{
+    // Streamed while the cache has nothing, or the song URL if not resolved yet
+    CHECK(aCache.playbackUri(kSong, kStream, false) == kStream);
+    CHECK(aCache.playbackUri(kSong, "", false) == kSong);
+}
+
+void testHit(AudioCache& aCache)
+{
+    CHECK(cacheSong(aCache, kSong, 4096));
+
+    auto cached = aCache.find(kSong);
+    CHECK(!cached.empty());
+    CHECK(aCache.playbackUri(kSong, kStream, false) == "file://" + cached.string());
+    // Cached under the song, so it holds for an expired stream and other forms of the URL
+    CHECK(aCache.playbackUri(kSong, "", false) == "file://" + cached.string());
+    CHECK(aCache.playbackUri("https://youtu.be/dQw4w9WgXcQ", kStream, false) == "file://" + cached.string());
+
+    // Already there, nothing more to store
+    CHECK(aCache.store(kSong) == nullptr);
+}
+
+void testLocal(AudioCache& aCache)
+{
+    constexpr const char* kLocal = "file:///music/song.ogg";
+    CHECK(aCache.playbackUri(kLocal, kLocal, true) == kLocal);
+    CHECK(aCache.playbackUri(kSong, kStream, true) == kStream);
+}
+
+void testPartial(AudioCache& aCache)
+{
+    // A stream that skips around is never cached, and keeps playing from the network
+    constexpr const char* kSkipped = "https://www.youtube.com/watch?v=skipped0000";
+    auto writer = aCache.store(kSkipped);
+    CHECK(writer != nullptr);
+    if (writer)
+    {
+        std::vector<uint8_t> data(1024, 0x42);
+        CHECK(writer->write(0, data.data(), data.size()));
+        CHECK(!writer->write(4096, data.data(), data.size()));
+        writer->finish();
+    }
+    CHECK(aCache.find(kSkipped).empty());
+    CHECK(aCache.playbackUri(kSkipped, kStream, false) == kStream);
+
+    // Nor is one that's dropped before its end
+    constexpr const char* kDropped = "https://www.youtube.com/watch?v=dropped0000";
+    {
+        auto dropped = aCache.store(kDropped);
+        std::vector<uint8_t> data(1024, 0x42);
+        CHECK(dropped && dropped->write(0, data.data(), data.size()));
+    }
+    CHECK(aCache.playbackUri(kDropped, kStream, false) == kStream);
+
+    // Nor one over the limit it was stored with, as prefetches are
+    constexpr const char* kCapped = "https://www.youtube.com/watch?v=capped00000";
+    auto capped = aCache.store(kCapped, 2048);
+    CHECK(capped != nullptr);
+    if (capped)
+    {
+        std::vector<uint8_t> data(1024, 0x42);
+        CHECK(capped->write(0, data.data(), data.size()));
+        CHECK(capped->write(1024, data.data(), data.size()));
+        CHECK(!capped->write(2048, data.data(), data.size()));
+        capped->finish();
+    }
+    CHECK(aCache.find(kCapped).empty());
+
+    // Nor one that ended before the size its server announced
+    constexpr const char* kShort = "https://www.youtube.com/watch?v=short000000";
+    auto cut = aCache.store(kShort);
+    CHECK(cut != nullptr);
+    if (cut)
+    {
+        std::vector<uint8_t> data(1024, 0x42);
+        CHECK(cut->write(0, data.data(), data.size()));
+        cut->finish(4096);
+    }
+    CHECK(aCache.find(kShort).empty());
+    CHECK(aCache.store(kShort) != nullptr);
+}
+
+void testStats(AudioCache& aCache)
+{
+    // Only plays count, not the writers that prefetches and playback ask for
+    auto before = aCache.getStats();
+    CHECK(aCache.store(kSong) == nullptr);
+    CHECK(aCache.store("https://www.youtube.com/watch?v=counted0000") != nullptr);
+    CHECK(aCache.getStats().Misses == before.Misses);
+
+    aCache.miss();
+    CHECK(aCache.use(kSong));
+    auto after = aCache.getStats();
+    CHECK(after.Misses == before.Misses + 1);
+    CHECK(after.Hits == before.Hits + 1);
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    auto dir = std::filesystem::temp_directory_path() / "ydld-audiocache-test";
+    std::filesystem::remove_all(dir);
+
+    {
+        AudioCache cache;
+
+        // Closed, everything streams
+        CHECK(cache.playbackUri(kSong, kStream, false) == kStream);
+        CHECK(cache.store(kSong) == nullptr);
+
+        CHECK(cache.open(dir, 1024 * 1024));
+        testMiss(cache);
+        testHit(cache);
+        testLocal(cache);
+        testPartial(cache);
+        testStats(cache);
+
+        // Still there after a restart
+        CHECK(cache.open(dir, 1024 * 1024));
+        CHECK(cache.playbackUri(kSong, kStream, false) == "file://" + cache.find(kSong).string());
+
+        cache.close();
+        CHECK(cache.playbackUri(kSong, kStream, false) == kStream);
+        auto misses = cache.getStats().Misses;
+        cache.miss();
+        CHECK(cache.getStats().Misses == misses);
+    }
+
+    std::filesystem::remove_all(dir);
+    return Check::Result();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <iostream>
+
+// Minimal assertions for the unit tests, failures are reported and counted
+// rather than aborting, so one run shows everything that's broken.
+
+namespace Check
+{
+
+inline int& Failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline bool Report(bool aPassed, const char* aExpr, const char* aFile, int aLine)
+{
+    if (!aPassed)
+    {
+        std::cerr << aFile << ":" << aLine << ": check failed: " << aExpr << std::endl;
+        ++Failures();
+    }
+    return aPassed;
+}
+
+// Exit code for main
+inline int Result()
+{
+    if (Failures() > 0)
+        std::cerr << Failures() << " checks failed" << std::endl;
+    return Failures() > 0 ? 1 : 0;
+}
+
+}
+
+#define CHECK(expr) Check::Report(bool(expr), #expr, __FILE__, __LINE__)
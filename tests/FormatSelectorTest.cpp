@@ -0,0 +1,190 @@
+#include "Check.hpp"
+#include "Util/FormatSelector.hpp"
+#include "Util/Logging.hpp"
+#include "Util/YoutubeDLParser.hpp"
+#include "External/json.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Format choices on a real info dict, for the preferences the configuration
+// can express.
+//
+// doc/youtube.json offers opus at 50, 70 and 160 kbit/s, vorbis and AAC at
+// 128 kbit/s, video-only formats, and muxed ones with audio.
+
+namespace
+{
+
+constexpr const char* kInfo = "doc/youtube.json";
+
+struct Choice
+{
+    std::string Format;
+    std::vector<std::string> Alternates;
+};
+
+class Formats
+{
+public:
+    explicit Formats(const std::string& aInfo)
+        : m_info(aInfo)
+    {
+        auto doc = nlohmann::json::parse(aInfo);
+        for (auto& format : doc["formats"])
+            m_ids[format["url"].get<std::string>()] = format["format_id"].get<std::string>();
+    }
+
+    Choice choose(const FormatSelector::Options& aOptions) const
+    {
+        auto response = YoutubeDLParser::Parse(m_info, FormatSelector(aOptions));
+
+        Choice choice;
+        choice.Format = id(response.DownloadUrl);
+        for (auto& alternate : response.AlternateFormats)
+            choice.Alternates.push_back(id(alternate.Url));
+        return choice;
+    }
+
+private:
+    std::string id(const std::string& aUrl) const
+    {
+        auto it = m_ids.find(aUrl);
+        return it == m_ids.end() ? "?" : it->second;
+    }
+
+    std::string m_info;
+    std::unordered_map<std::string, std::string> m_ids;
+};
+
+std::string readFile(const std::string& aPath)
+{
+    std::ifstream file(aPath, std::ios::in | std::ios::binary);
+    std::ostringstream oss;
+    oss << file.rdbuf();
+    return oss.str();
+}
+
+void testDefaults(const Formats& aFormats)
+{
+    // The best audio-only stream, with the next best to fail over to
+    auto choice = aFormats.choose({});
+    CHECK(choice.Format == "251");
+    CHECK(choice.Alternates.size() == 2);
+    for (auto& alternate : choice.Alternates)
+        CHECK(alternate == "171" || alternate == "140");
+}
+
+void testPreferences(const Formats& aFormats)
+{
+    FormatSelector::Options options;
+
+    // Codecs match as prefixes, and aac is taken for mp4a
+    options.Codecs = "aac";
+    CHECK(aFormats.choose(options).Format == "140");
+    options.Codecs = "vorbis,opus";
+    CHECK(aFormats.choose(options).Format == "171");
+
+    // Nothing matching falls back to the best there is
+    options.Codecs = "flac";
+    CHECK(aFormats.choose(options).Format == "251");
+
+    options = {};
+    options.Containers = "m4a";
+    CHECK(aFormats.choose(options).Format == "140");
+}
+
+void testCeiling(const Formats& aFormats)
+{
+    FormatSelector::Options options;
+
+    // The best that fits under the ceiling
+    options.MaxBitrate = 100;
+    auto choice = aFormats.choose(options);
+    CHECK(choice.Format == "250");
+    CHECK(!choice.Alternates.empty() && choice.Alternates.front() == "249");
+
+    // A ceiling outranks the preferred codec
+    options.Codecs = "vorbis";
+    CHECK(aFormats.choose(options).Format == "250");
+
+    // With nothing under it, the smallest overshoot
+    options = {};
+    options.MaxBitrate = 10;
+    CHECK(aFormats.choose(options).Format == "249");
+}
+
+void testAlternates(const Formats& aFormats)
+{
+    FormatSelector::Options options;
+    options.Alternates = 0;
+    CHECK(aFormats.choose(options).Alternates.empty());
+
+    options.Alternates = 4;
+    auto choice = aFormats.choose(options);
+    CHECK(choice.Alternates.size() == 4);
+    for (auto& alternate : choice.Alternates)
+        CHECK(alternate != choice.Format);
+}
+
+void testScore()
+{
+    FormatSelector selector;
+
+    FormatSelector::Format audio;
+    audio.Url = "https://example.com/audio";
+    audio.ACodec = "opus";
+    audio.VCodec = "none";
+    audio.Protocol = "https";
+    audio.Abr = 128;
+
+    auto muxed = audio;
+    muxed.VCodec = "avc1";
+    auto manifest = audio;
+    manifest.Protocol = "m3u8_native";
+    auto silent = audio;
+    silent.ACodec = "none";
+
+    CHECK(selector.score(audio) > selector.score(muxed));
+    CHECK(selector.score(audio) > selector.score(manifest));
+    CHECK(!selector.score(silent).Usable);
+
+    auto sized = audio;
+    sized.Filesize = 1024;
+    CHECK(selector.score(sized) > selector.score(audio));
+}
+
+void testFormatSpec()
+{
+    FormatSelector::Options options;
+    CHECK(FormatSelector(options).getFormatSpec() == "bestaudio/best");
+
+    options.Codecs = "aac";
+    options.Containers = "m4a";
+    options.MaxBitrate = 128;
+    CHECK(FormatSelector(options).getFormatSpec() == "bestaudio[acodec^=mp4a][abr<=?128]/bestaudio[ext=m4a][abr<=?128]/bestaudio[abr<=?128]/worstaudio/best");
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    auto info = readFile(kInfo);
+    if (!CHECK(!info.empty()))
+        return Check::Result();
+
+    Formats formats(info);
+    testDefaults(formats);
+    testPreferences(formats);
+    testCeiling(formats);
+    testAlternates(formats);
+    testScore();
+    testFormatSpec();
+
+    return Check::Result();
+}
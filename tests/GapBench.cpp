@@ -0,0 +1,145 @@
+#include "Server.hpp"
+#include "Util/Logging.hpp"
+#include "Wave.hpp"
+
+#include <gstreamermm.h>
+#include <glibmm/main.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Measures the silence between local songs as it's actually rendered, next
+// to the gaps the queue itself records in its transition stats.
+//
+// A synced fakesink stands in for the audio output. Its handoffs mark when
+// each buffer is rendered, and the gap is the time from the end of the last
+// buffer of one song to the first buffer of the next.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kSongLength = std::chrono::seconds(3);
+constexpr auto kTimeout = std::chrono::seconds(30);
+
+struct SinkLog
+{
+    std::mutex Mutex;
+    bool NewStream = true;
+    Clock::time_point LastEnd{};
+    std::vector<std::chrono::nanoseconds> Gaps;
+};
+
+void onHandoff(GstElement* /* aSink */, GstBuffer* aBuffer, GstPad* /* aPad */, gpointer aData)
+{
+    auto* log = static_cast<SinkLog*>(aData);
+    auto now = Clock::now();
+
+    std::lock_guard<std::mutex> _lock(log->Mutex);
+    if (log->NewStream && log->LastEnd != Clock::time_point())
+        log->Gaps.push_back(std::max(now - log->LastEnd, Clock::duration::zero()));
+    log->NewStream = false;
+
+    auto duration = GST_BUFFER_DURATION_IS_VALID(aBuffer) ? std::chrono::nanoseconds(GST_BUFFER_DURATION(aBuffer)) : std::chrono::nanoseconds(0);
+    log->LastEnd = now + std::chrono::duration_cast<Clock::duration>(duration);
+}
+
+GstPadProbeReturn onSinkEvent(GstPad* /* aPad */, GstPadProbeInfo* aInfo, gpointer aData)
+{
+    auto* event = GST_PAD_PROBE_INFO_EVENT(aInfo);
+    if (event && GST_EVENT_TYPE(event) == GST_EVENT_STREAM_START)
+    {
+        auto* log = static_cast<SinkLog*>(aData);
+        std::lock_guard<std::mutex> _lock(log->Mutex);
+        log->NewStream = true;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+bool measure(const std::vector<std::filesystem::path>& aSongs)
+{
+    SinkLog log;
+
+    Server server;
+    auto& queue = server.getQueue();
+    queue.init(server);
+
+    auto sink = Gst::ElementFactory::create_element("fakesink");
+    if (!sink)
+    {
+        std::cerr << "Missing fakesink" << std::endl;
+        return false;
+    }
+    sink->set_property("sync", true);
+    sink->set_property("signal-handoffs", true);
+    g_signal_connect(sink->gobj(), "handoff", G_CALLBACK(onHandoff), &log);
+    gst_pad_add_probe(sink->get_static_pad("sink")->gobj(), GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, onSinkEvent, &log, nullptr);
+    queue.getPipeline()->set_property("audio-sink", sink);
+
+    for (auto& song : aSongs)
+        queue.addSong(song.string());
+
+    // Stands in for the server's tick, until the queue has played out
+    auto loop = Glib::MainLoop::create();
+    auto start = Clock::now();
+    bool started = false;
+    Glib::signal_timeout().connect([&]() {
+        queue.update();
+        started |= queue.getStatus() == PS_Playing;
+        if ((started && queue.getStatus() == PS_Stopped) || Clock::now() - start > kTimeout)
+            loop->quit();
+        return true;
+    }, 100);
+
+    queue.play();
+    loop->run();
+    queue.stop();
+    queue.getPipeline()->set_state(Gst::STATE_NULL);
+
+    auto& stats = queue.getTransitionStats();
+    std::lock_guard<std::mutex> _lock(log.Mutex);
+    std::cout << "rendered gaps:";
+    for (auto& gap : log.Gaps)
+        std::cout << " " << std::chrono::duration<double, std::milli>(gap).count() << " ms";
+    std::cout << std::endl << "queue: " << stats.Gapless << "/" << stats.Transitions << " transitions handed over, "
+        << stats.MaxGap.count() << " ms longest gap" << std::endl;
+
+    // Local songs are always ready in time, so every one of them should be handed over
+    if (log.Gaps.size() != aSongs.size() - 1 || stats.Gapless != aSongs.size() - 1)
+    {
+        std::cerr << "Expected " << aSongs.size() - 1 << " handed over transitions, saw " << log.Gaps.size()
+            << " rendered and " << stats.Gapless << " handed over" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+    Gst::init(argc, argv);
+
+    auto dir = std::filesystem::temp_directory_path() / "ydld-gap";
+    std::filesystem::create_directories(dir);
+
+    std::vector<std::filesystem::path> songs = { dir / "first.wav", dir / "second.wav", dir / "third.wav" };
+    for (size_t i = 0; i < songs.size(); ++i)
+        if (!Wave::Write(songs[i], kSongLength, 440 + 220 * i))
+        {
+            std::cerr << "Failed to write " << songs[i] << std::endl;
+            return 1;
+        }
+
+    bool ok = measure(songs);
+
+    std::filesystem::remove_all(dir);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#include "Util/Logging.hpp"
+#include "Util/YoutubeDLParser.hpp"
+#include "External/json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include <cstdlib>
+
+// Times reading a song out of youtube-dl's info dict, with the streaming
+// parser against building the whole document first and copying formats out
+// of it, the way responses used to be read. Every allocation is counted too,
+// through the global operator new.
+
+namespace
+{
+
+constexpr const char* kInfo = "doc/youtube.json";
+
+std::atomic<uint64_t> s_allocations(0);
+std::atomic<uint64_t> s_allocatedBytes(0);
+
+std::string readFile(const std::string& aPath)
+{
+    std::ifstream file(aPath, std::ios::in | std::ios::binary);
+    std::ostringstream oss;
+    oss << file.rdbuf();
+    return oss.str();
+}
+
+// The old reader, minus its debug logging; copies the format list and every
+// better format it finds, then picks the fields out of the copy
+YoutubeDLResponse parseDocument(const std::string& aInfo)
+{
+    auto data = nlohmann::json::parse(aInfo);
+    if (data["duration"].is_null())
+        data["duration"] = 0;
+
+    if (data["thumbnail"].is_null())
+    {
+        auto thumbnails = data["thumbnails"];
+        if (thumbnails.empty())
+            data["thumbnail"] = "";
+        else
+            data["thumbnail"] = thumbnails.front()["url"];
+    }
+
+    YoutubeDLResponse response;
+    response.Success = true;
+    response.Duration = data["duration"].get<uint32_t>();
+    response.Title = data["title"].get<std::string>();
+    response.ThumbnailUrl = data["thumbnail"].get<std::string>();
+
+    if (data.count("artist") > 0 && !data["artist"].is_null())
+        response.Artist = data["artist"];
+    else if (data.count("creator") > 0 && !data["creator"].is_null())
+        response.Artist = data["creator"];
+    else if (data.count("uploader") > 0 && !data["uploader"].is_null())
+        response.Artist = data["uploader"];
+
+    if (data.count("extractor_key") > 0 && !data["extractor_key"].is_null())
+        response.Extractor = data["extractor_key"];
+    else if (data.count("extractor") > 0 && !data["extractor"].is_null())
+        response.Extractor = data["extractor"];
+
+    if (data.count("original_url") > 0 && !data["original_url"].is_null())
+        response.SourceUrl = data["original_url"];
+    else if (data.count("webpage_url") > 0 && !data["webpage_url"].is_null())
+        response.SourceUrl = data["webpage_url"];
+
+    nlohmann::json chosenFormat = { { "abr", -1.0 } };
+    if (data.count("url") > 0)
+        chosenFormat = data;
+    else
+    {
+        nlohmann::json formats;
+        if (data.count("requested_formats") > 0)
+            formats = data["requested_formats"];
+        else
+            formats = data["formats"];
+
+        for (auto& format : formats)
+        {
+            if (format["acodec"] == "none")
+                continue;
+            if (format["vcodec"] != "none")
+                continue;
+
+            if (format["abr"].is_null())
+                format["abr"] = 1.0;
+
+            if (format["abr"].get<double>() > chosenFormat["abr"].get<double>())
+                chosenFormat = format;
+        }
+
+        if (chosenFormat["url"].is_null())
+        {
+            auto it = std::find_if(formats.begin(), formats.end(), [](auto& format) { return format["acodec"] != "none"; });
+            if (it == formats.end())
+                return {};
+            chosenFormat = *it;
+        }
+    }
+
+    response.DownloadUrl = chosenFormat["url"];
+    response.DownloadHeaders = chosenFormat["http_headers"].get<std::unordered_map<std::string, std::string>>();
+    return response;
+}
+
+struct Result
+{
+    double Micros;
+    double Allocations;
+    double Bytes;
+};
+
+template<typename Func>
+Result timeRuns(const char* aName, size_t aRuns, const std::string& aInfo, Func&& aParse)
+{
+    auto allocations = s_allocations.load();
+    auto bytes = s_allocatedBytes.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < aRuns; ++i)
+        if (!aParse(aInfo).Success)
+        {
+            std::cerr << aName << ": no usable format found" << std::endl;
+            return { -1, 0, 0 };
+        }
+
+    Result result;
+    result.Micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / aRuns;
+    result.Allocations = double(s_allocations - allocations) / aRuns;
+    result.Bytes = double(s_allocatedBytes - bytes) / aRuns;
+    std::cout << aName << ": " << result.Micros << " us, " << result.Allocations << " allocations ("
+        << result.Bytes / 1024 << " KiB) per parse" << std::endl;
+    return result;
+}
+
+}
+
+void* operator new(size_t aSize)
+{
+    ++s_allocations;
+    s_allocatedBytes += aSize;
+    if (auto* ptr = std::malloc(aSize ? aSize : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+// Kept out of line, or GCC takes free() in them for a mismatch with new
+[[gnu::noinline]] void operator delete(void* aPtr) noexcept
+{
+    std::free(aPtr);
+}
+
+[[gnu::noinline]] void operator delete(void* aPtr, size_t /* aSize */) noexcept
+{
+    std::free(aPtr);
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    size_t runs = argc > 1 ? std::stoul(argv[1]) : 2000;
+    auto info = readFile(kInfo);
+    if (info.empty())
+    {
+        std::cerr << "Missing " << kInfo << ", run from the source tree" << std::endl;
+        return 1;
+    }
+
+    std::cout << runs << " parses of " << info.size() << " bytes" << std::endl;
+    auto document = timeRuns("whole document", runs, info, parseDocument);
+    auto streaming = timeRuns("streaming", runs, info, [](auto& aInfo) { return YoutubeDLParser::Parse(aInfo); });
+    if (document.Micros < 0 || streaming.Micros < 0)
+        return 1;
+
+    std::cout << "speedup: " << document.Micros / streaming.Micros << "x, "
+        << document.Allocations / std::max(streaming.Allocations, 1.0) << "x fewer allocations" << std::endl;
+    return 0;
+}
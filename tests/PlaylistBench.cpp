@@ -0,0 +1,86 @@
+#include "Playlist.hpp"
+#include "Util/Logging.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Times the per-tick refresh check and ID lookups on a large queue, with
+// the timer heap and position map against scanning every song, the way
+// refreshes and lookups used to go.
+
+namespace
+{
+
+class BenchPlaylist : public Playlist
+{
+public:
+    // What update() did before the timer heap, minus the refresh itself
+    size_t scanDue()
+    {
+        auto now = std::chrono::system_clock::now();
+        size_t due = 0;
+        for (auto& song : m_songs)
+            if (song.NextUpdateTime <= now)
+                ++due;
+        return due;
+    }
+
+    const Song* findSongID(size_t aID)
+    {
+        bool rebuilt = false;
+        return _findSongID(aID, rebuilt);
+    }
+};
+
+template<typename Func>
+double timeRuns(const char* aName, size_t aRuns, Func&& aRun)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < aRuns; ++i)
+        aRun(i);
+
+    auto took = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / aRuns;
+    std::cout << aName << ": " << took << " us" << std::endl;
+    return took;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    size_t songs = argc > 1 ? std::stoul(argv[1]) : 100000;
+    size_t runs = argc > 2 ? std::stoul(argv[2]) : 1000;
+
+    // Local songs don't resolve, so nothing leaves the process
+    BenchPlaylist playlist;
+    for (size_t i = 0; i < songs; ++i)
+        playlist.addSong("/music/" + std::to_string(i) + ".ogg");
+    std::cout << songs << " songs, " << runs << " runs" << std::endl;
+
+    std::mt19937 rng(42);
+    std::vector<size_t> ids(runs);
+    for (auto& id : ids)
+        id = rng() % songs;
+
+    bool missing = false;
+    timeRuns("tick, full scan", runs, [&](size_t) { playlist.scanDue(); });
+    timeRuns("tick, timer heap", runs, [&](size_t) { playlist.update(); });
+    timeRuns("lookup by ID, scan", runs, [&](size_t i) { missing |= playlist.getSongID(ids[i]) == nullptr; });
+    timeRuns("lookup by ID, map", runs, [&](size_t i) { missing |= playlist.findSongID(ids[i]) == nullptr; });
+
+    // The first lookup after songs move rebuilds the map once
+    playlist.removeSong(size_t(0));
+    timeRuns("lookup by ID, map after a removal", runs, [&](size_t i) { missing |= ids[i] != 0 && playlist.findSongID(ids[i]) == nullptr; });
+
+    if (missing)
+    {
+        std::cerr << "A song wasn't found by its ID" << std::endl;
+        return 1;
+    }
+    return 0;
+}
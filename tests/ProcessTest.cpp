@@ -0,0 +1,61 @@
+#include "Check.hpp"
+#include "Util/CancelToken.hpp"
+#include "Util/Logging.hpp"
+#include "Util/Process.hpp"
+
+#include <chrono>
+
+// Children are killed once their deadline passes, whether they've gone
+// quiet or keep writing.
+
+namespace
+{
+
+using namespace std::chrono_literals;
+
+Util::ProcessResult runFor(const char* aScript, std::chrono::milliseconds aDeadline)
+{
+    auto token = Util::CancelToken::Create();
+    token.setDeadline(Util::CancelToken::Clock::now() + aDeadline);
+
+    Util::Process proc;
+    if (!CHECK(proc.spawn({ "/bin/sh", "-c", aScript })))
+        return {};
+    return proc.communicate(token);
+}
+
+void testQuiet()
+{
+    auto result = runFor("sleep 10", 200ms);
+    CHECK(result.Killed);
+    CHECK(result.Duration < 5s);
+}
+
+void testChatty()
+{
+    auto result = runFor("exec yes chatter", 200ms);
+    CHECK(result.Killed);
+    CHECK(result.Duration < 5s);
+    CHECK(!result.Stdout.empty());
+}
+
+void testFinished()
+{
+    auto result = runFor("echo done", 5000ms);
+    CHECK(!result.Killed);
+    CHECK(result.ExitCode == 0);
+    CHECK(result.Stdout == "done\n");
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    testQuiet();
+    testChatty();
+    testFinished();
+
+    return Check::Result();
+}
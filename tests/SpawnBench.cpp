@@ -0,0 +1,95 @@
+#include "Util/Logging.hpp"
+#include "Util/Process.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+// Times handing youtube-dl's output over, with cat printing a real info dict
+// in its place so only the spawn and the transfer are measured.
+//
+// The shell run is how resolves used to go, through system() with the output
+// redirected into temp files, against spawning directly over pipes.
+
+namespace
+{
+
+constexpr const char* kStub = "/bin/cat";
+constexpr const char* kInfo = "doc/youtube.json";
+
+std::string readFile(const std::filesystem::path& aPath)
+{
+    std::ifstream file(aPath, std::ios::in | std::ios::binary);
+    std::ostringstream oss;
+    oss << file.rdbuf();
+    return oss.str();
+}
+
+bool runShell(std::string& aOut)
+{
+    std::random_device dev;
+    auto id = std::to_string(std::uniform_int_distribution<int>(100000, 999999)(dev));
+    auto outname = std::filesystem::temp_directory_path() / ("ydl_out" + id);
+    auto errname = std::filesystem::temp_directory_path() / ("ydl_err" + id);
+
+    std::string cmd = std::string(kStub) + " " + kInfo + " 1> " + outname.string() + " 2> " + errname.string();
+    int ret = std::system(cmd.c_str());
+    aOut = readFile(ret == 0 ? outname : errname);
+
+    std::filesystem::remove(outname);
+    std::filesystem::remove(errname);
+    return ret == 0;
+}
+
+bool runPipes(std::string& aOut)
+{
+    auto result = Util::Process::Run({ kStub, kInfo });
+    aOut = std::move(result.Stdout);
+    return result.ExitCode == 0;
+}
+
+template<typename Func>
+double timeRuns(const char* aName, size_t aRuns, const std::string& aExpected, Func&& aRun)
+{
+    std::string out;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < aRuns; ++i)
+        if (!aRun(out) || out != aExpected)
+        {
+            std::cerr << aName << ": run " << i << " didn't hand over the info dict" << std::endl;
+            return -1;
+        }
+
+    auto took = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / aRuns;
+    std::cout << aName << ": " << took << " ms per run" << std::endl;
+    return took;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    size_t runs = argc > 1 ? std::stoul(argv[1]) : 200;
+    auto expected = readFile(kInfo);
+    if (expected.empty())
+    {
+        std::cerr << "Missing " << kInfo << ", run from the source tree" << std::endl;
+        return 1;
+    }
+
+    std::cout << runs << " runs, " << expected.size() << " bytes each" << std::endl;
+    auto shell = timeRuns("shell + temp files", runs, expected, runShell);
+    auto pipes = timeRuns("direct over pipes", runs, expected, runPipes);
+    if (shell < 0 || pipes < 0)
+        return 1;
+
+    std::cout << "speedup: " << shell / pipes << "x" << std::endl;
+    return 0;
+}
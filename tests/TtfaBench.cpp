@@ -0,0 +1,188 @@
+#include "Server.hpp"
+#include "Util/AudioCache.hpp"
+#include "Util/Logging.hpp"
+#include "Util/Process.hpp"
+#include "Wave.hpp"
+
+#include <gstreamermm.h>
+#include <glibmm/dispatcher.h>
+#include <glibmm/main.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Times the first audio of songs served from a local HTTP server; streamed
+// with nothing cached, prefetched while the song before it played, and
+// cached by an earlier play of its own.
+//
+// A synced fakesink stands in for the audio output, its first handoff after
+// the song is picked is taken as the first audio heard.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+using Millis = std::chrono::duration<double, std::milli>;
+
+constexpr uint16_t kPort = 18089;
+constexpr auto kSongLength = std::chrono::seconds(4);
+constexpr auto kTimeout = std::chrono::seconds(30);
+
+std::atomic<int64_t> s_firstAudio(0);
+
+void onHandoff(GstElement* /* aSink */, GstBuffer* /* aBuffer */, GstPad* /* aPad */, gpointer /* aData */)
+{
+    int64_t unset = 0;
+    s_firstAudio.compare_exchange_strong(unset, Clock::now().time_since_epoch().count());
+}
+
+bool waitForServer()
+{
+    auto deadline = Clock::now() + std::chrono::seconds(5);
+    while (Clock::now() < deadline)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(kPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        close(fd);
+        if (connected)
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+std::string songUrl(const std::string& aName)
+{
+    return "http://127.0.0.1:" + std::to_string(kPort) + "/" + aName;
+}
+
+// Stands in for the server's tick until aDone holds, false if it never did
+bool runUntil(ActivePlaylist& aQueue, const std::function<bool()>& aDone)
+{
+    auto loop = Glib::MainLoop::create();
+    auto start = Clock::now();
+    bool done = false;
+    auto ticker = Glib::signal_timeout().connect([&]() {
+        aQueue.update();
+        done = aDone();
+        if (done || Clock::now() - start > kTimeout)
+            loop->quit();
+        return true;
+    }, 100);
+
+    loop->run();
+    ticker.disconnect();
+    return done;
+}
+
+// Picks a song the way a client would, returns the time to its first audio
+double timeToAudio(ActivePlaylist& aQueue, size_t aID)
+{
+    s_firstAudio = 0;
+    auto start = Clock::now();
+
+    aQueue.playSongID(aID);
+    if (!runUntil(aQueue, []() { return s_firstAudio != 0; }))
+        return -1;
+    return Millis(Clock::time_point(Clock::duration(s_firstAudio.load())) - start).count();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+    Gst::init(argc, argv);
+
+    auto dir = std::filesystem::temp_directory_path() / "ydld-ttfa";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "www");
+    if (!Wave::Write(dir / "www" / "first.wav", kSongLength) || !Wave::Write(dir / "www" / "second.wav", kSongLength, 660))
+    {
+        std::cerr << "Failed to write the songs" << std::endl;
+        return 1;
+    }
+
+    Util::Process http;
+    if (!http.spawn({ "/usr/bin/env", "python3", "-m", "http.server", std::to_string(kPort), "--bind", "127.0.0.1", "--directory", (dir / "www").string() }) || !waitForServer())
+    {
+        std::cerr << "Failed to start python3 -m http.server" << std::endl;
+        return 1;
+    }
+
+    auto& cache = AudioCache::getSingleton();
+    cache.open(dir / "cache", 64 * 1024 * 1024);
+
+    bool ok = false;
+    {
+        Server server;
+        server.getConfig().setValue("Playback/Prefetch", "1");
+        auto& queue = server.getQueue();
+        queue.init(server);
+
+        // Direct media is probed on a worker, its result comes back through the main loop
+        Glib::Dispatcher resolved;
+        resolved.connect(sigc::ptr_fun(&Playlist::deliverUpdates));
+        Playlist::setUpdateNotifier([&resolved]() { resolved.emit(); });
+
+        auto sink = Gst::ElementFactory::create_element("fakesink");
+        sink->set_property("sync", true);
+        sink->set_property("signal-handoffs", true);
+        g_signal_connect(sink->gobj(), "handoff", G_CALLBACK(onHandoff), nullptr);
+        queue.getPipeline()->set_property("audio-sink", sink);
+
+        auto first = queue.addSong(songUrl("first.wav")).ID;
+        auto second = queue.addSong(songUrl("second.wav")).ID;
+
+        // Nothing cached, so the first song streams
+        auto streamed = timeToAudio(queue, first);
+        // While it plays, the song after it is prefetched
+        bool prefetched = runUntil(queue, [&cache]() { return !cache.find(songUrl("second.wav")).empty(); });
+        auto fromPrefetch = timeToAudio(queue, second);
+
+        // Played to the end, the first song is cached on the way
+        queue.playSongID(first);
+        bool played = runUntil(queue, [&cache]() { return !cache.find(songUrl("first.wav")).empty(); });
+        auto fromPlayed = timeToAudio(queue, first);
+        queue.stop();
+
+        auto& starts = queue.getStartStats();
+        auto& prefetch = queue.getPrefetchStats();
+        std::cout << "first audio streamed: " << streamed << " ms" << std::endl
+            << "first audio prefetched: " << fromPrefetch << " ms" << std::endl
+            << "first audio cached by playing: " << fromPlayed << " ms" << std::endl
+            << "queue: " << starts.Starts << " starts, " << starts.Cached << " from the cache; "
+            << prefetch.Started << " prefetches, " << prefetch.Finished << " finished" << std::endl;
+
+        if (!prefetched)
+            std::cerr << "The second song was never prefetched" << std::endl;
+        if (!played)
+            std::cerr << "Playing the first song didn't cache it" << std::endl;
+        ok = prefetched && played && streamed >= 0 && fromPrefetch >= 0 && fromPlayed >= 0;
+
+        queue.getPipeline()->set_state(Gst::STATE_NULL);
+        Playlist::setUpdateNotifier(nullptr);
+    }
+
+    cache.close();
+    http.kill(SIGTERM);
+    http.wait();
+    std::filesystem::remove_all(dir);
+    return ok ? 0 : 1;
+}
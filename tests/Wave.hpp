@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+// Local audio for the playback harnesses, so they never need the network.
+
+namespace Wave
+{
+
+constexpr uint32_t kRate = 44100;
+constexpr uint16_t kChannels = 2;
+
+// Writes a 16-bit stereo sine of the given length as a WAV file
+inline bool Write(const std::filesystem::path& aPath, std::chrono::milliseconds aLength, double aFrequency = 440)
+{
+    std::ofstream file(aPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    auto put = [&file](uint32_t aValue, size_t aBytes) {
+        for (size_t i = 0; i < aBytes; ++i)
+            file.put(char((aValue >> (i * 8)) & 0xFF));
+    };
+
+    uint32_t frames = uint32_t(uint64_t(kRate) * aLength.count() / 1000);
+    uint32_t dataSize = frames * kChannels * 2;
+
+    file.write("RIFF", 4);
+    put(36 + dataSize, 4);
+    file.write("WAVEfmt ", 8);
+    put(16, 4);
+    put(1, 2);
+    put(kChannels, 2);
+    put(kRate, 4);
+    put(kRate * kChannels * 2, 4);
+    put(kChannels * 2, 2);
+    put(16, 2);
+    file.write("data", 4);
+    put(dataSize, 4);
+
+    constexpr double kTau = 6.283185307179586;
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        auto sample = int16_t(std::sin(kTau * aFrequency * i / kRate) * 8000);
+        for (uint16_t c = 0; c < kChannels; ++c)
+            put(uint16_t(sample), 2);
+    }
+
+    return bool(file);
+}
+
+}
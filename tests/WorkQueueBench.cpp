@@ -0,0 +1,156 @@
+#include "Util/Logging.hpp"
+#include "Util/WorkQueue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Times getting through lots of small tasks, with the pool against a bare
+// locked queue of std::function, to keep the cost of its priority classes
+// and inline task storage in check.
+//
+// Tasks are queued both from outside, like song updates from the main loop,
+// and from within running tasks, like batches handing work back.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+class BareQueue
+{
+public:
+    explicit BareQueue(size_t aCount)
+        : m_running(true)
+    {
+        for (size_t i = 0; i < aCount; ++i)
+            m_threads.emplace_back([this]() { _workThread(); });
+    }
+    ~BareQueue()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(m_mutex);
+            m_running = false;
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    template<typename Ret, typename Func>
+    std::future<Ret> queueTask(Func&& aFunc)
+    {
+        auto promise = std::make_shared<std::promise<Ret>>();
+        auto future = promise->get_future();
+        {
+            std::lock_guard<std::mutex> _lock(m_mutex);
+            m_tasks.push_back([func = std::forward<Func>(aFunc), promise]() { func(); promise->set_value(); });
+        }
+        m_cv.notify_one();
+        return future;
+    }
+
+private:
+    void _workThread()
+    {
+        std::unique_lock<std::mutex> _lock(m_mutex);
+        while (true)
+        {
+            m_cv.wait(_lock, [this]() { return !m_running || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+
+            auto task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            _lock.unlock();
+            task();
+            _lock.lock();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_running;
+};
+
+void waitFor(const std::atomic<size_t>& aDone, size_t aCount)
+{
+    while (aDone.load() < aCount)
+        std::this_thread::yield();
+}
+
+// Many small tasks queued from the outside
+template<typename Queue>
+double runFlat(Queue& aQueue, size_t aTasks)
+{
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    for (size_t i = 0; i < aTasks; ++i)
+        aQueue.template queueTask<void>([&done]() { ++done; });
+    waitFor(done, aTasks);
+
+    return aTasks / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Tasks that each queue a batch of smaller ones
+template<typename Queue>
+double runNested(Queue& aQueue, size_t aParents, size_t aChildren)
+{
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    for (size_t i = 0; i < aParents; ++i)
+        aQueue.template queueTask<void>([&aQueue, &done, aChildren]() {
+            for (size_t j = 0; j < aChildren; ++j)
+                aQueue.template queueTask<void>([&done]() { ++done; });
+        });
+    waitFor(done, aParents * aChildren);
+
+    return aParents * aChildren / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const char* aName, double aBare, double aPool)
+{
+    std::cout << aName << ": bare queue " << size_t(aBare) << " tasks/s, WorkQueue "
+        << size_t(aPool) << " tasks/s (" << aPool / aBare << "x)" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    size_t tasks = argc > 1 ? std::stoul(argv[1]) : 200000;
+    uint8_t workers = uint8_t(std::max(2u, std::min(16u, std::thread::hardware_concurrency())));
+    std::cout << tasks << " tasks on " << int(workers) << " workers" << std::endl;
+
+    double bareFlat, bareNested;
+    {
+        BareQueue queue(workers);
+        bareFlat = runFlat(queue, tasks);
+        bareNested = runNested(queue, tasks / 200, 200);
+    }
+
+    double poolFlat, poolNested;
+    {
+        Util::WorkQueue queue(workers);
+        queue.start();
+        poolFlat = runFlat(queue, tasks);
+        poolNested = runNested(queue, tasks / 200, 200);
+        queue.stop();
+    }
+
+    report("queued from outside", bareFlat, poolFlat);
+    report("queued from tasks", bareNested, poolNested);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "Check.hpp"
+#include "Util/Logging.hpp"
+#include "Util/WorkQueue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Urgent song updates mustn't wait behind a backlog of background ones.
+//
+// Fills the pool with far more background work than it can get through
+// quickly, then times how long playback work, and a background task moved
+// up to playback, wait before they start.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+using Millis = std::chrono::duration<double, std::milli>;
+
+constexpr uint8_t kWorkers = 4;
+constexpr size_t kBacklog = 400;
+constexpr auto kTaskTime = std::chrono::milliseconds(2);
+// Generous, the backlog alone takes well over a second per worker to drain
+constexpr auto kMaxLatency = std::chrono::milliseconds(100);
+
+std::vector<std::future<void>> fillBacklog(Util::WorkQueue& aQueue)
+{
+    std::vector<std::future<void>> backlog;
+    for (size_t i = 0; i < kBacklog; ++i)
+        backlog.push_back(aQueue.queueTask<void>([]() { std::this_thread::sleep_for(kTaskTime); }));
+    return backlog;
+}
+
+Millis timeToStart(Util::WorkQueue& aQueue, Util::WorkQueue::Priority aPriority)
+{
+    auto backlog = fillBacklog(aQueue);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto queued = Clock::now();
+    auto started = aQueue.queuePriorityTask<Clock::time_point>(aPriority, 0, []() { return Clock::now(); }).get();
+
+    for (auto& pending : backlog)
+        pending.wait();
+    return started - queued;
+}
+
+Millis timeToStartReprioritised(Util::WorkQueue& aQueue)
+{
+    auto backlog = fillBacklog(aQueue);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    // Queued last behind everything else, then found to be needed right away
+    constexpr uintptr_t kKey = 1;
+    auto queued = Clock::now();
+    auto task = aQueue.queuePriorityTask<Clock::time_point>(Util::WorkQueue::Priority_Background, kKey, []() { return Clock::now(); });
+    CHECK(aQueue.reprioritise(kKey, Util::WorkQueue::Priority_Playback));
+    auto started = task.get();
+
+    for (auto& pending : backlog)
+        pending.wait();
+    return started - queued;
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    Util::WorkQueue queue(kWorkers);
+    queue.start();
+
+    auto playback = timeToStart(queue, Util::WorkQueue::Priority_Playback);
+    auto prefetch = timeToStart(queue, Util::WorkQueue::Priority_Prefetch);
+    auto moved = timeToStartReprioritised(queue);
+
+    std::cout << "Behind " << kBacklog << " background tasks on " << int(kWorkers) << " workers:" << std::endl
+        << "playback started after " << playback.count() << " ms" << std::endl
+        << "prefetch started after " << prefetch.count() << " ms" << std::endl
+        << "reprioritised started after " << moved.count() << " ms" << std::endl;
+
+    CHECK(playback < kMaxLatency);
+    CHECK(prefetch < kMaxLatency);
+    CHECK(moved < kMaxLatency);
+
+    queue.stop();
+    return Check::Result();
+}
@@ -0,0 +1,89 @@
+#include "Check.hpp"
+#include "Util/CancelToken.hpp"
+#include "Util/Logging.hpp"
+#include "Util/YoutubeDLPool.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include <cstdlib>
+
+// Resolver workers that die mid-request, or get killed for running past
+// their deadline, are started again for the next request.
+//
+// Runs scripts/ydl-worker-stub.py, which needs no youtube-dl or network.
+
+namespace
+{
+
+constexpr const char* kWorker = "scripts/ydl-worker-stub.py";
+constexpr const char* kFormat = "bestaudio/best";
+
+bool resolves(YoutubeDLPool& aPool, const std::string& aUrl, const Util::CancelToken& aToken = {})
+{
+    try
+    {
+        return aPool.resolve(aUrl, kFormat, aToken).find(aUrl) != std::string::npos;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+void testCrash()
+{
+    YoutubeDLPool pool;
+    pool.setWorker(kWorker);
+    pool.setWorkerCount(1);
+    if (!CHECK(pool.start()))
+        return;
+
+    CHECK(resolves(pool, "http://example.com/first"));
+    CHECK(pool.getRestarts() == 0);
+
+    // Dies on the request and again on its one retry
+    CHECK(!resolves(pool, "http://example.com/crash"));
+    CHECK(pool.getRestarts() == 1);
+
+    CHECK(resolves(pool, "http://example.com/second"));
+    CHECK(pool.getRestarts() == 2);
+    CHECK(pool.getKills() == 0);
+
+    pool.stop();
+}
+
+void testKill()
+{
+    setenv("YDLD_STUB_DELAY", "1", 1);
+
+    YoutubeDLPool pool;
+    pool.setWorker(kWorker);
+    pool.setWorkerCount(1);
+    if (!CHECK(pool.start()))
+        return;
+
+    auto token = Util::CancelToken::Create();
+    token.setDeadline(Util::CancelToken::Clock::now() + std::chrono::milliseconds(200));
+    CHECK(!resolves(pool, "http://example.com/slow", token));
+    CHECK(pool.getKills() == 1);
+
+    CHECK(resolves(pool, "http://example.com/after"));
+    CHECK(pool.getRestarts() == 1);
+
+    pool.stop();
+    unsetenv("YDLD_STUB_DELAY");
+}
+
+}
+
+int main()
+{
+    Util::SetLogger(new Util::StdoutLogger);
+
+    testCrash();
+    testKill();
+
+    return Check::Result();
+}